@@ -0,0 +1,52 @@
+#include "arena.h"
+
+#include <algorithm>
+
+namespace ast {
+
+Arena::~Arena() {
+    for (auto it = destructors_.rbegin(); it != destructors_.rend(); ++it)
+        it->destroy(it->object);
+}
+
+size_t Arena::BytesUsed() const {
+    return used_;
+}
+
+size_t Arena::BytesReserved() const {
+    return reserved_;
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+    const auto position = reinterpret_cast<uintptr_t>(position_);
+    size_t padding = (alignment - position % alignment) % alignment;
+
+    if (position_ == nullptr || padding + size > static_cast<size_t>(end_ - position_)) {
+        // Крупный объект получает собственный блок, остаток текущего блока не теряется
+        if (size + alignment > MAX_BLOCK_SIZE) {
+            // Без make_unique: обнулять блок незачем, узлы конструируются поверх
+            blocks_.emplace_back(new std::byte[size + alignment]);
+            reserved_ += size + alignment;
+            std::byte* block = blocks_.back().get();
+            const auto address = reinterpret_cast<uintptr_t>(block);
+            used_ += size;
+            return block + (alignment - address % alignment) % alignment;
+        }
+        while (next_block_size_ < size + alignment)
+            next_block_size_ *= 2;
+        const size_t block_size = next_block_size_;
+        next_block_size_ = std::min(next_block_size_ * 2, MAX_BLOCK_SIZE);
+        blocks_.emplace_back(new std::byte[block_size]);
+        reserved_ += block_size;
+        position_ = blocks_.back().get();
+        end_ = position_ + block_size;
+        padding = (alignment - reinterpret_cast<uintptr_t>(position_) % alignment) % alignment;
+    }
+
+    std::byte* result = position_ + padding;
+    position_ = result + size;
+    used_ += size;
+    return result;
+}
+
+}  // namespace ast
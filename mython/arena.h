@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ast {
+
+// Линейный распределитель узлов дерева программы. Узлы кладутся подряд в крупные блоки,
+// по одному не освобождаются; деструкторы вызываются в обратном порядке при разрушении арены,
+// после чего блоки освобождаются разом
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena();
+
+    template <typename T, typename... Args>
+    T* Make(Args&&... args) {
+        T* object = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            destructors_.push_back({object, [](void* p) {
+                                        static_cast<T*>(p)->~T();
+                                    }});
+        }
+        return object;
+    }
+
+    // Память, занятая объектами, и память, выделенная под блоки
+    [[nodiscard]] size_t BytesUsed() const;
+    [[nodiscard]] size_t BytesReserved() const;
+
+private:
+    void* Allocate(size_t size, size_t alignment);
+
+    struct Destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    // Блоки растут вдвое до MAX_BLOCK_SIZE: у каждого класса своя арена для тел методов,
+    // и маленькому классу хватает одного небольшого блока
+    static constexpr size_t MIN_BLOCK_SIZE = 1 << 10;
+    static constexpr size_t MAX_BLOCK_SIZE = 64 << 10;
+
+    std::vector<std::unique_ptr<std::byte[]>> blocks_;
+    std::byte* position_ = nullptr;
+    std::byte* end_ = nullptr;
+    size_t used_ = 0;
+    size_t reserved_ = 0;
+    size_t next_block_size_ = MIN_BLOCK_SIZE;
+    std::vector<Destructor> destructors_;
+};
+
+// Ссылка на дочерний узел размером в указатель. Узлы из арены ссылкой не владеют;
+// узел, переданный как std::unique_ptr (дерево, собранное вручную), удаляется вместе со ссылкой.
+// Признак владения хранится в младшем бите указателя
+template <typename T>
+class Ptr {
+public:
+    Ptr() = default;
+
+    Ptr(std::nullptr_t) {  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+    }
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    Ptr(U* node)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : bits_(reinterpret_cast<uintptr_t>(static_cast<T*>(node))) {
+    }
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    Ptr(std::unique_ptr<U>&& node)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : bits_(reinterpret_cast<uintptr_t>(static_cast<T*>(node.release()))) {
+        if (bits_ != 0)
+            bits_ |= OWNED;
+    }
+
+    Ptr(Ptr&& other) noexcept
+        : bits_(std::exchange(other.bits_, 0)) {
+    }
+
+    Ptr& operator=(Ptr&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            bits_ = std::exchange(other.bits_, 0);
+        }
+        return *this;
+    }
+
+    ~Ptr() {
+        Reset();
+    }
+
+    [[nodiscard]] T* Get() const {
+        return reinterpret_cast<T*>(bits_ & ~OWNED);
+    }
+
+    T* operator->() const {
+        return Get();
+    }
+
+    T& operator*() const {
+        return *Get();
+    }
+
+    explicit operator bool() const {
+        return bits_ != 0;
+    }
+
+private:
+    void Reset() {
+        if (bits_ & OWNED)
+            delete Get();
+        bits_ = 0;
+    }
+
+    static constexpr uintptr_t OWNED = 1;
+    static_assert(alignof(T) > 1);
+
+    uintptr_t bits_ = 0;
+};
+
+}  // namespace ast
@@ -0,0 +1,428 @@
+#include "bytecode.h"
+#include "closures.h"
+#include "lexer.h"
+#include "parse.h"
+#include "runtime.h"
+#include "scan.h"
+#include "statement.h"
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <malloc.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+// Синтетический скрипт: классы с методами, комментариями и строковыми константами
+string MakeScript(size_t min_size) {
+    string script;
+    script.reserve(min_size + 1024);
+    for (int i = 0; script.size() < min_size; ++i) {
+        const string n = to_string(i);
+        script += "# generated class number "s + n + "\n"s;
+        script += "class Generated"s + n + ":\n"s;
+        script += "  def __init__(first_value, second_value):\n"s;
+        script += "    self.first_value = first_value\n"s;
+        script += "    self.second_value = second_value + "s + n + "\n"s;
+        script += "\n"s;
+        script += "  def describe():\n"s;
+        script += "    if self.first_value >= self.second_value and not self.first_value == 0:\n"s;
+        script += "      return 'first is greater: ' + str(self.first_value)\n"s;
+        script += "    else:\n"s;
+        script += "      return \"second is greater: \" + str(self.second_value)\n"s;
+        script += "\n"s;
+        script += "value"s + n + " = Generated"s + n + "("s + n + ", 42)\n"s;
+        script += "print value"s + n + ".describe()\n"s;
+    }
+    return script;
+}
+
+// Скрипт с длинными блоками комментариев, длинными идентификаторами и строками
+string MakeWideScript(size_t min_size) {
+    const string comment(120, '=');
+    const string long_name = "a_very_long_generated_identifier_name_used_by_code_generators"s;
+    const string long_text(200, 'x');
+
+    string script;
+    script.reserve(min_size + 4096);
+    for (int i = 0; script.size() < min_size; ++i) {
+        const string n = to_string(i);
+        for (int line = 0; line < 8; ++line) {
+            script += "# "s + comment + "\n"s;
+        }
+        script += "class "s + long_name + n + ":\n"s;
+        script += "  def "s + long_name + "_method("s + long_name + "_argument):\n"s;
+        script += "    self."s + long_name + "_field = "s + long_name + "_argument\n"s;
+        script += "    return '"s + long_text + "' + \""s + long_text + "\"\n"s;
+        script += "\n"s;
+    }
+    return script;
+}
+
+size_t CountTokens(parse::Lexer& lexer) {
+    size_t count = 1;
+    while (!lexer.NextToken().Is<parse::token_type::Eof>()) {
+        ++count;
+    }
+    return count;
+}
+
+void Measure(string_view name, size_t bytes, const function<size_t()>& run, string_view unit = "tokens"sv) {
+    const auto start = chrono::steady_clock::now();
+    const size_t count = run();
+    const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    cout << setw(24) << left << name << fixed << setprecision(3) << elapsed.count() << " s, "
+         << setprecision(1) << bytes / elapsed.count() / (1 << 20) << " MB/s, " << count
+         << ' ' << unit << endl;
+}
+
+// Рекурсивная программа: вызовы методов, сравнения и арифметика без вывода в цикле
+string MakeRecursiveProgram(int depth) {
+    return R"(
+class Fib:
+  def calc(n):
+    if n < 2:
+      return n
+    return self.calc(n - 1) + self.calc(n - 2)
+
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def count(n):
+    if n > 0:
+      self.value = self.value + 1
+      self.count(n - 1)
+
+fib = Fib()
+counter = Counter()
+depth = )"s + to_string(depth) + R"(
+counter.count(depth * 20)
+print fib.calc(depth), counter.value
+)"s;
+}
+
+// Упорядочивание тройки объектов с __lt__ и __eq__ в листьях двоичной рекурсии глубины depth
+string MakeComparisonProgram(int depth) {
+    return R"(
+class Key:
+  def __init__(value):
+    self.value = value
+
+  def __lt__(other):
+    return self.value < other.value
+
+  def __eq__(other):
+    return self.value == other.value
+
+class Sorter:
+  def __init__(a, b, c):
+    self.a = a
+    self.b = b
+    self.c = c
+    self.swaps = 0
+
+  def order():
+    if self.a > self.b:
+      t = self.a
+      self.a = self.b
+      self.b = t
+      self.swaps = self.swaps + 1
+    if self.b >= self.c:
+      t = self.b
+      self.b = self.c
+      self.c = t
+      self.swaps = self.swaps + 1
+    if not self.a <= self.b:
+      t = self.a
+      self.a = self.b
+      self.b = t
+      self.swaps = self.swaps + 1
+
+  def run(n):
+    if n > 0:
+      self.run(n - 1)
+      self.run(n - 1)
+    else:
+      self.order()
+      t = self.a
+      self.a = self.c
+      self.c = t
+
+sorter = Sorter(Key(3), Key(1), Key(2))
+sorter.run()"s + to_string(depth) + R"()
+print sorter.swaps
+)"s;
+}
+
+// Узлы верхнего уровня и тел методов, разобранных к этому моменту. Тела методов одного класса
+// делят его арену
+size_t NodeBytes(const ast::Program& program) {
+    size_t bytes = program.GetArena().BytesUsed();
+    for (const auto& holder : program.GetClasses()) {
+        const auto& methods = holder.TryAs<runtime::Class>()->GetMethods();
+        if (methods.empty())
+            continue;
+        const runtime::Executable* body = methods.begin()->second.body.get();
+        if (const auto* lazy = dynamic_cast<const ast::LazyMethodBody*>(body))
+            bytes += lazy->GetArena().BytesUsed();
+        else if (const auto* eager = dynamic_cast<const ast::MethodBody*>(body); eager && eager->GetArena())
+            bytes += eager->GetArena()->BytesUsed();
+    }
+    return bytes;
+}
+
+void BenchmarkParser(size_t size) {
+    const string script = MakeScript(size);
+    cout << "Parser on "sv << script.size() / (1 << 20) << " MB script"sv << endl;
+
+    // Отложенные тела методов не попадают в арену до первого вызова
+    for (bool eager : {true, false}) {
+        ParseOptions options;
+        options.eager_method_bodies = eager;
+        Measure(eager ? "parse eager"sv : "parse lazy"sv, script.size(), [&script, &options] {
+            parse::Lexer lexer(string_view{script});
+            const auto program = ParseProgram(lexer, options);
+            return NodeBytes(dynamic_cast<const ast::Program&>(*program)) >> 10;
+        }, "KB of nodes"sv);
+    }
+}
+
+// Занятая память кучи или 0, если её не узнать
+size_t HeapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// Объект с полями в словаре, как ClassInstance до появления форм
+struct ClosureInstance : runtime::Object {
+    explicit ClosureInstance(const runtime::Class& cls)
+        : cls(cls) {
+    }
+
+    void Print(ostream& os, [[maybe_unused]] runtime::Context& context) override {
+        os << this;
+    }
+
+    const runtime::Class& cls;
+    runtime::Closure fields;
+};
+
+// Память и время на создание объектов с полями x и y
+void BenchmarkInstances(size_t count) {
+    cout << count << " instances with fields x, y"sv << endl;
+
+    const runtime::Class cls("Point"s, {}, nullptr);
+    const runtime::ObjectHolder x = runtime::ObjectHolder::Own(runtime::Number(1));
+    const runtime::ObjectHolder y = runtime::ObjectHolder::Own(runtime::Number(2));
+
+    auto measure = [count](string_view name, const function<runtime::ObjectHolder()>& make) {
+        vector<runtime::ObjectHolder> objects;
+        objects.reserve(count);
+        const size_t heap = HeapInUse();
+        const auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i)
+            objects.push_back(make());
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+        cout << setw(24) << left << name << fixed << setprecision(3) << elapsed.count() << " s, "sv;
+        if (heap != 0)
+            cout << (HeapInUse() - heap) / count << " bytes per instance"sv;
+        cout << endl;
+    };
+
+    measure("closure fields"sv, [&] {
+        auto object = runtime::ObjectHolder::Own(ClosureInstance(cls));
+        auto& fields = object.TryAs<ClosureInstance>()->fields;
+        fields["x"s] = x;
+        fields["y"s] = y;
+        return object;
+    });
+    measure("shape and slots"sv, [&] {
+        auto object = runtime::ObjectHolder::Own(runtime::ClassInstance(cls));
+        auto& fields = object.TryAs<runtime::ClassInstance>()->Fields();
+        fields["x"s] = x;
+        fields["y"s] = y;
+        return object;
+    });
+}
+
+// Чтение o.a.b.c при разном числе полей у объектов и переменных в области видимости
+void BenchmarkFieldAccess(size_t reads) {
+    cout << "Field access o.a.b.c, "sv << reads << " reads"sv << endl;
+
+    const runtime::Class cls("Node"s, {}, nullptr);
+    runtime::DummyContext context;
+    for (size_t object_size : {1, 50, 500}) {
+        for (size_t scope_size : {1, 50, 500}) {
+            runtime::Closure closure;
+            for (size_t i = 0; i < scope_size; ++i) {
+                closure["v"s + to_string(i)] = runtime::ObjectHolder::Own(runtime::Number(static_cast<int>(i)));
+            }
+
+            runtime::ObjectHolder value = runtime::ObjectHolder::Own(runtime::Number(42));
+            for (const char* field : {"c", "b", "a"}) {
+                runtime::ObjectHolder object = runtime::ObjectHolder::Own(runtime::ClassInstance(cls));
+                auto& fields = object.TryAs<runtime::ClassInstance>()->Fields();
+                for (size_t i = 0; i < object_size; ++i) {
+                    fields["f"s + to_string(i)] = runtime::ObjectHolder::None();
+                }
+                fields[field] = value;
+                value = object;
+            }
+            closure["o"s] = value;
+
+            ast::VariableValue path(vector<string>{"o"s, "a"s, "b"s, "c"s});
+            const auto start = chrono::steady_clock::now();
+            size_t found = 0;
+            for (size_t i = 0; i < reads; ++i) {
+                found += static_cast<bool>(path.Execute(closure, context));
+            }
+            const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+            cout << setw(6) << right << object_size << " fields, "sv << setw(4) << scope_size
+                 << " variables: "sv << fixed << setprecision(1) << elapsed.count() / found
+                 << " ns per read"sv << endl;
+        }
+    }
+}
+
+void BenchmarkExecute(string_view title, const string& script) {
+    cout << title << endl;
+
+    parse::Lexer lexer(string_view{script});
+    const auto program = ParseProgram(lexer);
+    const auto& tree = dynamic_cast<const ast::Program&>(*program);
+
+    // Кеш чистых методов выключен, чтобы сравнивались сами вызовы, а не число вызовов
+    auto measure = [](string_view name, const function<void(runtime::Closure&, runtime::Context&)>& run,
+                      bool memoize = false) {
+        const auto start = chrono::steady_clock::now();
+        ostringstream output;
+        runtime::SimpleContext context{output};
+        context.SetMemoizing(memoize);
+        runtime::Closure closure;
+        run(closure, context);
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+        cout << setw(24) << left << name << fixed << setprecision(3) << elapsed.count() << " s, output "sv
+             << output.str();
+    };
+
+    ast::CallSiteCache::ResetTotals();
+    measure("tree-walker"sv, [&program](runtime::Closure& closure, runtime::Context& context) {
+        program->Execute(closure, context);
+    });
+    const auto calls = ast::CallSiteCache::GetTotals();
+    cout << "  call sites: "sv << calls.hits << " hits, "sv << calls.misses << " misses"sv << endl;
+    // Компиляция в байт-код входит в замер
+    measure("bytecode"sv, [&tree](runtime::Closure& closure, runtime::Context& context) {
+        bytecode::Machine machine(tree);
+        machine.Run(closure, context);
+    });
+    measure("closures"sv, [&tree](runtime::Closure& closure, runtime::Context& context) {
+        closures::Engine engine(tree);
+        engine.Run(closure, context);
+    });
+    // Кеш остаётся в методах дерева, поэтому этот замер последний
+    runtime::MethodMemo::ResetTotals();
+    measure("tree-walker memoized"sv, [&program](runtime::Closure& closure, runtime::Context& context) {
+        program->Execute(closure, context);
+    }, true);
+    const auto memo = runtime::MethodMemo::GetTotals();
+    cout << "  pure methods: "sv << memo.hits << " hits, "sv << memo.misses << " misses"sv << endl;
+}
+
+void BenchmarkLexer(size_t size) {
+    const string script = MakeScript(size);
+    cout << "Lexer on "sv << script.size() / (1 << 20) << " MB script"sv << endl;
+
+    Measure("istream"sv, script.size(), [&script] {
+        istringstream input(script);
+        parse::Lexer lexer(input);
+        return CountTokens(lexer);
+    });
+    Measure("string_view"sv, script.size(), [&script] {
+        parse::Lexer lexer(string_view{script});
+        return CountTokens(lexer);
+    });
+}
+
+void BenchmarkScanKernels(size_t size) {
+    const string script = MakeWideScript(size);
+    cout << "Scan kernels on "sv << script.size() / (1 << 20) << " MB script"sv << endl;
+
+    const parse::ScanKernel default_kernel = parse::ActiveScanKernel();
+    for (auto kernel : {parse::ScanKernel::Scalar, parse::ScanKernel::Sse2, parse::ScanKernel::Avx2}) {
+        if (!parse::SetScanKernel(kernel)) {
+            cout << parse::ScanKernelName(kernel) << " is not supported"sv << endl;
+            continue;
+        }
+        Measure(parse::ScanKernelName(kernel), script.size(), [&script] {
+            parse::Lexer lexer(string_view{script});
+            return CountTokens(lexer);
+        });
+    }
+    parse::SetScanKernel(default_kernel);
+}
+
+void BenchmarkParallelLexer(size_t size) {
+    const string script = MakeScript(size);
+    cout << "Parallel lexer on "sv << script.size() / (1 << 20) << " MB script, "sv
+         << thread::hardware_concurrency() << " hardware threads"sv << endl;
+
+    Measure("serial"sv, script.size(), [&script] {
+        parse::Lexer lexer(string_view{script});
+        return lexer.TokenizeAll().Size();
+    });
+    for (size_t threads = 1; threads <= max(thread::hardware_concurrency(), 1U); threads *= 2) {
+        Measure(to_string(threads) + " threads"s, script.size(), [&script, threads] {
+            parse::Lexer lexer(string_view{script});
+            return lexer.TokenizeAllParallel(threads).Size();
+        });
+    }
+}
+
+}  // namespace
+
+// Использование: myton_benchmark [lexer|scan|parallel|parse] [размер скрипта в мегабайтах]
+//                myton_benchmark [execute|compare] [глубина рекурсии]
+//                myton_benchmark fields [число чтений]
+//                myton_benchmark instances [число объектов]
+int main(int argc, char* argv[]) {
+    const string_view suite = argc > 1 ? argv[1] : "lexer"sv;
+    if (suite == "lexer"sv) {
+        BenchmarkLexer((argc > 2 ? stoul(argv[2]) : 16) << 20);
+    } else if (suite == "scan"sv) {
+        BenchmarkScanKernels((argc > 2 ? stoul(argv[2]) : 100) << 20);
+    } else if (suite == "parallel"sv) {
+        BenchmarkParallelLexer((argc > 2 ? stoul(argv[2]) : 256) << 20);
+    } else if (suite == "parse"sv) {
+        BenchmarkParser((argc > 2 ? stoul(argv[2]) : 16) << 20);
+    } else if (suite == "execute"sv) {
+        const int depth = argc > 2 ? stoi(argv[2]) : 25;
+        BenchmarkExecute("Execute recursive program, depth "s + to_string(depth), MakeRecursiveProgram(depth));
+    } else if (suite == "compare"sv) {
+        const int depth = argc > 2 ? stoi(argv[2]) : 14;
+        BenchmarkExecute("Compare class instances, depth "s + to_string(depth), MakeComparisonProgram(depth));
+    } else if (suite == "fields"sv) {
+        BenchmarkFieldAccess(argc > 2 ? stoul(argv[2]) : 1000000);
+    } else if (suite == "instances"sv) {
+        BenchmarkInstances(argc > 2 ? stoul(argv[2]) : 1000000);
+    } else {
+        cerr << "Unknown benchmark "sv << suite << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,1064 @@
+#include "bytecode.h"
+
+#include "purity.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <type_traits>
+#include <typeinfo>
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MYTHON_NO_COMPUTED_GOTO)
+#define MYTHON_COMPUTED_GOTO 1
+#else
+#define MYTHON_COMPUTED_GOTO 0
+#endif
+
+using namespace std;
+
+namespace bytecode {
+
+using runtime::ClassInstance;
+using runtime::Context;
+using runtime::ObjectHolder;
+
+namespace {
+
+const runtime::Symbol ADD_METHOD = "__add__"sv;
+const runtime::Symbol INIT_METHOD = "__init__"sv;
+
+// Номер сравнения в команде Compare — индекс в этой таблице
+const ast::Comparison::Comparator COMPARATORS[] = {
+    runtime::Equal, runtime::NotEqual, runtime::Less, runtime::Greater, runtime::LessOrEqual, runtime::GreaterOrEqual,
+};
+
+const char* const OPCODE_NAMES[] = {
+#define MYTHON_OPCODE_NAME(name) #name,
+    MYTHON_OPCODES(MYTHON_OPCODE_NAME)
+#undef MYTHON_OPCODE_NAME
+};
+
+template <typename T>
+constexpr bool IS_EXPRESSION = std::is_base_of_v<ast::BinaryOperation, T> || std::is_base_of_v<ast::UnaryOperation, T>
+                               || std::is_same_v<T, ast::NumericConst> || std::is_same_v<T, ast::StringConst>
+                               || std::is_same_v<T, ast::BoolConst> || std::is_same_v<T, ast::None>
+                               || std::is_same_v<T, ast::VariableValue> || std::is_same_v<T, ast::MethodCall>
+                               || std::is_same_v<T, ast::NewInstance>;
+
+class Compiler {
+public:
+    explicit Compiler(Function& function) : function_(function) {
+    }
+
+    void Statement(const ast::Statement& node) {
+        ast::VisitNode(node, [this](const auto& n) {
+            if constexpr (IS_EXPRESSION<std::decay_t<decltype(n)>>) {
+                CompileExpression(n);
+                Emit(Op::Pop, -1);
+            } else {
+                CompileStatement(n);
+            }
+        });
+    }
+
+    void Expression(const ast::Statement& node) {
+        ast::VisitNode(node, [this](const auto& n) {
+            using T = std::decay_t<decltype(n)>;
+            if constexpr (IS_EXPRESSION<T>) {
+                CompileExpression(n);
+            } else if constexpr (std::is_same_v<T, ast::Assignment>) {
+                CompileStatement(n);
+                Emit(Op::LoadSlot, 1, n.GetSlot());
+            } else {
+                CompileStatement(n);
+                Emit(Op::PushNone, 1);
+            }
+        });
+    }
+
+    // Выход из тела без return возвращает None
+    void Finish() {
+        Emit(Op::PushNone, 1);
+        Emit(Op::Return, -1);
+    }
+
+private:
+    size_t Emit(Op op, int stack_effect, uint32_t arg = 0, size_t count = 0) {
+        if (count > std::numeric_limits<uint16_t>::max())
+            throw CompileError("Too many operands"s);
+        function_.code.push_back({op, static_cast<uint16_t>(count), arg});
+        depth_ += stack_effect;
+        function_.max_stack = std::max(function_.max_stack, static_cast<uint32_t>(depth_));
+        return function_.code.size() - 1;
+    }
+
+    // Направляет ранее записанный переход на следующую команду
+    void Patch(size_t jump) {
+        function_.code[jump].arg = static_cast<uint32_t>(function_.code.size());
+    }
+
+    uint32_t Constant(Value value) {
+        function_.constants.push_back(std::move(value));
+        return static_cast<uint32_t>(function_.constants.size() - 1);
+    }
+
+    uint32_t SymbolIndex(runtime::Symbol symbol) {
+        auto& symbols = function_.symbols;
+        const auto it = std::find(symbols.begin(), symbols.end(), symbol);
+        if (it != symbols.end())
+            return static_cast<uint32_t>(it - symbols.begin());
+        symbols.push_back(symbol);
+        return static_cast<uint32_t>(symbols.size() - 1);
+    }
+
+    // Номер нового кеша поля; больше 65536 на функцию Emit не пропустит
+    size_t FieldCacheIndex() {
+        function_.field_caches.emplace_back();
+        return function_.field_caches.size() - 1;
+    }
+
+    uint32_t Slot(uint32_t slot) const {
+        if (slot == ast::NO_SLOT || slot >= function_.frame_size)
+            throw CompileError("Variable without a frame slot"s);
+        return slot;
+    }
+
+    void Arguments(const ast::StatementList& args) {
+        for (const auto& arg : args)
+            Expression(*arg);
+    }
+
+    void CompileExpression(const ast::NumericConst& node) {
+        Emit(Op::PushConst, 1, Constant(Value::OfNumber(node.GetValue().GetValue())));
+    }
+
+    void CompileExpression(const ast::StringConst& node) {
+        Emit(Op::PushConst, 1, Constant(Value::FromHolder(ObjectHolder::Own(runtime::String(node.GetValue())))));
+    }
+
+    void CompileExpression(const ast::BoolConst& node) {
+        Emit(node.GetValue().GetValue() ? Op::PushTrue : Op::PushFalse, 1);
+    }
+
+    void CompileExpression(const ast::None& /*node*/) {
+        Emit(Op::PushNone, 1);
+    }
+
+    void CompileExpression(const ast::VariableValue& node) {
+        const auto& ids = node.GetDottedIds();
+        Emit(Op::LoadSlot, 1, Slot(node.GetSlot()));
+        for (auto id = std::next(ids.begin()); id != ids.end(); ++id)
+            Emit(Op::LoadField, 0, SymbolIndex(*id), FieldCacheIndex());
+    }
+
+    void CompileExpression(const ast::MethodCall& node) {
+        Expression(node.GetObject());
+        Arguments(node.GetArgs());
+        const auto count = node.GetArgs().size();
+        Emit(Op::CallMethod, -static_cast<int>(count), SymbolIndex(node.GetMethod()), count);
+    }
+
+    // Как и при обходе дерева, без подходящего __init__ аргументы не вычисляются
+    void CompileExpression(const ast::NewInstance& node) {
+        const runtime::Class& cls = node.GetClass();
+        const runtime::Method* init = cls.GetMethod(INIT_METHOD);
+        const auto count = node.GetArgs().size();
+        if (init == nullptr || init->formal_params.size() != count) {
+            function_.new_sites.push_back({&cls, nullptr});
+            Emit(Op::NewInstance, 1, static_cast<uint32_t>(function_.new_sites.size() - 1));
+            return;
+        }
+        // Аргументы сами могут создавать объекты, поэтому номер места запоминается до них
+        const auto site = static_cast<uint32_t>(function_.new_sites.size());
+        function_.new_sites.push_back({&cls, init});
+        Arguments(node.GetArgs());
+        Emit(Op::NewInstance, 1 - static_cast<int>(count), site, count);
+    }
+
+    void CompileExpression(const ast::Stringify& node) {
+        Expression(node.GetArgument());
+        Emit(Op::Stringify, 0);
+    }
+
+    void CompileExpression(const ast::Not& node) {
+        Expression(node.GetArgument());
+        Emit(Op::Not, 0);
+    }
+
+    void CompileExpression(const ast::Negate& node) {
+        Expression(node.GetArgument());
+        Emit(Op::Negate, 0);
+    }
+
+    void Binary(const ast::BinaryOperation& node, Op op) {
+        Expression(node.GetLhs());
+        Expression(node.GetRhs());
+        Emit(op, -1);
+    }
+
+    void CompileExpression(const ast::Add& node) {
+        Binary(node, Op::Add);
+    }
+
+    void CompileExpression(const ast::Sub& node) {
+        Binary(node, Op::Sub);
+    }
+
+    void CompileExpression(const ast::Mult& node) {
+        Binary(node, Op::Mult);
+    }
+
+    void CompileExpression(const ast::Div& node) {
+        Binary(node, Op::Div);
+    }
+
+    void CompileExpression(const ast::Comparison& node) {
+        const auto it = std::find(std::begin(COMPARATORS), std::end(COMPARATORS), node.GetComparator());
+        if (it == std::end(COMPARATORS))
+            throw CompileError("Unknown comparison"s);
+        Expression(node.GetLhs());
+        Expression(node.GetRhs());
+        Emit(Op::Compare, -1, 0, static_cast<size_t>(it - std::begin(COMPARATORS)));
+    }
+
+    // Or и And вычисляют правый операнд, только если левый не решил результат
+    void ShortCircuit(const ast::BinaryOperation& node, Op jump, Op decided) {
+        Expression(node.GetLhs());
+        const size_t to_decided = Emit(jump, -1);
+        Expression(node.GetRhs());
+        Emit(Op::ToBool, 0);
+        const size_t to_end = Emit(Op::Jump, 0);
+        Patch(to_decided);
+        --depth_;
+        Emit(decided, 1);
+        Patch(to_end);
+    }
+
+    void CompileExpression(const ast::Or& node) {
+        ShortCircuit(node, Op::JumpIfTrue, Op::PushTrue);
+    }
+
+    void CompileExpression(const ast::And& node) {
+        ShortCircuit(node, Op::JumpIfFalse, Op::PushFalse);
+    }
+
+    void CompileStatement(const ast::Assignment& node) {
+        Expression(node.GetValue());
+        Emit(Op::StoreSlot, -1, Slot(node.GetSlot()));
+    }
+
+    void CompileStatement(const ast::FieldAssignment& node) {
+        CompileExpression(node.GetObject());
+        Expression(node.GetValue());
+        Emit(Op::StoreField, -2, SymbolIndex(node.GetFieldName()), FieldCacheIndex());
+    }
+
+    void CompileStatement(const ast::Print& node) {
+        if (node.GetVariable() != nullptr)
+            throw CompileError("Print::Variable reads a closure"s);
+        Arguments(node.GetArgs());
+        const auto count = node.GetArgs().size();
+        Emit(Op::Print, -static_cast<int>(count), 0, count);
+    }
+
+    void CompileStatement(const ast::Compound& node) {
+        for (const auto& statement : node.GetStatements())
+            Statement(*statement);
+    }
+
+    void CompileStatement(const ast::IfElse& node) {
+        Expression(node.GetCondition());
+        const size_t to_else = Emit(Op::JumpIfFalse, -1);
+        Statement(node.GetIfBody());
+        if (node.GetElseBody() == nullptr) {
+            Patch(to_else);
+            return;
+        }
+        const size_t to_end = Emit(Op::Jump, 0);
+        Patch(to_else);
+        Statement(*node.GetElseBody());
+        Patch(to_end);
+    }
+
+    // return вызова метода компилируется в TailCall: в методе он занимает фрейм вызывающего,
+    // а на верхнем уровне работает как CallMethod, и тогда значение возвращает следующий Return
+    void CompileStatement(const ast::Return& node) {
+        if (node.IsTailCall()) {
+            const auto& call = static_cast<const ast::MethodCall&>(node.GetStatement());
+            Expression(call.GetObject());
+            Arguments(call.GetArgs());
+            const auto count = call.GetArgs().size();
+            Emit(Op::TailCall, -static_cast<int>(count), SymbolIndex(call.GetMethod()), count);
+        } else {
+            Expression(node.GetStatement());
+        }
+        Emit(Op::Return, -1);
+    }
+
+    void CompileStatement(const ast::ClassDefinition& node) {
+        Emit(Op::PushConst, 1, Constant(Value::FromHolder(node.GetClass())));
+        Emit(Op::StoreSlot, -1, Slot(node.GetSlot()));
+    }
+
+    void CompileStatement(const ast::Statement& node) {
+        throw CompileError("Node "s + typeid(node).name() + " cannot be compiled"s);
+    }
+
+    Function& function_;
+    int depth_ = 0;
+};
+
+template <typename T>
+bool CompareWith(uint16_t comparator, const T& lhs, const T& rhs) {
+    switch (comparator) {
+        case 0:
+            return lhs == rhs;
+        case 1:
+            return lhs != rhs;
+        case 2:
+            return lhs < rhs;
+        case 3:
+            return lhs > rhs;
+        case 4:
+            return lhs <= rhs;
+        default:
+            return lhs >= rhs;
+    }
+}
+
+// Числа, строки и логические значения сравниваются на месте, остальное — через runtime
+bool CompareValues(uint16_t comparator, const Value& lhs, const Value& rhs, Context& context) {
+    if (lhs.GetKind() == rhs.GetKind()) {
+        if (lhs.GetKind() == Value::Kind::Number)
+            return CompareWith(comparator, lhs.AsNumber(), rhs.AsNumber());
+        if (lhs.GetKind() == Value::Kind::Bool)
+            return CompareWith(comparator, lhs.AsBool(), rhs.AsBool());
+        if (const auto* l = lhs.TryAs<runtime::String>())
+            if (const auto* r = rhs.TryAs<runtime::String>())
+                return CompareWith(comparator, l->GetValue(), r->GetValue());
+    }
+    return COMPARATORS[comparator](lhs.ToHolder(), rhs.ToHolder(), context);
+}
+
+[[noreturn]] void ThrowUndefined() {
+    throw std::runtime_error("not definition var"s);
+}
+
+// Метод объекта receiver, который вызывается с count аргументами
+const runtime::Method& MethodOf(const Value& receiver, runtime::Symbol name, size_t count) {
+    const auto* instance = receiver.TryAs<ClassInstance>();
+    const runtime::Method* method = instance != nullptr ? instance->GetClass().GetMethod(name) : nullptr;
+    if (method == nullptr || method->formal_params.size() != count)
+        throw std::runtime_error("method not found"s);
+    return *method;
+}
+
+}  // namespace
+
+Value Value::OfNone() {
+    Value value;
+    value.kind_ = Kind::None;
+    return value;
+}
+
+Value Value::OfBool(bool value) {
+    Value result;
+    result.kind_ = Kind::Bool;
+    result.number_ = value;
+    return result;
+}
+
+Value Value::OfNumber(int value) {
+    Value result;
+    result.kind_ = Kind::Number;
+    result.number_ = value;
+    return result;
+}
+
+Value Value::FromHolder(ObjectHolder holder) {
+    runtime::Object* object = holder.Get();
+    if (object == nullptr)
+        return OfNone();
+    // Точное сравнение типов дешевле dynamic_cast, а наследников у Number и Bool нет
+    const std::type_info& type = typeid(*object);
+    if (type == typeid(runtime::Number))
+        return OfNumber(static_cast<runtime::Number*>(object)->GetValue());
+    if (type == typeid(runtime::Bool))
+        return OfBool(static_cast<runtime::Bool*>(object)->GetValue());
+
+    Value result;
+    result.kind_ = Kind::Object;
+    result.object_ = std::move(holder);
+    return result;
+}
+
+ObjectHolder Value::ToHolder() const {
+    switch (kind_) {
+        case Kind::Bool:
+            return runtime::Bool::Of(AsBool());
+        case Kind::Number:
+            return ObjectHolder::Own(runtime::Number(number_));
+        case Kind::Object:
+            return object_;
+        default:
+            return ObjectHolder::None();
+    }
+}
+
+bool Value::IsTrue() const {
+    switch (kind_) {
+        case Kind::Bool:
+        case Kind::Number:
+            return number_ != 0;
+        case Kind::Object:
+            return runtime::IsTrue(object_);
+        default:
+            return false;
+    }
+}
+
+bool Value::AddToKey(runtime::MethodMemo::Key& key) const {
+    switch (kind_) {
+        case Kind::None:
+            key.AddNone();
+            return true;
+        case Kind::Bool:
+            key.AddBool(AsBool());
+            return true;
+        case Kind::Number:
+            key.AddNumber(number_);
+            return true;
+        case Kind::Object:
+            return key.Add(object_);
+        default:
+            return false;
+    }
+}
+
+void Value::Print(ostream& os, Context& context) const {
+    switch (kind_) {
+        case Kind::Bool:
+            os << (AsBool() ? "True"sv : "False"sv);
+            break;
+        case Kind::Number:
+            os << number_;
+            break;
+        case Kind::Object:
+            object_->Print(os, context);
+            break;
+        default:
+            os << "None"sv;
+    }
+}
+
+Function Compile(const ast::Statement& body, size_t frame_size) {
+    Function function;
+    function.frame_size = static_cast<uint32_t>(frame_size);
+    Compiler compiler(function);
+    compiler.Statement(body);
+    compiler.Finish();
+    return function;
+}
+
+std::string Disassemble(const Function& function) {
+    std::ostringstream out;
+    for (size_t i = 0; i < function.code.size(); ++i) {
+        const Instruction& instruction = function.code[i];
+        out << std::setw(4) << i << ' ' << OPCODE_NAMES[static_cast<size_t>(instruction.op)];
+        switch (instruction.op) {
+            case Op::LoadField:
+            case Op::StoreField:
+                out << ' ' << function.symbols[instruction.arg];
+                break;
+            case Op::CallMethod:
+            case Op::TailCall:
+                out << ' ' << function.symbols[instruction.arg] << ' ' << instruction.count;
+                break;
+            case Op::NewInstance:
+                out << ' ' << function.new_sites[instruction.arg].cls->GetName() << ' ' << instruction.count;
+                break;
+            case Op::Print:
+            case Op::Compare:
+                out << ' ' << instruction.count;
+                break;
+            case Op::PushConst:
+            case Op::LoadSlot:
+            case Op::StoreSlot:
+            case Op::Jump:
+            case Op::JumpIfFalse:
+            case Op::JumpIfTrue:
+                out << ' ' << instruction.arg;
+                break;
+            default:
+                break;
+        }
+        out << '\n';
+    }
+    return out.str();
+}
+
+// Стек значений из сегментов, которые не перемещаются: окна фреймов остаются на месте,
+// пока вложенные вызовы занимают новые сегменты
+class Machine::ValueStack {
+public:
+    class Window {
+    public:
+        Window(ValueStack& stack, size_t size)
+            : stack_(stack), data_(stack.Acquire(size)), size_(size) {
+        }
+
+        Window(const Window&) = delete;
+        Window& operator=(const Window&) = delete;
+
+        ~Window() {
+            stack_.Release(data_, size_);
+        }
+
+        [[nodiscard]] Value* Data() const {
+            return data_;
+        }
+
+    private:
+        ValueStack& stack_;
+        Value* data_;
+        size_t size_;
+    };
+
+    Value* Acquire(size_t size) {
+        if (segments_.empty() || segments_[current_].size - segments_[current_].used < size) {
+            if (!segments_.empty())
+                ++current_;
+            if (current_ == segments_.size())
+                segments_.emplace_back();
+            Segment& next = segments_[current_];
+            // Сегменты за текущим свободны, слишком маленький заменяется
+            if (next.size < size) {
+                next.size = std::max(SEGMENT_SIZE, size);
+                next.values = std::make_unique<Value[]>(next.size);
+            }
+        }
+        Segment& segment = segments_[current_];
+        Value* result = segment.values.get() + segment.used;
+        segment.used += size;
+        return result;
+    }
+
+    // Окна освобождаются в обратном порядке; значения сбрасываются, чтобы отпустить объекты
+    void Release(Value* data, size_t size) {
+        std::fill(data, data + size, Value());
+        Segment& segment = segments_[current_];
+        segment.used -= size;
+        if (segment.used == 0 && current_ > 0)
+            --current_;
+    }
+
+private:
+    struct Segment {
+        std::unique_ptr<Value[]> values;
+        size_t size = 0;
+        size_t used = 0;
+    };
+
+    static constexpr size_t SEGMENT_SIZE = 1 << 14;
+
+    std::vector<Segment> segments_;
+    size_t current_ = 0;
+};
+
+Machine::Machine(const ast::Program& program)
+    : program_(program),
+      main_(Compile(program.GetBody(), program.GetGlobals().size())),
+      stack_(std::make_unique<ValueStack>()) {
+}
+
+Machine::~Machine() = default;
+
+ObjectHolder Machine::Run(runtime::Closure& closure, Context& context) {
+    const auto& globals = program_.GetGlobals();
+    ValueStack::Window window(*stack_, main_.frame_size + main_.max_stack);
+    Value* slots = window.Data();
+    for (uint32_t slot = 0; slot < globals.size(); ++slot)
+        if (auto it = closure.find(globals[slot]); it != closure.end())
+            slots[slot] = Value::FromHolder(it->second);
+
+    auto publish = [&] {
+        for (uint32_t slot = 0; slot < globals.size(); ++slot)
+            if (slots[slot].GetKind() != Value::Kind::Unbound)
+                closure[globals[slot]] = slots[slot].ToHolder();
+    };
+
+    try {
+        Invoke(main_, slots, context);
+    } catch (...) {
+        publish();
+        throw;
+    }
+    publish();
+    return ObjectHolder::None();
+}
+
+const Function* Machine::FunctionFor(const runtime::Method& method) {
+    if (auto it = methods_.find(&method); it != methods_.end())
+        return it->second.get();
+
+    // Отложенное тело разбирается здесь; ошибка разбора не запоминается, как и при обходе дерева
+    const runtime::Executable* body = method.body.get();
+    if (auto* lazy = dynamic_cast<ast::LazyMethodBody*>(method.body.get()))
+        body = &lazy->GetBody();
+
+    std::unique_ptr<Function> function;
+    if (const auto* method_body = dynamic_cast<const ast::MethodBody*>(body); method_body && method.frame_size > 0) {
+        try {
+            function = std::make_unique<Function>(Compile(method_body->GetBody(), method.frame_size));
+        } catch (const CompileError&) {
+        }
+    }
+    return methods_.emplace(&method, std::move(function)).first->second.get();
+}
+
+Value Machine::CallTreeWalker(const Value& self, const runtime::Method& method, Value* args, Context& context) {
+    const size_t count = method.formal_params.size();
+    std::vector<ObjectHolder> actual_args;
+    actual_args.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        actual_args.push_back(args[i].ToHolder());
+    return Value::FromHolder(self.TryAs<ClassInstance>()->Call(method, actual_args, context));
+}
+
+// Вызов, который ждёт возврата из скомпилированного метода: состояние вызывающей функции
+// и окно вызванной в стеке значений
+struct Machine::CallFrame {
+    const Function* function;
+    // Команда вызова
+    const Instruction* ip;
+    Value* locals;
+    Value* sp;
+    Value* window = nullptr;
+    size_t window_size = 0;
+    // Число значений вызова на стеке вызывающей функции
+    uint16_t drop;
+    // Объект, созданный NewInstance: он, а не результат __init__, становится значением вызова
+    Value object;
+    // Кеш чистого метода, в который записывается результат; ключ — в CallStack
+    runtime::MethodMemo* memo = nullptr;
+};
+
+// Ожидающие вызовы одного Invoke в куче, поэтому вызовы между методами байт-кода не расходуют
+// стек C++. Глубина засчитывается в контекст; при исключении окна освобождаются в обратном порядке
+class Machine::CallStack {
+public:
+    CallStack(ValueStack& values, Context& context) : values_(values), context_(context) {
+    }
+
+    CallStack(const CallStack&) = delete;
+    CallStack& operator=(const CallStack&) = delete;
+
+    ~CallStack() {
+        while (!frames_.empty())
+            Pop();
+    }
+
+    [[nodiscard]] bool Empty() const {
+        return frames_.empty();
+    }
+
+    // Занимает окно вызываемой функции; RecursionError, если превышен предел глубины
+    Value* Push(CallFrame frame, const Function& callee) {
+        context_.EnterCall();
+        frame.window_size = callee.frame_size + callee.max_stack;
+        frame.window = values_.Acquire(frame.window_size);
+        return frames_.emplace_back(std::move(frame)).window;
+    }
+
+    // Отдаёт окно последнего вызова функции callee для хвостового вызова: в начало окна переносятся
+    // count значений из values (объект и аргументы, они лежат выше начала окна), остальные
+    // отпускаются. Окно, в которое callee не помещается, заменяется. Глубина не меняется
+    Value* Replace(const Function& callee, Value* values, size_t count) {
+        CallFrame& frame = frames_.back();
+        const size_t size = callee.frame_size + callee.max_stack;
+        if (size > frame.window_size) {
+            std::vector<Value> moved(std::make_move_iterator(values), std::make_move_iterator(values + count));
+            values_.Release(frame.window, frame.window_size);
+            frame.window_size = size;
+            frame.window = values_.Acquire(size);
+            std::move(moved.begin(), moved.end(), frame.window);
+            return frame.window;
+        }
+        std::move(values, values + count, frame.window);
+        std::fill(frame.window + count, frame.window + frame.window_size, Value());
+        return frame.window;
+    }
+
+    // Последний вызов: состояние вызывающей функции
+    [[nodiscard]] CallFrame& Top() {
+        return frames_.back();
+    }
+
+    // Ключи мемоизации вызовов, у которых CallFrame::memo задан, в том же порядке
+    void PushMemoKey(runtime::MethodMemo::Key key) {
+        memo_keys_.push_back(std::move(key));
+    }
+
+    runtime::MethodMemo::Key PopMemoKey() {
+        runtime::MethodMemo::Key key = std::move(memo_keys_.back());
+        memo_keys_.pop_back();
+        return key;
+    }
+
+    // Освобождает окно вызванной функции
+    void Pop() {
+        CallFrame& frame = frames_.back();
+        values_.Release(frame.window, frame.window_size);
+        frames_.pop_back();
+        context_.LeaveCall();
+    }
+
+private:
+    ValueStack& values_;
+    Context& context_;
+    std::vector<CallFrame> frames_;
+    std::vector<runtime::MethodMemo::Key> memo_keys_;
+};
+
+Value Machine::Invoke(const Function& entry, Value* locals, Context& context) {
+    const Function* function = &entry;
+    const Instruction* code = function->code.data();
+    const Instruction* ip = code;
+    Value* sp = locals + function->frame_size;
+    CallStack calls(*stack_, context);
+
+    // Снимает со стека n значений, отпуская объекты
+    auto drop = [&sp](size_t n) {
+        for (; n > 0; --n)
+            *--sp = Value();
+    };
+
+    // Кладёт значение вызова вместо его аргументов и переходит к следующей команде
+    auto finish_call = [&](uint16_t count, Value object, Value result) {
+        drop(count);
+        *sp++ = object.GetKind() != Value::Kind::Unbound ? std::move(object) : std::move(result);
+        ++ip;
+    };
+
+    // Вызов метода командой ip. Скомпилированное тело начинает выполняться в новом окне, остальные
+    // выполняются обходом дерева и сразу дают значение, как и запомненный вызов чистого метода.
+    // args — аргументы на стеке, count — сколько значений вызова снять со стека после возврата,
+    // object — значение NewInstance
+    auto call = [&](const runtime::Method& method, Value receiver, Value* args, uint16_t count, Value object) {
+        const size_t arity = method.formal_params.size();
+        runtime::MethodMemo* memo = nullptr;
+        runtime::MethodMemo::Key key;
+        if (context.IsMemoizing()) {
+            const runtime::Class& cls = receiver.TryAs<ClassInstance>()->GetClass();
+            memo = ast::FindPureMemo(cls, method);
+            if (memo != nullptr) {
+                key = runtime::MethodMemo::Key(cls);
+                for (size_t i = 0; i < arity && memo != nullptr; ++i)
+                    if (!args[i].AddToKey(key))
+                        memo = nullptr;
+            }
+            if (memo != nullptr) {
+                if (const ObjectHolder* cached = memo->Find(key)) {
+                    finish_call(count, std::move(object), Value::FromHolder(*cached));
+                    return;
+                }
+            }
+        }
+
+        const Function* callee = FunctionFor(method);
+        if (callee == nullptr) {
+            Value result = CallTreeWalker(receiver, method, args, context);
+            if (memo != nullptr)
+                memo->Store(std::move(key), result.ToHolder());
+            finish_call(count, std::move(object), std::move(result));
+            return;
+        }
+
+        Value* window = calls.Push({function, ip, locals, sp, nullptr, 0, count, std::move(object), memo}, *callee);
+        if (memo != nullptr)
+            calls.PushMemoKey(std::move(key));
+        window[0] = std::move(receiver);
+        for (size_t i = 0; i < arity; ++i)
+            window[i + 1] = std::move(args[i]);
+        function = callee;
+        code = callee->code.data();
+        ip = code;
+        locals = window;
+        sp = window + callee->frame_size;
+    };
+
+#if MYTHON_COMPUTED_GOTO
+    static const void* const LABELS[] = {
+#define MYTHON_OPCODE_LABEL(name) &&L_##name,
+        MYTHON_OPCODES(MYTHON_OPCODE_LABEL)
+#undef MYTHON_OPCODE_LABEL
+    };
+#define VM_DISPATCH() goto* LABELS[static_cast<size_t>(ip->op)]
+#define VM_CASE(name) L_##name:
+    VM_DISPATCH();
+    {
+#else
+#define VM_DISPATCH() goto dispatch
+#define VM_CASE(name) case Op::name:
+dispatch:
+    switch (ip->op) {
+#endif
+
+    VM_CASE(PushConst) {
+        *sp++ = function->constants[ip->arg];
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(PushNone) {
+        *sp++ = Value::OfNone();
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(PushTrue) {
+        *sp++ = Value::OfBool(true);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(PushFalse) {
+        *sp++ = Value::OfBool(false);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Pop) {
+        drop(1);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(LoadSlot) {
+        const Value& value = locals[ip->arg];
+        if (value.GetKind() == Value::Kind::Unbound)
+            ThrowUndefined();
+        *sp++ = value;
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(StoreSlot) {
+        locals[ip->arg] = std::move(*--sp);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(LoadField) {
+        auto* instance = sp[-1].TryAs<ClassInstance>();
+        if (instance == nullptr)
+            ThrowUndefined();
+        const ObjectHolder* field =
+            instance->Fields().Find(function->symbols[ip->arg], function->field_caches[ip->count]);
+        if (field == nullptr)
+            ThrowUndefined();
+        sp[-1] = Value::FromHolder(*field);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(StoreField) {
+        auto* instance = sp[-2].TryAs<ClassInstance>();
+        if (instance == nullptr)
+            throw std::runtime_error("Class has not self"s);
+        instance->Fields().Slot(function->symbols[ip->arg], function->field_caches[ip->count]) = sp[-1].ToHolder();
+        drop(2);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Print) {
+        std::ostream& os = context.GetOutputStream();
+        const Value* values = sp - ip->count;
+        for (size_t i = 0; i < ip->count; ++i) {
+            if (i > 0)
+                os << ' ';
+            values[i].Print(os, context);
+        }
+        os << '\n';
+        drop(ip->count);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(CallMethod) {
+        Value* args = sp - ip->count;
+        const runtime::Method& method = MethodOf(args[-1], function->symbols[ip->arg], ip->count);
+        call(method, args[-1], args, ip->count + 1, Value());
+        VM_DISPATCH();
+    }
+
+    // Хвостовой вызов выполняется без ожидающего вызова, как в ClassInstance::Call, и без кеша
+    // чистого метода. Значение исходного вызова всё равно попадёт в его кеш при возврате
+    VM_CASE(TailCall) {
+        Value* args = sp - ip->count;
+        const runtime::Method& method = MethodOf(args[-1], function->symbols[ip->arg], ip->count);
+        const Function* callee = calls.Empty() ? nullptr : FunctionFor(method);
+        if (callee == nullptr) {
+            call(method, args[-1], args, ip->count + 1, Value());
+            VM_DISPATCH();
+        }
+        function = callee;
+        code = callee->code.data();
+        ip = code;
+        locals = calls.Replace(*callee, args - 1, method.formal_params.size() + 1);
+        sp = locals + callee->frame_size;
+        VM_DISPATCH();
+    }
+
+    // Переход по вычисляемому goto не вызывает деструкторы локальных переменных, поэтому
+    // значения, владеющие объектами, живут во вложенном блоке и уничтожаются до перехода
+    VM_CASE(NewInstance) {
+        const NewSite& site = function->new_sites[ip->arg];
+        {
+            Value object = Value::FromHolder(ObjectHolder::Own(ClassInstance(*site.cls)));
+            if (site.init != nullptr) {
+                call(*site.init, object, sp - ip->count, ip->count, object);
+            } else {
+                *sp++ = std::move(object);
+                ++ip;
+            }
+        }
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Stringify) {
+        {
+            std::ostringstream str;
+            sp[-1].Print(str, context);
+            sp[-1] = Value::FromHolder(ObjectHolder::Own(runtime::String(str.str())));
+        }
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Add) {
+        Value& lhs = sp[-2];
+        Value& rhs = sp[-1];
+        if (lhs.GetKind() == Value::Kind::Number && rhs.GetKind() == Value::Kind::Number) {
+            lhs = Value::OfNumber(lhs.AsNumber() + rhs.AsNumber());
+        } else if (const auto* l = lhs.TryAs<runtime::String>(), *r = rhs.TryAs<runtime::String>(); l && r) {
+            lhs = Value::FromHolder(ObjectHolder::Own(runtime::String(l->GetValue() + r->GetValue())));
+        } else if (const auto* instance = lhs.TryAs<ClassInstance>()) {
+            const runtime::Method* method = instance->GetClass().GetMethod(ADD_METHOD);
+            if (method == nullptr || method->formal_params.size() != 1)
+                throw std::runtime_error("incorrect Add operands"s);
+            call(*method, lhs, &rhs, 2, Value());
+            VM_DISPATCH();
+        } else {
+            throw std::runtime_error("incorrect Add operands"s);
+        }
+        drop(1);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Sub) {
+        if (sp[-2].GetKind() != Value::Kind::Number || sp[-1].GetKind() != Value::Kind::Number)
+            throw std::runtime_error("incorrect Sub operands"s);
+        sp[-2] = Value::OfNumber(sp[-2].AsNumber() - sp[-1].AsNumber());
+        drop(1);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Mult) {
+        if (sp[-2].GetKind() != Value::Kind::Number || sp[-1].GetKind() != Value::Kind::Number)
+            throw std::runtime_error("incorrect Mult operands"s);
+        sp[-2] = Value::OfNumber(sp[-2].AsNumber() * sp[-1].AsNumber());
+        drop(1);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Div) {
+        if (sp[-2].GetKind() != Value::Kind::Number || sp[-1].GetKind() != Value::Kind::Number
+            || sp[-1].AsNumber() == 0)
+            throw std::runtime_error("incorrect Div operands"s);
+        sp[-2] = Value::OfNumber(sp[-2].AsNumber() / sp[-1].AsNumber());
+        drop(1);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Not) {
+        sp[-1] = Value::OfBool(!sp[-1].IsTrue());
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Negate) {
+        if (sp[-1].GetKind() != Value::Kind::Number)
+            throw std::runtime_error("incorrect Negate operand"s);
+        sp[-1] = Value::OfNumber(-sp[-1].AsNumber());
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(ToBool) {
+        sp[-1] = Value::OfBool(sp[-1].IsTrue());
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Compare) {
+        const bool result = CompareValues(ip->count, sp[-2], sp[-1], context);
+        drop(1);
+        sp[-1] = Value::OfBool(result);
+        ++ip;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Jump) {
+        ip = code + ip->arg;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(JumpIfFalse) {
+        const bool condition = sp[-1].IsTrue();
+        drop(1);
+        ip = condition ? ip + 1 : code + ip->arg;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(JumpIfTrue) {
+        const bool condition = sp[-1].IsTrue();
+        drop(1);
+        ip = condition ? code + ip->arg : ip + 1;
+        VM_DISPATCH();
+    }
+
+    VM_CASE(Return) {
+        // Результат остаётся в окне вызванной функции и отпускается вместе с ним
+        Value& result = *--sp;
+        if (calls.Empty())
+            return std::move(result);
+
+        CallFrame& frame = calls.Top();
+        if (frame.memo != nullptr)
+            frame.memo->Store(calls.PopMemoKey(), result.ToHolder());
+        function = frame.function;
+        code = function->code.data();
+        ip = frame.ip + 1;
+        locals = frame.locals;
+        sp = frame.sp;
+        drop(frame.drop);
+        *sp++ = frame.object.GetKind() != Value::Kind::Unbound ? std::move(frame.object) : std::move(result);
+        calls.Pop();
+        VM_DISPATCH();
+    }
+    }
+
+#undef VM_DISPATCH
+#undef VM_CASE
+    throw std::logic_error("Bad opcode"s);
+}
+
+}  // namespace bytecode
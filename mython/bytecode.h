@@ -0,0 +1,180 @@
+#pragma once
+
+#include "runtime.h"
+#include "statement.h"
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace bytecode {
+
+// Узел, который нельзя перевести в байт-код: переменная без слота, Print::Variable и т.п.
+// Метод с таким телом выполняется обходом дерева
+class CompileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Значение на стеке машины. Числа, логические значения и None хранятся без выделения памяти,
+// остальные объекты — через ObjectHolder. Unbound — слот, которому ничего не присваивали
+class Value {
+public:
+    enum class Kind : uint8_t { Unbound, None, Bool, Number, Object };
+
+    Value() = default;
+
+    [[nodiscard]] static Value OfNone();
+    [[nodiscard]] static Value OfBool(bool value);
+    [[nodiscard]] static Value OfNumber(int value);
+    // Number и Bool распаковываются, None становится Kind::None
+    [[nodiscard]] static Value FromHolder(runtime::ObjectHolder holder);
+
+    [[nodiscard]] Kind GetKind() const {
+        return kind_;
+    }
+
+    [[nodiscard]] int AsNumber() const {
+        return number_;
+    }
+
+    [[nodiscard]] bool AsBool() const {
+        return number_ != 0;
+    }
+
+    [[nodiscard]] const runtime::ObjectHolder& AsObject() const {
+        return object_;
+    }
+
+    // Объект Kind::Object, приведённый к T, иначе nullptr
+    template <typename T>
+    [[nodiscard]] T* TryAs() const {
+        return kind_ == Kind::Object ? object_.TryAs<T>() : nullptr;
+    }
+
+    // Упаковывает число в новый объект; логическое значение — общий True или False
+    [[nodiscard]] runtime::ObjectHolder ToHolder() const;
+
+    // Истинность по правилам runtime::IsTrue
+    [[nodiscard]] bool IsTrue() const;
+
+    // Вывод как у print: None, True/False, число или Print объекта
+    void Print(std::ostream& os, runtime::Context& context) const;
+
+    // Добавляет значение в ключ мемоизации; false для объекта, который нельзя сравнить по значению
+    [[nodiscard]] bool AddToKey(runtime::MethodMemo::Key& key) const;
+
+private:
+    Kind kind_ = Kind::Unbound;
+    int number_ = 0;
+    runtime::ObjectHolder object_;
+};
+
+#define MYTHON_OPCODES(OP) \
+    OP(PushConst)          \
+    OP(PushNone)           \
+    OP(PushTrue)           \
+    OP(PushFalse)          \
+    OP(Pop)                \
+    OP(LoadSlot)           \
+    OP(StoreSlot)          \
+    OP(LoadField)          \
+    OP(StoreField)         \
+    OP(Print)              \
+    OP(CallMethod)         \
+    OP(TailCall)           \
+    OP(NewInstance)        \
+    OP(Stringify)          \
+    OP(Add)                \
+    OP(Sub)                \
+    OP(Mult)               \
+    OP(Div)                \
+    OP(Not)                \
+    OP(Negate)             \
+    OP(ToBool)             \
+    OP(Compare)            \
+    OP(Jump)               \
+    OP(JumpIfFalse)        \
+    OP(JumpIfTrue)         \
+    OP(Return)
+
+enum class Op : uint8_t {
+#define MYTHON_OPCODE(name) name,
+    MYTHON_OPCODES(MYTHON_OPCODE)
+#undef MYTHON_OPCODE
+};
+
+// Команда стековой машины в 8 байтах. arg — слот, адрес перехода или индекс в таблицах функции;
+// count — число аргументов вызова или значений print, для Compare — номер сравнения,
+// для LoadField и StoreField — номер кеша поля
+struct Instruction {
+    Op op;
+    uint16_t count = 0;
+    uint32_t arg = 0;
+};
+
+// Создание объекта: класс и его __init__, если он вызывается с таким числом аргументов
+struct NewSite {
+    const runtime::Class* cls;
+    const runtime::Method* init;
+};
+
+// Скомпилированное тело метода или программы. Фрейм функции — frame_size слотов переменных,
+// над которыми лежит стек вычислений глубиной не больше max_stack
+struct Function {
+    std::vector<Instruction> code;
+    std::vector<Value> constants;
+    std::vector<runtime::Symbol> symbols;
+    std::vector<NewSite> new_sites;
+    // Кеши полей для LoadField и StoreField, номер — count команды. Заполняются при исполнении
+    mutable std::vector<runtime::FieldCache> field_caches;
+    uint32_t frame_size = 0;
+    uint32_t max_stack = 0;
+};
+
+// Переводит тело с переменными по слотам в байт-код; CompileError, если это невозможно
+[[nodiscard]] Function Compile(const ast::Statement& body, size_t frame_size);
+
+// Текстовый вид байт-кода, по команде на строку
+[[nodiscard]] std::string Disassemble(const Function& function);
+
+// Исполнитель программы на байт-коде. Код верхнего уровня компилируется сразу, методы — при первом
+// вызове из байт-кода. Методы, которые не удалось скомпилировать, а также методы, вызванные
+// из runtime (__str__ при печати, __eq__ и __lt__ при сравнении), выполняются обходом дерева.
+// Вызовы между скомпилированными методами хранятся в куче, а не на стеке C++: глубину рекурсии
+// ограничивает только предел контекста. return вызова метода переиспользует фрейм вызывающего
+// метода и глубину не увеличивает
+class Machine {
+public:
+    explicit Machine(const ast::Program& program);
+
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+    ~Machine();
+
+    // Как ast::Program::Execute: глобальные переменные берутся из closure и записываются обратно
+    runtime::ObjectHolder Run(runtime::Closure& closure, runtime::Context& context);
+
+    [[nodiscard]] const Function& GetMain() const {
+        return main_;
+    }
+
+private:
+    class ValueStack;
+    struct CallFrame;
+    class CallStack;
+
+    Value Invoke(const Function& entry, Value* locals, runtime::Context& context);
+    // Вызов метода, который не удалось скомпилировать; args — formal_params.size() значений
+    Value CallTreeWalker(const Value& self, const runtime::Method& method, Value* args, runtime::Context& context);
+    const Function* FunctionFor(const runtime::Method& method);
+
+    const ast::Program& program_;
+    Function main_;
+    std::unordered_map<const runtime::Method*, std::unique_ptr<Function>> methods_;
+    std::unique_ptr<ValueStack> stack_;
+};
+
+}  // namespace bytecode
@@ -0,0 +1,70 @@
+#include "bytecode.h"
+#include "lexer.h"
+#include "parse.h"
+#include "test_runner_p.h"
+
+using namespace std;
+
+namespace bytecode {
+
+// Вызовы между методами байт-кода идут в куче: глубину ограничивает только предел контекста
+void TestCallDepth() {
+    parse::Lexer lexer{R"(
+class Deep:
+  def down(n):
+    if n == 0:
+      return 0
+    return 1 + self.down(n - 1)
+
+d = Deep()
+print d.down(depth)
+)"sv};
+    auto tree = ParseProgram(lexer);
+    auto run = [&tree](int depth, size_t limit) {
+        runtime::DummyContext context;
+        context.SetMaxCallDepth(limit);
+        // Кеш чистого down пережил бы прогон и сократил глубину следующего
+        context.SetMemoizing(false);
+        runtime::Closure closure = {{"depth"s, runtime::ObjectHolder::Own(runtime::Number(depth))}};
+        Machine machine(dynamic_cast<const ast::Program&>(*tree));
+        try {
+            machine.Run(closure, context);
+        } catch (const runtime::RecursionError&) {
+            ASSERT_EQUAL(context.GetCallDepth(), 0u);
+            return "RecursionError"s;
+        }
+        ASSERT_EQUAL(context.GetCallDepth(), 0u);
+        return context.output.str();
+    };
+
+    ASSERT_EQUAL(run(99, 100), "99\n"s);
+    ASSERT_EQUAL(run(100, 100), "RecursionError"s);
+    ASSERT_EQUAL(run(20000, 100000), "20000\n"s);
+}
+
+void TestDisassemble() {
+    parse::Lexer lexer{"x = y + 1\nprint x.f(2)\n"sv};
+    auto tree = ParseProgram(lexer);
+    const Machine machine(dynamic_cast<const ast::Program&>(*tree));
+    const string code = Disassemble(machine.GetMain());
+
+    ASSERT_EQUAL(code,
+                 "   0 LoadSlot 1\n"
+                 "   1 PushConst 0\n"
+                 "   2 Add\n"
+                 "   3 StoreSlot 0\n"
+                 "   4 LoadSlot 0\n"
+                 "   5 PushConst 1\n"
+                 "   6 CallMethod f 1\n"
+                 "   7 Print 1\n"
+                 "   8 PushNone\n"
+                 "   9 Return\n"s);
+    ASSERT_EQUAL(machine.GetMain().max_stack, 2u);
+}
+
+void RunBytecodeTests(TestRunner& tr) {
+    RUN_TEST(tr, bytecode::TestCallDepth);
+    RUN_TEST(tr, bytecode::TestDisassemble);
+}
+
+}  // namespace bytecode
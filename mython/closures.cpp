@@ -0,0 +1,652 @@
+#include "closures.h"
+
+#include "purity.h"
+
+#include <algorithm>
+#include <array>
+#include <sstream>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace closures {
+
+using runtime::ClassInstance;
+using runtime::Context;
+using runtime::ObjectHolder;
+
+namespace {
+
+const runtime::Symbol ADD_METHOD = "__add__"sv;
+const runtime::Symbol INIT_METHOD = "__init__"sv;
+
+template <typename T>
+constexpr bool IS_EXPRESSION = std::is_base_of_v<ast::BinaryOperation, T> || std::is_base_of_v<ast::UnaryOperation, T>
+                               || std::is_same_v<T, ast::NumericConst> || std::is_same_v<T, ast::StringConst>
+                               || std::is_same_v<T, ast::BoolConst> || std::is_same_v<T, ast::None>
+                               || std::is_same_v<T, ast::VariableValue> || std::is_same_v<T, ast::MethodCall>
+                               || std::is_same_v<T, ast::NewInstance>;
+
+[[noreturn]] void ThrowUndefined() {
+    throw std::runtime_error("not definition var"s);
+}
+
+// Значения вызова: слоты переменных или аргументы. Небольшие размещаются на стеке C++
+class Values {
+public:
+    explicit Values(size_t size) : size_(size) {
+        if (size > INLINE_SIZE) {
+            heap_ = std::make_unique<Value[]>(size);
+            data_ = heap_.get();
+            capacity_ = size;
+        }
+    }
+
+    Values(const Values&) = delete;
+    Values& operator=(const Values&) = delete;
+
+    [[nodiscard]] Value* Data() {
+        return data_;
+    }
+
+    // Отпускает значения и даёт size пустых слотов, например для фрейма хвостового вызова
+    Value* Reset(size_t size) {
+        std::fill(data_, data_ + size_, Value());
+        if (size > capacity_) {
+            heap_ = std::make_unique<Value[]>(size);
+            data_ = heap_.get();
+            capacity_ = size;
+        }
+        size_ = size;
+        return data_;
+    }
+
+private:
+    static constexpr size_t INLINE_SIZE = 8;
+
+    std::array<Value, INLINE_SIZE> inline_;
+    std::unique_ptr<Value[]> heap_;
+    Value* data_ = inline_.data();
+    size_t size_;
+    size_t capacity_ = INLINE_SIZE;
+};
+
+// Метод объекта receiver, который вызывается с count аргументами
+const runtime::Method& MethodOf(const Value& receiver, ast::CallSiteCache& cache, runtime::Symbol name, size_t count) {
+    const auto* instance = receiver.TryAs<ClassInstance>();
+    const runtime::Method* method = instance != nullptr ? cache.Lookup(instance->GetClass(), name) : nullptr;
+    if (method == nullptr || method->formal_params.size() != count)
+        throw std::runtime_error("method not found"s);
+    return *method;
+}
+
+// Операнды, вид которых известен при переводе. Число-константа и переменная в слоте читаются
+// прямо в замыкании родителя, без вызова дочернего
+struct ConstOperand {
+    Value value;
+
+    Value operator()(Env& /*env*/) const {
+        return value;
+    }
+};
+
+struct SlotOperand {
+    uint32_t slot;
+
+    Value operator()(Env& env) const {
+        const Value& value = env.locals[slot];
+        if (value.GetKind() == Value::Kind::Unbound)
+            ThrowUndefined();
+        return value;
+    }
+};
+
+struct ExprOperand {
+    Expr expr;
+
+    Value operator()(Env& env) const {
+        return expr(env);
+    }
+};
+
+struct AddNumbers {
+    static Value Numbers(int lhs, int rhs) {
+        return Value::OfNumber(lhs + rhs);
+    }
+
+    static Value Other(const Value& lhs, Value rhs, Env& env) {
+        if (const auto* l = lhs.TryAs<runtime::String>(), *r = rhs.TryAs<runtime::String>(); l && r)
+            return Value::FromHolder(ObjectHolder::Own(runtime::String(l->GetValue() + r->GetValue())));
+        if (const auto* instance = lhs.TryAs<ClassInstance>()) {
+            const runtime::Method* method = instance->GetClass().GetMethod(ADD_METHOD);
+            if (method != nullptr && method->formal_params.size() == 1)
+                return env.engine.Call(lhs, *method, &rhs, env.context);
+        }
+        throw std::runtime_error("incorrect Add operands"s);
+    }
+};
+
+struct SubNumbers {
+    static Value Numbers(int lhs, int rhs) {
+        return Value::OfNumber(lhs - rhs);
+    }
+
+    static Value Other(const Value& /*lhs*/, Value /*rhs*/, Env& /*env*/) {
+        throw std::runtime_error("incorrect Sub operands"s);
+    }
+};
+
+struct MultNumbers {
+    static Value Numbers(int lhs, int rhs) {
+        return Value::OfNumber(lhs * rhs);
+    }
+
+    static Value Other(const Value& /*lhs*/, Value /*rhs*/, Env& /*env*/) {
+        throw std::runtime_error("incorrect Mult operands"s);
+    }
+};
+
+struct DivNumbers {
+    static Value Numbers(int lhs, int rhs) {
+        if (rhs == 0)
+            throw std::runtime_error("incorrect Div operands"s);
+        return Value::OfNumber(lhs / rhs);
+    }
+
+    static Value Other(const Value& /*lhs*/, Value /*rhs*/, Env& /*env*/) {
+        throw std::runtime_error("incorrect Div operands"s);
+    }
+};
+
+template <typename Arith, typename L, typename R>
+Expr MakeArithmetic(L lhs, R rhs) {
+    return [lhs = std::move(lhs), rhs = std::move(rhs)](Env& env) {
+        const Value l = lhs(env);
+        Value r = rhs(env);
+        if (l.GetKind() == Value::Kind::Number && r.GetKind() == Value::Kind::Number)
+            return Arith::Numbers(l.AsNumber(), r.AsNumber());
+        return Arith::Other(l, std::move(r), env);
+    };
+}
+
+// Числа, логические значения и строки сравниваются на месте, остальное — функцией runtime
+template <ast::CompareOp OP, typename L, typename R>
+Cond MakeComparison(L lhs, R rhs, ast::Comparison::Comparator other) {
+    return [lhs = std::move(lhs), rhs = std::move(rhs), other](Env& env) {
+        using Node = ast::Compare<OP>;
+        const Value l = lhs(env);
+        const Value r = rhs(env);
+        if (l.GetKind() == r.GetKind()) {
+            if (l.GetKind() == Value::Kind::Number)
+                return Node::Apply(l.AsNumber(), r.AsNumber());
+            if (l.GetKind() == Value::Kind::Bool)
+                return Node::Apply(l.AsBool(), r.AsBool());
+            if (const auto* ls = l.TryAs<runtime::String>())
+                if (const auto* rs = r.TryAs<runtime::String>())
+                    return Node::Apply(ls->GetValue(), rs->GetValue());
+        }
+        return other(l.ToHolder(), r.ToHolder(), env.context);
+    };
+}
+
+class Compiler {
+public:
+    explicit Compiler(uint32_t frame_size) : frame_size_(frame_size) {
+    }
+
+    Stmt Statement(const ast::Statement& node) {
+        return ast::VisitNode(node, [this](const auto& n) -> Stmt {
+            if constexpr (IS_EXPRESSION<std::decay_t<decltype(n)>>) {
+                return [expr = CompileExpression(n)](Env& env) {
+                    expr(env);
+                    return false;
+                };
+            } else {
+                return CompileStatement(n);
+            }
+        });
+    }
+
+    Expr Expression(const ast::Statement& node) {
+        return ast::VisitNode(node, [this](const auto& n) -> Expr {
+            using T = std::decay_t<decltype(n)>;
+            if constexpr (IS_EXPRESSION<T>) {
+                return CompileExpression(n);
+            } else if constexpr (std::is_same_v<T, ast::Assignment>) {
+                return [statement = CompileStatement(n), slot = n.GetSlot()](Env& env) {
+                    statement(env);
+                    return env.locals[slot];
+                };
+            } else {
+                return [statement = CompileStatement(n)](Env& env) {
+                    statement(env);
+                    return Value::OfNone();
+                };
+            }
+        });
+    }
+
+    // Условие if и операнды логических операций не упаковываются в Value
+    Cond Condition(const ast::Statement& node) {
+        return ast::VisitNode(node, [this](const auto& n) -> Cond {
+            using T = std::decay_t<decltype(n)>;
+            if constexpr (std::is_base_of_v<ast::Comparison, T> || std::is_same_v<T, ast::Or>
+                          || std::is_same_v<T, ast::And> || std::is_same_v<T, ast::Not>) {
+                return CompileCondition(n);
+            } else {
+                return [expr = Expression(n)](Env& env) {
+                    return expr(env).IsTrue();
+                };
+            }
+        });
+    }
+
+private:
+    uint32_t Slot(uint32_t slot) const {
+        if (slot == ast::NO_SLOT || slot >= frame_size_)
+            throw CompileError("Variable without a frame slot"s);
+        return slot;
+    }
+
+    std::vector<Expr> Arguments(const ast::StatementList& args) {
+        std::vector<Expr> result;
+        result.reserve(args.size());
+        for (const auto& arg : args)
+            result.push_back(Expression(*arg));
+        return result;
+    }
+
+    // Передаёт в action операнд самого узкого вида
+    template <typename Action>
+    std::invoke_result_t<Action, ExprOperand> WithOperand(const ast::Statement& node, Action action) {
+        if (const auto* number = dynamic_cast<const ast::NumericConst*>(&node))
+            return action(ConstOperand{Value::OfNumber(number->GetValue().GetValue())});
+        if (const auto* variable = dynamic_cast<const ast::VariableValue*>(&node);
+            variable != nullptr && variable->GetDottedIds().size() == 1)
+            return action(SlotOperand{Slot(variable->GetSlot())});
+        return action(ExprOperand{Expression(node)});
+    }
+
+    template <typename Arith>
+    Expr Arithmetic(const ast::BinaryOperation& node) {
+        return WithOperand(node.GetLhs(), [&](auto lhs) {
+            return WithOperand(node.GetRhs(), [&](auto rhs) {
+                return MakeArithmetic<Arith>(std::move(lhs), std::move(rhs));
+            });
+        });
+    }
+
+    Expr CompileExpression(const ast::NumericConst& node) {
+        return ConstOperand{Value::OfNumber(node.GetValue().GetValue())};
+    }
+
+    Expr CompileExpression(const ast::StringConst& node) {
+        return ConstOperand{Value::FromHolder(ObjectHolder::Own(runtime::String(node.GetValue())))};
+    }
+
+    Expr CompileExpression(const ast::BoolConst& node) {
+        return ConstOperand{Value::OfBool(node.GetValue().GetValue())};
+    }
+
+    Expr CompileExpression(const ast::None& /*node*/) {
+        return ConstOperand{Value::OfNone()};
+    }
+
+    Expr CompileExpression(const ast::VariableValue& node) {
+        const auto& ids = node.GetDottedIds();
+        SlotOperand variable{Slot(node.GetSlot())};
+        if (ids.size() == 1)
+            return variable;
+
+        std::vector<runtime::Symbol> fields(std::next(ids.begin()), ids.end());
+        std::vector<runtime::FieldCache> caches(fields.size());
+        return [variable, fields = std::move(fields), caches = std::move(caches)](Env& env) mutable {
+            Value value = variable(env);
+            for (size_t i = 0; i < fields.size(); ++i) {
+                auto* instance = value.TryAs<ClassInstance>();
+                if (instance == nullptr)
+                    ThrowUndefined();
+                const ObjectHolder* field = instance->Fields().Find(fields[i], caches[i]);
+                if (field == nullptr)
+                    ThrowUndefined();
+                value = Value::FromHolder(*field);
+            }
+            return value;
+        };
+    }
+
+    Expr CompileExpression(const ast::MethodCall& node) {
+        return [object = Expression(node.GetObject()), args = Arguments(node.GetArgs()), name = node.GetMethod(),
+                cache = ast::CallSiteCache()](Env& env) mutable {
+            const Value receiver = object(env);
+            const runtime::Method& method = MethodOf(receiver, cache, name, args.size());
+            Values values(args.size());
+            for (size_t i = 0; i < args.size(); ++i)
+                values.Data()[i] = args[i](env);
+            return env.engine.Call(receiver, method, values.Data(), env.context);
+        };
+    }
+
+    // Как и при обходе дерева, без подходящего __init__ аргументы не вычисляются
+    Expr CompileExpression(const ast::NewInstance& node) {
+        const runtime::Class& cls = node.GetClass();
+        const runtime::Method* init = cls.GetMethod(INIT_METHOD);
+        if (init == nullptr || init->formal_params.size() != node.GetArgs().size()) {
+            return [&cls](Env& /*env*/) {
+                return Value::FromHolder(ObjectHolder::Own(ClassInstance(cls)));
+            };
+        }
+        return [&cls, init, args = Arguments(node.GetArgs())](Env& env) {
+            Value object = Value::FromHolder(ObjectHolder::Own(ClassInstance(cls)));
+            Values values(args.size());
+            for (size_t i = 0; i < args.size(); ++i)
+                values.Data()[i] = args[i](env);
+            env.engine.Call(object, *init, values.Data(), env.context);
+            return object;
+        };
+    }
+
+    Expr CompileExpression(const ast::Stringify& node) {
+        return [argument = Expression(node.GetArgument())](Env& env) {
+            std::ostringstream str;
+            argument(env).Print(str, env.context);
+            return Value::FromHolder(ObjectHolder::Own(runtime::String(str.str())));
+        };
+    }
+
+    Expr CompileExpression(const ast::Negate& node) {
+        return [argument = Expression(node.GetArgument())](Env& env) {
+            const Value value = argument(env);
+            if (value.GetKind() != Value::Kind::Number)
+                throw std::runtime_error("incorrect Negate operand"s);
+            return Value::OfNumber(-value.AsNumber());
+        };
+    }
+
+    Expr CompileExpression(const ast::Add& node) {
+        return Arithmetic<AddNumbers>(node);
+    }
+
+    Expr CompileExpression(const ast::Sub& node) {
+        return Arithmetic<SubNumbers>(node);
+    }
+
+    Expr CompileExpression(const ast::Mult& node) {
+        return Arithmetic<MultNumbers>(node);
+    }
+
+    Expr CompileExpression(const ast::Div& node) {
+        return Arithmetic<DivNumbers>(node);
+    }
+
+    // Сравнения и логические операции дают bool, который упаковывается только здесь
+    template <typename T>
+    Expr CompileExpression(const T& node) {
+        static_assert(std::is_base_of_v<ast::Comparison, T> || std::is_same_v<T, ast::Or>
+                      || std::is_same_v<T, ast::And> || std::is_same_v<T, ast::Not>);
+        return [condition = CompileCondition(node)](Env& env) {
+            return Value::OfBool(condition(env));
+        };
+    }
+
+    template <ast::CompareOp OP>
+    Cond CompileCondition(const ast::Compare<OP>& node) {
+        return WithOperand(node.GetLhs(), [&](auto lhs) {
+            return WithOperand(node.GetRhs(), [&](auto rhs) {
+                return MakeComparison<OP>(std::move(lhs), std::move(rhs), node.GetComparator());
+            });
+        });
+    }
+
+    // Сравнение, собранное вручную с произвольной функцией
+    Cond CompileCondition(const ast::Comparison& node) {
+        return [lhs = Expression(node.GetLhs()), rhs = Expression(node.GetRhs()),
+                comparator = node.GetComparator()](Env& env) {
+            const Value l = lhs(env);
+            const Value r = rhs(env);
+            return comparator(l.ToHolder(), r.ToHolder(), env.context);
+        };
+    }
+
+    Cond CompileCondition(const ast::Or& node) {
+        return [lhs = Condition(node.GetLhs()), rhs = Condition(node.GetRhs())](Env& env) {
+            return lhs(env) || rhs(env);
+        };
+    }
+
+    Cond CompileCondition(const ast::And& node) {
+        return [lhs = Condition(node.GetLhs()), rhs = Condition(node.GetRhs())](Env& env) {
+            return lhs(env) && rhs(env);
+        };
+    }
+
+    Cond CompileCondition(const ast::Not& node) {
+        return [argument = Condition(node.GetArgument())](Env& env) {
+            return !argument(env);
+        };
+    }
+
+    Stmt CompileStatement(const ast::Assignment& node) {
+        return [slot = Slot(node.GetSlot()), value = Expression(node.GetValue())](Env& env) {
+            env.locals[slot] = value(env);
+            return false;
+        };
+    }
+
+    Stmt CompileStatement(const ast::FieldAssignment& node) {
+        return [object = CompileExpression(node.GetObject()), value = Expression(node.GetValue()),
+                field = node.GetFieldName(), cache = runtime::FieldCache()](Env& env) mutable {
+            const Value target = object(env);
+            auto* instance = target.TryAs<ClassInstance>();
+            if (instance == nullptr)
+                throw std::runtime_error("Class has not self"s);
+            ObjectHolder holder = value(env).ToHolder();
+            instance->Fields().Slot(field, cache) = std::move(holder);
+            return false;
+        };
+    }
+
+    Stmt CompileStatement(const ast::Print& node) {
+        if (node.GetVariable() != nullptr)
+            throw CompileError("Print::Variable reads a closure"s);
+        return [args = Arguments(node.GetArgs())](Env& env) {
+            std::ostream& os = env.context.GetOutputStream();
+            for (size_t i = 0; i < args.size(); ++i) {
+                if (i > 0)
+                    os << ' ';
+                args[i](env).Print(os, env.context);
+            }
+            os << '\n';
+            return false;
+        };
+    }
+
+    Stmt CompileStatement(const ast::Compound& node) {
+        std::vector<Stmt> statements;
+        statements.reserve(node.GetStatements().size());
+        for (const auto& statement : node.GetStatements())
+            statements.push_back(Statement(*statement));
+        return [statements = std::move(statements)](Env& env) {
+            for (const auto& statement : statements)
+                if (statement(env))
+                    return true;
+            return false;
+        };
+    }
+
+    Stmt CompileStatement(const ast::IfElse& node) {
+        Cond condition = Condition(node.GetCondition());
+        Stmt if_body = Statement(node.GetIfBody());
+        if (node.GetElseBody() == nullptr) {
+            return [condition = std::move(condition), if_body = std::move(if_body)](Env& env) {
+                return condition(env) && if_body(env);
+            };
+        }
+        return [condition = std::move(condition), if_body = std::move(if_body),
+                else_body = Statement(*node.GetElseBody())](Env& env) {
+            return condition(env) ? if_body(env) : else_body(env);
+        };
+    }
+
+    // return вызова метода только вычисляет объект и аргументы и взводит хвостовой вызов
+    Stmt CompileStatement(const ast::Return& node) {
+        if (node.IsTailCall()) {
+            const auto& call = static_cast<const ast::MethodCall&>(node.GetStatement());
+            return [object = Expression(call.GetObject()), args = Arguments(call.GetArgs()), name = call.GetMethod(),
+                    cache = ast::CallSiteCache()](Env& env) mutable {
+                Value receiver = object(env);
+                const runtime::Method& method = MethodOf(receiver, cache, name, args.size());
+                env.tail.args.resize(args.size());
+                for (size_t i = 0; i < args.size(); ++i)
+                    env.tail.args[i] = args[i](env);
+                env.tail.object = std::move(receiver);
+                env.tail.method = &method;
+                env.result = Value::OfNone();
+                return true;
+            };
+        }
+        return [value = Expression(node.GetStatement())](Env& env) {
+            env.result = value(env);
+            return true;
+        };
+    }
+
+    Stmt CompileStatement(const ast::ClassDefinition& node) {
+        return [slot = Slot(node.GetSlot()), cls = Value::FromHolder(node.GetClass())](Env& env) {
+            env.locals[slot] = cls;
+            return false;
+        };
+    }
+
+    Stmt CompileStatement(const ast::Statement& node) {
+        throw CompileError("Node "s + typeid(node).name() + " cannot be compiled"s);
+    }
+
+    uint32_t frame_size_;
+};
+
+}  // namespace
+
+Function Compile(const ast::Statement& body, size_t frame_size) {
+    Compiler compiler(static_cast<uint32_t>(frame_size));
+    return {compiler.Statement(body), static_cast<uint32_t>(frame_size)};
+}
+
+Engine::Engine(const ast::Program& program)
+    : program_(program), main_(Compile(program.GetBody(), program.GetGlobals().size())) {
+}
+
+ObjectHolder Engine::Run(runtime::Closure& closure, Context& context) {
+    const auto& globals = program_.GetGlobals();
+    Values values(main_.frame_size);
+    Value* slots = values.Data();
+    for (uint32_t slot = 0; slot < globals.size(); ++slot)
+        if (auto it = closure.find(globals[slot]); it != closure.end())
+            slots[slot] = Value::FromHolder(it->second);
+
+    auto publish = [&] {
+        for (uint32_t slot = 0; slot < globals.size(); ++slot)
+            if (slots[slot].GetKind() != Value::Kind::Unbound)
+                closure[globals[slot]] = slots[slot].ToHolder();
+    };
+
+    Env env{slots, context, *this, Value::OfNone()};
+    try {
+        // return на верхнем уровне завершает программу; его хвостовой вызов выполняется обычным
+        main_.body(env);
+        if (env.tail.method != nullptr)
+            static_cast<void>(Invoke(env.tail.object, *env.tail.method, env.tail.args.data(), context));
+    } catch (...) {
+        publish();
+        throw;
+    }
+    publish();
+    return ObjectHolder::None();
+}
+
+const Function* Engine::FunctionFor(const runtime::Method& method) {
+    if (auto it = methods_.find(&method); it != methods_.end())
+        return it->second.get();
+
+    // Отложенное тело разбирается здесь; ошибка разбора не запоминается, как и при обходе дерева
+    const runtime::Executable* body = method.body.get();
+    if (auto* lazy = dynamic_cast<ast::LazyMethodBody*>(method.body.get()))
+        body = &lazy->GetBody();
+
+    std::unique_ptr<Function> function;
+    if (const auto* method_body = dynamic_cast<const ast::MethodBody*>(body); method_body && method.frame_size > 0) {
+        try {
+            function = std::make_unique<Function>(Compile(method_body->GetBody(), method.frame_size));
+        } catch (const CompileError&) {
+        }
+    }
+    return methods_.emplace(&method, std::move(function)).first->second.get();
+}
+
+Value Engine::Call(const Value& self, const runtime::Method& method, Value* args, Context& context) {
+    const size_t count = method.formal_params.size();
+    if (context.IsMemoizing()) {
+        const runtime::Class& cls = self.TryAs<ClassInstance>()->GetClass();
+        if (runtime::MethodMemo* memo = ast::FindPureMemo(cls, method)) {
+            runtime::MethodMemo::Key key(cls);
+            bool comparable = true;
+            for (size_t i = 0; i < count && comparable; ++i)
+                comparable = args[i].AddToKey(key);
+            if (comparable) {
+                if (const ObjectHolder* cached = memo->Find(key))
+                    return Value::FromHolder(*cached);
+                Value result = Invoke(self, method, args, context);
+                memo->Store(std::move(key), result.ToHolder());
+                return result;
+            }
+        }
+    }
+    return Invoke(self, method, args, context);
+}
+
+Value Engine::Invoke(const Value& self, const runtime::Method& method, Value* args, Context& context) {
+    const Function* function = FunctionFor(method);
+    if (function == nullptr)
+        return CallTreeWalker(self, method, args, context);
+
+    runtime::CallScope call(context);
+    Values locals(function->frame_size);
+    Value* slots = locals.Data();
+    slots[0] = self;
+    for (size_t i = 0; i < method.formal_params.size(); ++i)
+        slots[i + 1] = std::move(args[i]);
+
+    // Хвостовой вызов из тела заменяет текущий, как в ClassInstance::Call: слоты очищаются
+    // и заполняются заново, глубина вызовов не растёт, кеш чистого метода не используется
+    Env env{slots, context, *this, Value::OfNone()};
+    for (;;) {
+        function->body(env);
+        if (env.tail.method == nullptr)
+            return std::move(env.result);
+
+        const runtime::Method& callee = *std::exchange(env.tail.method, nullptr);
+        function = FunctionFor(callee);
+        if (function == nullptr)
+            return CallTreeWalker(env.tail.object, callee, env.tail.args.data(), context);
+        slots = locals.Reset(function->frame_size);
+        slots[0] = std::move(env.tail.object);
+        for (size_t i = 0; i < env.tail.args.size(); ++i)
+            slots[i + 1] = std::move(env.tail.args[i]);
+        env.locals = slots;
+        env.result = Value::OfNone();
+    }
+}
+
+Value Engine::CallTreeWalker(const Value& self, const runtime::Method& method, Value* args, Context& context) {
+    const size_t count = method.formal_params.size();
+    std::vector<ObjectHolder> actual_args;
+    actual_args.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        actual_args.push_back(args[i].ToHolder());
+    return Value::FromHolder(self.TryAs<ClassInstance>()->Call(method, actual_args, context));
+}
+
+}  // namespace closures
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "bytecode.h"
+#include "runtime.h"
+#include "statement.h"
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace closures {
+
+using bytecode::Value;
+
+// Узел, для которого нет замыкания: переменная без слота, Print::Variable и т.п.
+// Метод с таким телом выполняется обходом дерева
+class CompileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class Engine;
+
+// return вызова метода: объект, метод и аргументы вызова, который Engine выполнит вместо
+// вызвавшего его метода, переиспользуя слоты. Так хвостовая рекурсия не растит стек C++
+struct TailCall {
+    Value object;
+    const runtime::Method* method = nullptr;
+    std::vector<Value> args;
+};
+
+// Состояние одного вызова: слоты переменных, значение выполненного return и взведённый им
+// хвостовой вызов
+struct Env {
+    Value* locals;
+    runtime::Context& context;
+    Engine& engine;
+    Value result;
+    TailCall tail = {};
+};
+
+// Замыкания, в которые переводится дерево. Выражение возвращает значение, условие — сразу bool,
+// инструкция — true, если выполнен return
+using Expr = std::function<Value(Env&)>;
+using Cond = std::function<bool(Env&)>;
+using Stmt = std::function<bool(Env&)>;
+
+// Тело метода или программы, переведённое в дерево замыканий
+struct Function {
+    Stmt body;
+    uint32_t frame_size = 0;
+};
+
+// Переводит тело с переменными по слотам в замыкания; CompileError, если это невозможно.
+// Дочерние замыкания и известные при переводе операнды (константы, слоты переменных, оператор
+// сравнения) зашиты в замыкание узла, поэтому при исполнении нет виртуального Execute и TryAs
+[[nodiscard]] Function Compile(const ast::Statement& body, size_t frame_size);
+
+// Исполнитель программы на замыканиях. Как и bytecode::Machine: код верхнего уровня переводится
+// сразу, методы — при первом вызове, а непереводимые методы и вызовы из runtime (__str__, __eq__,
+// __lt__) выполняются обходом дерева
+class Engine {
+public:
+    explicit Engine(const ast::Program& program);
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    // Как ast::Program::Execute: глобальные переменные берутся из closure и записываются обратно
+    runtime::ObjectHolder Run(runtime::Closure& closure, runtime::Context& context);
+
+    // Вызов метода; args — formal_params.size() значений, которые забираются. Результат чистого
+    // метода берётся из кеша, если контекст мемоизирует
+    Value Call(const Value& self, const runtime::Method& method, Value* args, runtime::Context& context);
+
+private:
+    Value Invoke(const Value& self, const runtime::Method& method, Value* args, runtime::Context& context);
+    // Вызов метода, который не удалось перевести; args — formal_params.size() значений
+    Value CallTreeWalker(const Value& self, const runtime::Method& method, Value* args, runtime::Context& context);
+    const Function* FunctionFor(const runtime::Method& method);
+
+    const ast::Program& program_;
+    Function main_;
+    std::unordered_map<const runtime::Method*, std::unique_ptr<Function>> methods_;
+};
+
+}  // namespace closures
@@ -0,0 +1,24 @@
+#include "closures.h"
+#include "test_runner_p.h"
+
+using namespace std;
+
+namespace closures {
+
+// Замыкания читают переменные только из слотов фрейма: всё, что обращается к Closure,
+// не переводится, и такой метод выполняется обходом дерева
+void TestCompileErrors() {
+    ASSERT_THROWS(static_cast<void>(Compile(ast::VariableValue("x"sv), 1)), CompileError);
+    ASSERT_THROWS(static_cast<void>(Compile(*ast::Print::Variable("x"sv), 1)), CompileError);
+    ASSERT_THROWS(static_cast<void>(Compile(ast::VariableValue({"x"sv}, 2), 2)), CompileError);
+
+    const Function function = Compile(ast::Return(make_unique<ast::VariableValue>(vector<runtime::Symbol>{"x"sv}, 1)), 2);
+    ASSERT_EQUAL(function.frame_size, 2u);
+    ASSERT(static_cast<bool>(function.body));
+}
+
+void RunClosureTests(TestRunner& tr) {
+    RUN_TEST(tr, closures::TestCompileErrors);
+}
+
+}  // namespace closures
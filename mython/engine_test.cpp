@@ -0,0 +1,421 @@
+#include "bytecode.h"
+#include "closures.h"
+#include "lexer.h"
+#include "parse.h"
+#include "test_runner_p.h"
+
+#include <exception>
+#include <functional>
+#include <limits>
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <pthread.h>
+#define MYTHON_TEST_SMALL_STACK 1
+#endif
+
+using namespace std;
+
+namespace engines {
+
+namespace {
+
+// Исполнители программы, которые сверяются с обходом дерева
+enum class Engine { TreeWalker, Bytecode, Closures };
+
+string EngineName(Engine engine) {
+    switch (engine) {
+        case Engine::TreeWalker:
+            return "tree"s;
+        case Engine::Bytecode:
+            return "bytecode"s;
+        case Engine::Closures:
+            return "closures"s;
+    }
+    return {};
+}
+
+void Execute(runtime::Executable& tree, Engine engine, runtime::Closure& closure, runtime::Context& context) {
+    const auto& program = dynamic_cast<const ast::Program&>(tree);
+    switch (engine) {
+        case Engine::TreeWalker:
+            tree.Execute(closure, context);
+            break;
+        case Engine::Bytecode: {
+            bytecode::Machine machine(program);
+            machine.Run(closure, context);
+            break;
+        }
+        case Engine::Closures: {
+            closures::Engine closures_engine(program);
+            closures_engine.Run(closure, context);
+            break;
+        }
+    }
+}
+
+unique_ptr<runtime::Executable> Parse(const string& source) {
+    parse::Lexer lexer{string_view(source)};
+    return ParseProgram(lexer);
+}
+
+string Run(runtime::Executable& tree, Engine engine, runtime::Closure& closure) {
+    runtime::DummyContext context;
+    Execute(tree, engine, closure, context);
+    return context.output.str();
+}
+
+string Run(const string& source, Engine engine, runtime::Closure& closure) {
+    return Run(*Parse(source), engine, closure);
+}
+
+// Вывод и итоговые глобальные переменные должны совпасть с обходом дерева. Константы попадают
+// в переменные без копирования, поэтому программы живут, пока сравниваются их переменные
+void AssertSameAsTreeWalker(const string& source, Engine engine) {
+    auto tree = Parse(source);
+    auto engine_tree = Parse(source);
+    runtime::Closure tree_closure;
+    runtime::Closure engine_closure;
+    const string expected = Run(*tree, Engine::TreeWalker, tree_closure);
+    ASSERT_EQUAL(Run(*engine_tree, engine, engine_closure), expected);
+
+    runtime::DummyContext context;
+    for (const auto& [name, value] : tree_closure) {
+        ASSERT(engine_closure.count(name));
+        if (value.TryAs<runtime::Number>() || value.TryAs<runtime::String>() || value.TryAs<runtime::Bool>()) {
+            ASSERT(runtime::Equal(value, engine_closure.at(name), context));
+        }
+    }
+}
+
+#ifdef MYTHON_TEST_SMALL_STACK
+// Стек потока, на котором проверяется защита стека C++: защита срабатывает на небольшой
+// глубине, и результат не зависит от размера стека главного потока
+constexpr size_t SMALL_STACK = 1 << 20;
+
+struct StackJob {
+    function<void()> body;
+    exception_ptr error;
+};
+
+void* RunStackJob(void* arg) {
+    auto& job = *static_cast<StackJob*>(arg);
+    try {
+        job.body();
+    } catch (...) {
+        job.error = current_exception();
+    }
+    return nullptr;
+}
+
+// Выполняет body в отдельном потоке со стеком SMALL_STACK; исключение передаётся вызывающему
+void RunOnSmallStack(function<void()> body) {
+    StackJob job{std::move(body), nullptr};
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SMALL_STACK);
+    pthread_t thread;
+    const int error = pthread_create(&thread, &attr, RunStackJob, &job);
+    pthread_attr_destroy(&attr);
+    ASSERT_EQUAL(error, 0);
+    pthread_join(thread, nullptr);
+    if (job.error) {
+        rethrow_exception(job.error);
+    }
+}
+#endif
+
+}  // namespace
+
+void TestExpressions(Engine engine) {
+    AssertSameAsTreeWalker(R"(
+x = 4
+y = x * 3 - 10 / 2
+s = 'abc' + "def"
+print x, y, s, -y, x + y * 2, 7 - x, x / 3
+print x < y, x == 4, s != 'abc', 'a' <= 'b', True > False, None == None, 5 >= x
+print x or y, 0 and x, not x, not None, x and 'str', '' or 0
+print str(x) + str(True) + str(None), str(s)
+flag = x > 3 and y > 3
+print flag
+if not x < 3 and s:
+  print 'yes'
+else:
+  print 'no'
+)", engine);
+}
+
+void TestClasses(Engine engine) {
+    AssertSameAsTreeWalker(R"(
+class Point:
+  def __init__(x, y):
+    self.x = x
+    self.y = y
+
+  def __str__():
+    return '(' + str(self.x) + ', ' + str(self.y) + ')'
+
+  def __add__(other):
+    return self.x * 10 + other.y
+
+  def __eq__(other):
+    return self.x == other.x and self.y == other.y
+
+  def __lt__(other):
+    return self.x < other.x or self.x == other.x and self.y < other.y
+
+class Labeled(Point):
+  def __init__(x, y, label):
+    self.x = x
+    self.y = y
+    self.label = label
+
+  def __str__():
+    return self.label + ':' + str(self.x)
+
+class Empty:
+  def __init__(a):
+    self.a = a
+
+a = Point(1, 2)
+b = Point(1, 3)
+c = a + b
+print a, b, c, str(c)
+print a == b, a < b, a > b, a <= b, a >= b, a != b
+l = Labeled(5, 6, 'L')
+print l, l.x + l.y
+e = Empty()
+f = Empty(l)
+print f.a.label
+g = Empty(Point(7, 8))
+print g.a.x, g.a
+)", engine);
+}
+
+void TestRecursion(Engine engine) {
+    AssertSameAsTreeWalker(R"(
+class Fib:
+  def calc(n):
+    if n < 2:
+      return n
+    return self.calc(n - 1) + self.calc(n - 2)
+
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def count(n):
+    if n > 0:
+      self.value = self.value + 1
+      self.count(n - 1)
+    else:
+      return self.value
+
+fib = Fib()
+counter = Counter()
+print fib.calc(15), counter.count(100), counter.value
+)", engine);
+}
+
+// Правый операнд or/and вычисляется только при необходимости
+void TestShortCircuit(Engine engine) {
+    AssertSameAsTreeWalker(R"(
+class Logger:
+  def log(value):
+    print 'log', value
+    return value
+
+l = Logger()
+print l.log(1) or l.log(2)
+print l.log(0) or l.log(3)
+print l.log(0) and l.log(4)
+print l.log(5) and l.log(0)
+if l.log(0) or l.log(6):
+  print 'taken'
+)", engine);
+}
+
+void TestErrors(Engine engine) {
+    for (const char* source : {
+             "print x\n",
+             "x = 1 / 0\n",
+             "x = 1 + 'a'\n",
+             "x = -'a'\n",
+             "x = 1 < 'a'\n",
+             "class A:\n  def f():\n    return 1\na = A()\nprint a.g()\n",
+             "class A:\n  def f():\n    return 1\na = A()\nprint a.f(1)\n",
+             "x = 1\nprint x.y\n",
+         }) {
+        runtime::Closure closure;
+        ASSERT_THROWS(static_cast<void>(Run(source, engine, closure)), std::runtime_error);
+    }
+
+    // Глобальные переменные публикуются и при ошибке
+    runtime::Closure closure;
+    ASSERT_THROWS(static_cast<void>(Run("x = 5\ny = x / 0\n", engine, closure)), std::runtime_error);
+    ASSERT(closure.count("x"s) && !closure.count("y"s));
+}
+
+// Метод с телом, собранным вручную без слотов, выполняется обходом дерева
+void TestFallbackToTreeWalker(Engine engine) {
+    vector<runtime::Method> methods;
+    methods.push_back({"answer"s, {}, make_unique<ast::MethodBody>(make_unique<ast::Return>(
+                                           make_unique<ast::NumericConst>(runtime::Number(42))))});
+    const runtime::Class cls("Native"s, std::move(methods), nullptr);
+
+    runtime::Closure closure = {{"obj"s, runtime::ObjectHolder::Own(runtime::ClassInstance(cls))}};
+    ASSERT_EQUAL(Run("print obj.answer() + 1\n", engine, closure), "43\n"s);
+}
+
+void TestCallDepthLimit(Engine engine) {
+    auto tree = Parse("class D:\n  def down(n):\n    if n == 0:\n      return 0\n    return 1 + self.down(n - 1)\n"
+                      "d = D()\nprint d.down(depth)\n"s);
+    auto run = [&](int depth) {
+        runtime::DummyContext context;
+        context.SetMaxCallDepth(50);
+        // Кеш чистого down пережил бы прогон и сократил глубину следующего
+        context.SetMemoizing(false);
+        runtime::Closure closure = {{"depth"s, runtime::ObjectHolder::Own(runtime::Number(depth))}};
+        try {
+            Execute(*tree, engine, closure, context);
+        } catch (const runtime::RecursionError&) {
+            ASSERT_EQUAL(context.GetCallDepth(), 0u);
+            return "RecursionError"s;
+        }
+        ASSERT_EQUAL(context.GetCallDepth(), 0u);
+        return context.output.str();
+    };
+
+    ASSERT_EQUAL(run(49), "49\n"s);
+    ASSERT_EQUAL(run(60), "RecursionError"s);
+}
+
+// return вызова метода не занимает новый фрейм ни в одном исполнителе: цепочки в 10000 шагов
+// проходят при пределе глубины 1000. Хвостовой вызов может перейти к методу другого класса
+// с большим фреймом
+void TestTailCalls(Engine engine) {
+    const string source = R"(
+class Counter:
+  def step(n, acc):
+    if n == 0:
+      return acc
+    return self.step(n - 1, acc + 1)
+
+class Odd:
+  def check(n, other):
+    if n == 0:
+      return False
+    return other.check(n - 1, self)
+
+class Even:
+  def check(n, other):
+    if n == 0:
+      return True
+    a = n - 1
+    b = a
+    c = b
+    d = c
+    e = d
+    f = e
+    g = f
+    h = g
+    return other.check(h, self)
+
+class Builder:
+  def __init__(n):
+    self.n = n
+    return self.fill(n)
+
+  def fill(n):
+    counter = Counter()
+    self.total = counter.step(n, 0)
+
+class Printer:
+  def show(value):
+    print 'result', value
+
+c = Counter()
+even = Even()
+builder = Builder(5000)
+print c.step(10000, 0), even.check(10001, Odd()), builder.total
+printer = Printer()
+return printer.show(c.step(3, 4))
+print 'unreachable'
+)";
+    auto tree = Parse(source);
+    runtime::DummyContext context;
+    context.SetMaxCallDepth(1000);
+    runtime::Closure closure;
+    Execute(*tree, engine, closure, context);
+    ASSERT_EQUAL(context.output.str(), "10000 False 5000\nresult 7\n"s);
+
+    // Фрейм хвостового вызова начинается пустым: локальные переменные прошлого шага не видны
+    const string stale = R"(
+class Stale:
+  def f(n):
+    if n > 0:
+      seen = n
+      return self.f(n - 1)
+    return seen
+
+s = Stale()
+x = s.f(1)
+)";
+    runtime::Closure stale_closure;
+    ASSERT_THROWS(static_cast<void>(Run(stale, engine, stale_closure)), std::runtime_error);
+}
+
+// Обход дерева и замыкания вызывают методы рекурсией C++. Глубокая рекурсия через __add__
+// без предела глубины даёт RecursionError, а не переполнение стека. Байт-код вызывает __add__
+// в куче и доходит до конца. Где границу стека узнать нельзя, действует только предел глубины
+void TestNativeStackGuard([[maybe_unused]] Engine engine) {
+#ifdef MYTHON_TEST_SMALL_STACK
+    auto tree = Parse(R"(
+class Chain:
+  def __add__(k):
+    if k == 0:
+      return 0
+    return (self + (k - 1)) + 1
+
+chain = Chain()
+print chain + depth
+)"s);
+    RunOnSmallStack([&tree, engine] {
+        // Контекст берёт границу стека у создавшего его потока
+        runtime::DummyContext context;
+        context.SetMaxCallDepth(numeric_limits<size_t>::max());
+        context.SetMemoizing(false);
+        const int depth = 20'000;
+        runtime::Closure closure = {{"depth"s, runtime::ObjectHolder::Own(runtime::Number(depth))}};
+        if (engine == Engine::Bytecode) {
+            Execute(*tree, engine, closure, context);
+            ASSERT_EQUAL(context.output.str(), to_string(depth) + "\n"s);
+        } else {
+            ASSERT_THROWS(Execute(*tree, engine, closure, context), runtime::RecursionError);
+        }
+        ASSERT_EQUAL(context.GetCallDepth(), 0u);
+    });
+#endif
+}
+
+#define RUN_ENGINE_TEST(tr, func, engine) \
+    tr.RunTest([engine] { func(engine); }, #func "/"s + EngineName(engine))
+
+void RunEngineTests(TestRunner& tr) {
+    for (Engine engine : {Engine::Bytecode, Engine::Closures}) {
+        RUN_ENGINE_TEST(tr, engines::TestExpressions, engine);
+        RUN_ENGINE_TEST(tr, engines::TestClasses, engine);
+        RUN_ENGINE_TEST(tr, engines::TestRecursion, engine);
+        RUN_ENGINE_TEST(tr, engines::TestShortCircuit, engine);
+        RUN_ENGINE_TEST(tr, engines::TestErrors, engine);
+        RUN_ENGINE_TEST(tr, engines::TestFallbackToTreeWalker, engine);
+        RUN_ENGINE_TEST(tr, engines::TestCallDepthLimit, engine);
+    }
+    for (Engine engine : {Engine::TreeWalker, Engine::Bytecode, Engine::Closures}) {
+        RUN_ENGINE_TEST(tr, engines::TestTailCalls, engine);
+        RUN_ENGINE_TEST(tr, engines::TestNativeStackGuard, engine);
+    }
+}
+
+#undef RUN_ENGINE_TEST
+
+}  // namespace engines
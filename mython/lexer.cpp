@@ -1,9 +1,13 @@
 #include "lexer.h"
+#include "scan.h"
 
 #include <algorithm>
-#include <charconv>
-#include <unordered_map>
-#include <iostream>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <utility>
 
 using namespace std;
 
@@ -12,7 +16,7 @@ namespace parse {
 bool operator==(const Token& lhs, const Token& rhs) {
     using namespace token_type;
 
-    if (lhs.index() != rhs.index()) {
+    if (lhs.Kind() != rhs.Kind()) {
         return false;
     }
     if (lhs.Is<Char>()) {
@@ -76,34 +80,59 @@ std::ostream& operator<<(std::ostream& os, const Token& rhs) {
     return os << "Unknown token :("sv;
 }
 
-Lexer::Lexer(std::istream& input) : input_it_(input) {
+namespace {
+std::string ReadAll(std::istream& input) {
+    std::ostringstream buffer;
+    buffer << input.rdbuf();
+    return std::move(buffer).str();
+}
+}  // namespace
+
+Lexer::Lexer(std::istream& input) : buffer_(ReadAll(input)), it_(buffer_.data()), end_(it_ + buffer_.size()) {
+    NextToken();
+}
+
+Lexer::Lexer(std::string_view source) : it_(source.data()), end_(source.data() + source.size()) {
     NextToken();
 }
 
+Lexer::Lexer(Streaming) {
+}
+
 const Token& Lexer::CurrentToken() const {
     return current_token_;
 }
 
-Token ReadNumber (std::istreambuf_iterator<char>& it) {
+inline bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+Token ReadNumber (const char*& it, const char* end) {
     int numder = 0;
-    for (; it != Lexer::END; ++it)
-        if (*it >= '0' && *it <= '9')
-            numder = numder*10 + (*it - '0');
-        else
-            break;
+    for (; it != end && IsDigit(*it); ++it)
+        numder = numder*10 + (*it - '0');
 
     return token_type::Number{numder};
 }
 
-inline Token ReadString (std::istreambuf_iterator<char>& it) {
-    std::string str;
-    for (char separator = *it++; *it != separator; ++it) {
-        if (it == Lexer::END)
+// Разбирает строковую константу. Текст без escape-последовательностей возвращается видом на
+// исходный буфер, иначе раскодированная копия сохраняется в unescaped
+inline Token ReadString (const char*& it, const char* end, std::deque<std::string>& unescaped) {
+    const char separator = *it++;
+    const char* begin = it;
+    it = FindStringSpecial(it, end, separator);
+
+    if (it != end && *it == separator)
+        return token_type::String{std::string_view(begin, static_cast<size_t>(it++ - begin))};
+
+    std::string str(begin, it);
+    for (; it == end || *it != separator; ++it) {
+        if (it == end)
             throw std::logic_error("String parsing error"s);
 
         if (*it == '\\') {
             ++it;
-            if (it == Lexer::END)
+            if (it == end)
                 throw std::logic_error("String parsing error"s);
 
             switch (*it) {
@@ -135,38 +164,111 @@ inline Token ReadString (std::istreambuf_iterator<char>& it) {
 
     }
     ++it;
-    return token_type::String{str};
+    return token_type::String{unescaped.emplace_back(std::move(str))};
 }
 
-std::string ReadWord (std::istreambuf_iterator<char>& it) {
-    std::string str;
-    for (; (*it >= '0' && *it <= '9') ||
-            (*it >= 'A' && *it <= 'Z') ||
-            (*it >= 'a' && *it <= 'z') ||
-            *it  == '_';
-             ++it)
-        str.push_back(*it);
-    return str;
+std::string_view ReadWord (const char*& it, const char* end) {
+    const char* begin = it;
+    it = SkipWordChars(it, end);
+    return {begin, static_cast<size_t>(it - begin)};
 }
 
-Token Lexer::ParseInput(std::istreambuf_iterator<char>& it) {
+namespace {
+
+struct Keyword {
+    std::string_view word;
+    TokenKind kind;
+};
+
+// Все ключевые слова языка. Новое слово добавляется сюда, хеш проверяется при компиляции
+constexpr Keyword KEYWORDS[] = {
+    {"class"sv, TokenKind::Class},
+    {"return"sv, TokenKind::Return},
+    {"if"sv, TokenKind::If},
+    {"else"sv, TokenKind::Else},
+    {"def"sv, TokenKind::Def},
+    {"print"sv, TokenKind::Print},
+    {"and"sv, TokenKind::And},
+    {"or"sv, TokenKind::Or},
+    {"not"sv, TokenKind::Not},
+    {"None"sv, TokenKind::None},
+    {"True"sv, TokenKind::True},
+    {"False"sv, TokenKind::False},
+};
+
+constexpr size_t KEYWORD_COUNT = std::size(KEYWORDS);
+constexpr size_t KEYWORD_TABLE_SIZE = 32;
+constexpr uint8_t NO_KEYWORD = 0xFF;
+
+// Хеш по длине, первому и последнему символу; слово должно быть непустым
+constexpr size_t KeywordHash(std::string_view word) {
+    return (word.size() + static_cast<unsigned char>(word.front())
+            + static_cast<unsigned char>(word.back())) % KEYWORD_TABLE_SIZE;
+}
 
-    for (;*it == ' '; ++it)
-        if (current_token_.Is<token_type::Newline>())
-            ++curr_dent_;
+constexpr std::array<uint8_t, KEYWORD_TABLE_SIZE> MakeKeywordTable() {
+    std::array<uint8_t, KEYWORD_TABLE_SIZE> table{};
+    for (auto& slot : table)
+        slot = NO_KEYWORD;
+    for (size_t i = 0; i < KEYWORD_COUNT; ++i)
+        table[KeywordHash(KEYWORDS[i].word)] = static_cast<uint8_t>(i);
+    return table;
+}
 
-    if (*it == '#')
-        for (;*it != '\n'; ++it)
-            if (it == END)
-                return token_type::Eof();
+constexpr auto KEYWORD_TABLE = MakeKeywordTable();
 
-    if (*it == '\n'){
-        ++it;
+constexpr bool IsPerfectKeywordHash() {
+    for (size_t i = 0; i < KEYWORD_COUNT; ++i)
+        if (KEYWORD_TABLE[KeywordHash(KEYWORDS[i].word)] != i)
+            return false;
+    return true;
+}
+
+static_assert(IsPerfectKeywordHash(), "Keyword hash collision: change KeywordHash or KEYWORD_TABLE_SIZE");
+
+constexpr size_t MAX_KEYWORD_SIZE = [] {
+    size_t max_size = 0;
+    for (const auto& keyword : KEYWORDS)
+        max_size = std::max(max_size, keyword.word.size());
+    return max_size;
+}();
+
+const Keyword* FindKeyword(std::string_view word) {
+    if (word.empty() || word.size() > MAX_KEYWORD_SIZE)
+        return nullptr;
+
+    const uint8_t index = KEYWORD_TABLE[KeywordHash(word)];
+    if (index == NO_KEYWORD || KEYWORDS[index].word != word)
+        return nullptr;
+    return &KEYWORDS[index];
+}
+
+}  // namespace
+
+Token Lexer::ParseInput() {
+    // Символ под курсором; за концом текста '\0', который не совпадает ни с одним правилом
+    auto peek = [this] {
+        return it_ != end_ ? *it_ : '\0';
+    };
+
+    const char* spaces_end = SkipSpaces(it_, end_);
+    if (current_token_.Is<token_type::Newline>())
+        curr_dent_ += static_cast<int>(spaces_end - it_);
+    it_ = spaces_end;
+
+    if (peek() == '#') {
+        it_ = FindLineEnd(it_, end_);
+        if (it_ == end_)
+            return token_type::Eof();
+    }
+
+    if (peek() == '\n'){
+        ++it_;
         curr_dent_ = 0;
         if (!current_token_.Is<token_type::Newline>())
             return token_type::Newline();
         else
-            return ParseInput(it);
+            return ParseInput();
     }
 
     if (curr_dent_ > old_dent_) {
@@ -177,106 +279,75 @@ Token Lexer::ParseInput(std::istreambuf_iterator<char>& it) {
         return token_type::Dedent();
     }
 
-    if (it == END)
+    if (it_ == end_)
         return token_type::Eof();
 
-    if (*it == '\'' || *it == '"' )
-        return ReadString(it);
-
-    if (*it >= '0' && *it <= '9')
-        return ReadNumber(it);
-
-    if ( *it == '-' ||
-        *it == '+' ||
-        *it == '*' ||
-        *it == '/' ||
-        *it == ',' ||
-        *it == '.' ||
-        *it == '(' ||
-        *it == ')' ||
-        *it == ':'
+    if (*it_ == '\'' || *it_ == '"' )
+        return ReadString(it_, end_, unescaped_);
+
+    if (IsDigit(*it_))
+        return ReadNumber(it_, end_);
+
+    if ( *it_ == '-' ||
+        *it_ == '+' ||
+        *it_ == '*' ||
+        *it_ == '/' ||
+        *it_ == ',' ||
+        *it_ == '.' ||
+        *it_ == '(' ||
+        *it_ == ')' ||
+        *it_ == ':'
         )
-        return token_type::Char{*it++};
+        return token_type::Char{*it_++};
 
-    switch (*it) {
+    switch (*it_) {
         case '=':
-        ++it;
-        if (*it == '=') {
-            ++it;
+        ++it_;
+        if (peek() == '=') {
+            ++it_;
             return token_type::Eq();
         }else
             return token_type::Char{'='};
 
         case '<':
-        ++it;
-        if (*it == '=') {
-            ++it;
+        ++it_;
+        if (peek() == '=') {
+            ++it_;
             return token_type::LessOrEq();
         }else
             return token_type::Char{'<'};
 
         case '>':
-        ++it;
-        if (*it == '=') {
-            ++it;
+        ++it_;
+        if (peek() == '=') {
+            ++it_;
             return token_type::GreaterOrEq();
         }else
             return token_type::Char{'>'};
 
         case '!':
-        ++it;
-        if (*it == '=') {
-            ++it;
+        ++it_;
+        if (peek() == '=') {
+            ++it_;
             return token_type::NotEq();
         }else
             throw std::logic_error("Uncorected simbol '!'"s);
 
         default:
-        std::string name = ReadWord(it);
-        if (name == "class"s)
-            return token_type::Class();
-
-        if (name == "return"s)
-            return token_type::Return();
-
-        if (name == "if"s)
-            return token_type::If();
-
-        if (name == "else"s)
-            return token_type::Else();
-
-        if (name == "def"s)
-            return token_type::Def();
-
-        if (name == "print"s)
-            return token_type::Print();
-
-        if (name == "and"s)
-            return token_type::And();
+        std::string_view name = ReadWord(it_, end_);
+        if (name.empty())
+            throw LexerError("Unexpected character '"s + *it_ + "'"s);
+        if (const Keyword* keyword = FindKeyword(name))
+            return Token::OfKind(keyword->kind);
 
-        if (name == "or"s)
-            return token_type::Or();
-
-        if (name == "not"s)
-            return token_type::Not();
-
-        if (name == "None"s)
-            return token_type::None();
-
-        if (name == "True"s)
-            return token_type::True();
-
-        if (name == "False"s)
-            return token_type::False();
-
-        return token_type::Id{name};
+        return token_type::Id{runtime::Symbol(name)};
 
     }
 
 }
 
 Token Lexer::NextToken() {
-    if (input_it_ == END) {
+    if (it_ == end_) {
         if (current_token_.Is<token_type::Eof>())
             return token_type::Eof();
         else if (current_token_.Is<token_type::Newline>() || current_token_.Is<token_type::Dedent>()){
@@ -288,10 +359,306 @@ Token Lexer::NextToken() {
         }else
             current_token_ = token_type::Newline();
     }else
-        current_token_ = ParseInput(input_it_);
+        current_token_ = ParseInput();
+
+    return current_token_;
+
+}
+
+void Lexer::TokenizeInto(TokenBuffer& tokens) {
+    for (; !current_token_.Is<token_type::Eof>(); NextToken())
+        tokens.Add(current_token_);
+}
+
+TokenBuffer Lexer::TokenizeAll() {
+    TokenBuffer tokens;
+    TokenizeInto(tokens);
+    tokens.Add(current_token_);
+    return tokens;
+}
+
+namespace {
+
+// Начало первой строки верхнего уровня, лежащей не раньше from; если такой нет — end
+const char* FindTopLevelLine(const char* from, const char* end) {
+    for (const char* it = from; it != end; ++it) {
+        it = FindLineEnd(it, end);
+        if (it == end || it + 1 == end)
+            return end;
+        const char next = it[1];
+        if (next != ' ' && next != '\n' && next != '#')
+            return it + 1;
+    }
+    return end;
+}
+
+}  // namespace
+
+TokenBuffer Lexer::TokenizeAllParallel(size_t thread_count, size_t min_chunk_size) {
+    // Фрагментов больше, чем потоков: строки разной длины не дают одному потоку задержать всех
+    constexpr size_t CHUNKS_PER_THREAD = 4;
+
+    const size_t size = static_cast<size_t>(end_ - it_);
+    const size_t chunk_count = std::min(thread_count * CHUNKS_PER_THREAD, size / std::max<size_t>(min_chunk_size, 1));
+    if (thread_count < 2 || chunk_count < 2)
+        return TokenizeAll();
+
+    // Первый фрагмент продолжает разбор с текущего состояния лексера, остальные начинаются
+    // со строки верхнего уровня
+    std::vector<const char*> bounds{it_};
+    for (size_t i = 1; i < chunk_count; ++i) {
+        const char* bound = FindTopLevelLine(std::max(it_ + size / chunk_count * i, bounds.back()), end_);
+        if (bound == end_)
+            break;
+        if (bound != bounds.back())
+            bounds.push_back(bound);
+    }
+    bounds.push_back(end_);
+
+    const size_t chunks = bounds.size() - 1;
+    std::vector<TokenBuffer> parts(chunks);
+    std::vector<std::deque<std::string>> unescaped(chunks);
+    std::vector<std::exception_ptr> errors(chunks);
+    const char* const end = end_;
+
+    std::atomic<size_t> next_chunk = 0;
+    auto work = [&] {
+        for (size_t i; (i = next_chunk++) < chunks;) {
+            try {
+                if (i == 0) {
+                    end_ = bounds[1];
+                    TokenizeInto(parts[0]);
+                } else {
+                    Lexer lexer(std::string_view(bounds[i], static_cast<size_t>(bounds[i + 1] - bounds[i])));
+                    lexer.TokenizeInto(parts[i]);
+                    unescaped[i] = std::move(lexer.unescaped_);
+                }
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min(thread_count, chunks); ++i)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+
+    // Ошибка в первом по порядку фрагменте — та, на которой остановился бы последовательный разбор
+    for (const auto& error : errors)
+        if (error)
+            std::rethrow_exception(error);
+
+    for (size_t i = 1; i < chunks; ++i) {
+        parts[0].Append(parts[i]);
+        // Перемещение deque не двигает сами строки, виды в буфере остаются действительными
+        chunk_unescaped_.push_back(std::move(unescaped[i]));
+    }
+
+    it_ = end_ = end;
+    curr_dent_ = old_dent_ = 0;
+    current_token_ = token_type::Eof();
+    parts[0].Add(current_token_);
+    return std::move(parts[0]);
+}
+
+void TokenBuffer::Add(const Token& token) {
+    using namespace token_type;
+
+    uint32_t payload = 0;
+    switch (token.Kind()) {
+        case TokenKind::Number:
+            payload = static_cast<uint32_t>(token.As<Number>().value);
+            break;
+        case TokenKind::Char:
+            payload = static_cast<unsigned char>(token.As<Char>().value);
+            break;
+        case TokenKind::Id:
+            payload = static_cast<uint32_t>(ids_.size());
+            ids_.push_back(token.As<Id>().value);
+            break;
+        case TokenKind::String:
+            payload = static_cast<uint32_t>(strings_.size());
+            strings_.push_back(token.As<String>().value);
+            break;
+        default:
+            break;
+    }
+
+    kinds_.push_back(token.Kind());
+    payloads_.push_back(payload);
+}
 
+void TokenBuffer::Append(const TokenBuffer& other) {
+    const uint32_t ids_offset = static_cast<uint32_t>(ids_.size());
+    const uint32_t strings_offset = static_cast<uint32_t>(strings_.size());
+
+    kinds_.insert(kinds_.end(), other.kinds_.begin(), other.kinds_.end());
+    payloads_.reserve(payloads_.size() + other.payloads_.size());
+    for (size_t i = 0; i < other.kinds_.size(); ++i) {
+        uint32_t payload = other.payloads_[i];
+        if (other.kinds_[i] == TokenKind::Id)
+            payload += ids_offset;
+        else if (other.kinds_[i] == TokenKind::String)
+            payload += strings_offset;
+        payloads_.push_back(payload);
+    }
+    ids_.insert(ids_.end(), other.ids_.begin(), other.ids_.end());
+    strings_.insert(strings_.end(), other.strings_.begin(), other.strings_.end());
+}
+
+size_t TokenBuffer::Size() const {
+    return kinds_.size();
+}
+
+Token TokenBuffer::At(size_t index) const {
+    using namespace token_type;
+
+    const uint32_t payload = payloads_[index];
+    switch (kinds_[index]) {
+        case TokenKind::Number:
+            return Number{static_cast<int>(payload)};
+        case TokenKind::Char:
+            return Char{static_cast<char>(payload)};
+        case TokenKind::Id:
+            return Id{ids_[payload]};
+        case TokenKind::String:
+            return String{strings_[payload]};
+        default:
+            return Token::OfKind(kinds_[index]);
+    }
+}
+
+void TokenBuffer::OwnStrings() {
+    std::string text;
+    size_t size = 0;
+    for (std::string_view str : strings_)
+        size += str.size();
+    text.reserve(size);
+    for (std::string_view str : strings_)
+        text += str;
+
+    // Виды перестраиваются после переноса: короткая строка при перемещении копируется
+    owned_text_ = std::move(text);
+    size_t offset = 0;
+    for (std::string_view& str : strings_) {
+        const size_t length = str.size();
+        str = std::string_view(owned_text_.data() + offset, length);
+        offset += length;
+    }
+}
+
+TokenCursor::TokenCursor(const TokenBuffer& tokens)
+    : tokens_(tokens), current_token_(PeekToken(0)) {
+}
+
+const Token& TokenCursor::CurrentToken() const {
+    return current_token_;
+}
+
+const Token& TokenCursor::NextToken() {
+    if (position_ + 1 < tokens_.Size())
+        current_token_ = tokens_.At(++position_);
     return current_token_;
+}
+
+Token TokenCursor::PeekToken(size_t offset) const {
+    if (position_ + offset < tokens_.Size())
+        return tokens_.At(position_ + offset);
+    return token_type::Eof();
+}
+
+size_t TokenCursor::Position() const {
+    return position_;
+}
+
+void TokenCursor::Rewind(size_t position) {
+    position_ = position;
+    current_token_ = PeekToken(0);
+}
+
+namespace {
+
+// Строка, дающая лексемы: после отступа не пустая и не комментарий
+bool HasTokens(std::string_view line) {
+    const size_t first = line.find_first_not_of(' ');
+    return first != std::string_view::npos && line[first] != '\n' && line[first] != '#';
+}
+
+}  // namespace
+
+StreamingLexer::StreamingLexer() : lexer_(Lexer::Streaming{}) {
+}
+
+void StreamingLexer::Feed(std::string_view chunk) {
+    if (finished_)
+        throw LexerError("Feed after Finish"s);
+
+    // В pending_ осталась только незаконченная строка, перевода строки в ней нет
+    size_t search_from = pending_.size();
+    pending_.append(chunk);
+
+    // Разбор заканчивается на строке с лексемами. Следующие за ней пустые строки и комментарии
+    // лексем не дают и состояние отступов не меняют, поэтому их можно отбросить
+    size_t lexed_end = 0;
+    size_t complete_end = 0;
+    for (size_t line_end; (line_end = pending_.find('\n', search_from)) != std::string::npos;
+         search_from = complete_end) {
+        const std::string_view line = std::string_view(pending_).substr(complete_end, line_end + 1 - complete_end);
+        complete_end = line_end + 1;
+        if (HasTokens(line))
+            lexed_end = complete_end;
+    }
+
+    if (lexed_end > 0) {
+        lexer_.it_ = pending_.data();
+        lexer_.end_ = pending_.data() + lexed_end;
+        while (lexer_.it_ != lexer_.end_)
+            Push(lexer_.NextToken());
+        lexer_.unescaped_.clear();
+    }
+    pending_.erase(0, complete_end);
+}
+
+void StreamingLexer::Finish() {
+    if (finished_)
+        return;
+
+    lexer_.it_ = pending_.data();
+    lexer_.end_ = pending_.data() + pending_.size();
+    Token token = lexer_.NextToken();
+    for (; !token.Is<token_type::Eof>(); token = lexer_.NextToken())
+        Push(std::move(token));
+    Push(std::move(token));
+    lexer_.unescaped_.clear();
+    pending_.clear();
+    finished_ = true;
+}
+
+std::optional<Token> StreamingLexer::PullToken() {
+    if (ready_.empty()) {
+        if (finished_)
+            return token_type::Eof();
+        return std::nullopt;
+    }
+
+    Token token = std::move(ready_.front());
+    ready_.pop_front();
+    if (token.Is<token_type::String>()) {
+        pulled_string_ = std::move(strings_.front());
+        strings_.pop_front();
+        token = token_type::String{pulled_string_};
+    }
+    return token;
+}
 
+void StreamingLexer::Push(Token token) {
+    // Текст строки копируется: буфер порции будет переиспользован
+    if (const auto str = token.TryAs<token_type::String>())
+        token = token_type::String{strings_.emplace_back(str->value)};
+    ready_.push_back(std::move(token));
 }
 
 }  // namespace parse
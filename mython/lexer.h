@@ -1,11 +1,18 @@
 #pragma once
 
+#include "symbol.h"
+
+#include <cstdint>
+#include <deque>
 #include <iosfwd>
 #include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <variant>
+#include <vector>
 
 namespace parse {
 
@@ -14,8 +21,8 @@ struct Number {  // Лексема «число»
     int value;   // число
 };
 
-struct Id {             // Лексема «идентификатор»
-    std::string value;  // Имя идентификатора
+struct Id {                 // Лексема «идентификатор»
+    runtime::Symbol value;  // Имя идентификатора
 };
 
 struct Char {    // Лексема «символ»
@@ -23,7 +30,9 @@ struct Char {    // Лексема «символ»
 };
 
 struct String {  // Лексема «строковая константа»
-    std::string value;
+    // Текст константы: вид на исходный текст либо, если были escape-последовательности,
+    // на строку во владении лексера. Действителен, пока жив лексер
+    std::string_view value;
 };
 
 struct Class {};    // Лексема «class»
@@ -48,33 +57,105 @@ struct True {};         // Лексема «True»
 struct False {};        // Лексема «False»
 }  // namespace token_type
 
-using TokenBase
-    = std::variant<token_type::Number, token_type::Id, token_type::Char, token_type::String,
-                   token_type::Class, token_type::Return, token_type::If, token_type::Else,
-                   token_type::Def, token_type::Newline, token_type::Print, token_type::Indent,
-                   token_type::Dedent, token_type::And, token_type::Or, token_type::Not,
-                   token_type::Eq, token_type::NotEq, token_type::LessOrEq, token_type::GreaterOrEq,
-                   token_type::None, token_type::True, token_type::False, token_type::Eof>;
+#define MYTHON_TOKEN_TYPES(X) \
+    X(Number) X(Id) X(Char) X(String) X(Class) X(Return) X(If) X(Else) X(Def) X(Newline) \
+    X(Print) X(Indent) X(Dedent) X(And) X(Or) X(Not) X(Eq) X(NotEq) X(LessOrEq) \
+    X(GreaterOrEq) X(None) X(True) X(False) X(Eof)
+
+enum class TokenKind : uint8_t {
+#define MYTHON_TOKEN_KIND(type) type,
+    MYTHON_TOKEN_TYPES(MYTHON_TOKEN_KIND)
+#undef MYTHON_TOKEN_KIND
+};
+
+template <typename T>
+struct TokenKindOf;
+
+#define MYTHON_TOKEN_KIND_OF(type)                              \
+    template <>                                                 \
+    struct TokenKindOf<token_type::type> {                      \
+        static constexpr TokenKind value = TokenKind::type;     \
+    };
+MYTHON_TOKEN_TYPES(MYTHON_TOKEN_KIND_OF)
+#undef MYTHON_TOKEN_KIND_OF
+
+// Лексема в 16 байтах: тип и объединение значений — число, символ, идентификатор или
+// указатель и длина строки. Копируется как простая структура.
+// Is/As/TryAs принимают типы из token_type, As и TryAs возвращают значение по копии
+class Token {
+public:
+    template <typename T>
+    Token(T token)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : kind_(TokenKindOf<T>::value), number_(0) {
+        if constexpr (std::is_same_v<T, token_type::Number>) {
+            number_ = token.value;
+        } else if constexpr (std::is_same_v<T, token_type::Char>) {
+            char_ = token.value;
+        } else if constexpr (std::is_same_v<T, token_type::Id>) {
+            id_ = token.value;
+        } else if constexpr (std::is_same_v<T, token_type::String>) {
+            size_ = static_cast<uint32_t>(token.value.size());
+            data_ = token.value.data();
+        } else {
+            static_assert(std::is_empty_v<T>, "Unknown token payload");
+        }
+    }
+
+    // Лексема без значения заданного типа
+    static Token OfKind(TokenKind kind) {
+        Token token = token_type::Eof{};
+        token.kind_ = kind;
+        return token;
+    }
 
-struct Token : TokenBase {
-    using TokenBase::TokenBase;
+    [[nodiscard]] TokenKind Kind() const {
+        return kind_;
+    }
 
     template <typename T>
     [[nodiscard]] bool Is() const {
-        return std::holds_alternative<T>(*this);
+        return kind_ == TokenKindOf<T>::value;
     }
 
     template <typename T>
-    [[nodiscard]] const T& As() const {
-        return std::get<T>(*this);
+    [[nodiscard]] T As() const {
+        if (!Is<T>())
+            throw std::bad_variant_access();
+
+        if constexpr (std::is_same_v<T, token_type::Number>) {
+            return T{number_};
+        } else if constexpr (std::is_same_v<T, token_type::Char>) {
+            return T{char_};
+        } else if constexpr (std::is_same_v<T, token_type::Id>) {
+            return T{id_};
+        } else if constexpr (std::is_same_v<T, token_type::String>) {
+            return T{std::string_view(data_, size_)};
+        } else {
+            return T{};
+        }
     }
 
     template <typename T>
-    [[nodiscard]] const T* TryAs() const {
-        return std::get_if<T>(this);
+    [[nodiscard]] std::optional<T> TryAs() const {
+        if (!Is<T>())
+            return std::nullopt;
+        return As<T>();
     }
+
+private:
+    TokenKind kind_;
+    uint32_t size_ = 0;
+    union {
+        int number_;
+        char char_;
+        runtime::Symbol id_;
+        const char* data_;
+    };
 };
 
+static_assert(sizeof(Token) == 16);
+static_assert(std::is_trivially_copyable_v<Token>);
+
 bool operator==(const Token& lhs, const Token& rhs);
 bool operator!=(const Token& lhs, const Token& rhs);
 
@@ -85,56 +166,173 @@ public:
     using std::runtime_error::runtime_error;
 };
 
-class Lexer {
-
-std::istreambuf_iterator<char> input_it_;
-int old_dent_ = 0;
-int curr_dent_ = 0;
-Token current_token_ = token_type::Newline();
-
-Token ParseInput(std::istreambuf_iterator<char>& it);
-
+// Общие проверки текущей лексемы для лексера и курсора по буферу лексем.
+// Derived предоставляет CurrentToken() и NextToken()
+template <typename Derived>
+class TokenReader {
 public:
-
-    static constexpr std::istreambuf_iterator<char> END = std::istreambuf_iterator<char>();
-
-    explicit Lexer(std::istream& input);
-
-    [[nodiscard]] const Token& CurrentToken() const;
-
-    Token NextToken();
-
     template <typename T>
-    const T& Expect() const {
+    T Expect() const {
         using namespace std::literals;
-        if (!current_token_.Is<T>())
+        const Token& token = Self().CurrentToken();
+        if (!token.Is<T>())
             throw LexerError("Expect error: incorrect token type"s);
 
 
-        return current_token_.As<T>();
+        return token.As<T>();
     }
 
     template <typename T, typename U>
     void Expect(const U& value) const {
         using namespace std::literals;
-        Expect<T>();
-        if (current_token_.As<T>().value != value )
+        if (Expect<T>().value != value )
             throw LexerError("Expect error: current_token.value != value"s);
     }
 
     template <typename T>
-    const T& ExpectNext() {
-        using namespace std::literals;
-        NextToken();
+    T ExpectNext() {
+        Self().NextToken();
         return Expect<T>();
     }
 
     template <typename T, typename U>
     void ExpectNext(const U& value) {
-        using namespace std::literals;
-        NextToken();
+        Self().NextToken();
         return Expect<T>(value);
     }
+
+private:
+    const Derived& Self() const {
+        return static_cast<const Derived&>(*this);
+    }
+
+    Derived& Self() {
+        return static_cast<Derived&>(*this);
+    }
+};
+
+// Поток лексем программы в виде структуры массивов: тип лексемы и 32-битная полезная нагрузка.
+// Число и символ хранятся в нагрузке непосредственно, для идентификаторов и строк нагрузка —
+// индекс в отдельной таблице. Строковые лексемы ссылаются на память породившего лексера
+class TokenBuffer {
+public:
+    void Add(const Token& token);
+
+    // Дописывает лексемы other в конец буфера
+    void Append(const TokenBuffer& other);
+
+    [[nodiscard]] size_t Size() const;
+    [[nodiscard]] Token At(size_t index) const;
+
+    // Копирует текст строковых констант в буфер: после этого буфер переживает лексер.
+    // Append по-прежнему переносит только виды на строки
+    void OwnStrings();
+
+private:
+    std::vector<TokenKind> kinds_;
+    std::vector<uint32_t> payloads_;
+    std::vector<runtime::Symbol> ids_;
+    std::vector<std::string_view> strings_;
+    std::string owned_text_;
+};
+
+// Курсор по TokenBuffer с интерфейсом лексера, произвольным просмотром вперёд и откатом
+class TokenCursor : public TokenReader<TokenCursor> {
+public:
+    explicit TokenCursor(const TokenBuffer& tokens);
+
+    [[nodiscard]] const Token& CurrentToken() const;
+
+    const Token& NextToken();
+
+    // Лексема на offset позиций впереди текущей; за концом буфера — Eof
+    [[nodiscard]] Token PeekToken(size_t offset = 1) const;
+
+    [[nodiscard]] size_t Position() const;
+    void Rewind(size_t position);
+
+private:
+    const TokenBuffer& tokens_;
+    size_t position_ = 0;
+    Token current_token_;
+};
+
+class Lexer : public TokenReader<Lexer> {
+
+std::string buffer_;
+std::deque<std::string> unescaped_;
+// Раскодированные строки лексеров фрагментов из TokenizeAllParallel
+std::vector<std::deque<std::string>> chunk_unescaped_;
+const char* it_ = nullptr;
+const char* end_ = nullptr;
+int old_dent_ = 0;
+int curr_dent_ = 0;
+Token current_token_ = token_type::Newline();
+
+Token ParseInput();
+// Добавляет лексемы с текущей по последнюю перед Eof
+void TokenizeInto(TokenBuffer& tokens);
+
+friend class StreamingLexer;
+struct Streaming {};
+// Лексер без входа для StreamingLexer: текст подставляется порциями, первая лексема не читается
+explicit Lexer(Streaming);
+
+public:
+
+    // Читает поток целиком и разбирает собственную копию текста
+    explicit Lexer(std::istream& input);
+
+    // Разбирает текст без копирования, source должен пережить лексер
+    explicit Lexer(std::string_view source);
+
+    Lexer(const Lexer&) = delete;
+    Lexer& operator=(const Lexer&) = delete;
+
+    [[nodiscard]] const Token& CurrentToken() const;
+
+    Token NextToken();
+
+    // Разбирает остаток текста за один проход, начиная с текущей лексемы и заканчивая Eof.
+    // Строковые лексемы буфера действительны, пока жив лексер
+    [[nodiscard]] TokenBuffer TokenizeAll();
+
+    // То же, что TokenizeAll, но остаток текста делится на фрагменты по строкам верхнего уровня
+    // (столбец 0, не пустая и не комментарий), которые разбираются на thread_count потоках.
+    // В такой строке отступ равен нулю и открытых строк нет, поэтому фрагмент разбирается
+    // с нуля, а у всех фрагментов, кроме последнего, отбрасывается Eof: закрывающие Dedent
+    // в конце фрагмента совпадают с теми, что последовательный лексер выдал бы в начале
+    // следующей строки. Результат совпадает с TokenizeAll
+    [[nodiscard]] TokenBuffer TokenizeAllParallel(size_t thread_count, size_t min_chunk_size = 1 << 16);
+};
+
+// Лексер с поточным вводом. Текст подаётся порциями произвольного размера через Feed(),
+// готовые лексемы забираются PullToken() до того, как пришёл весь текст.
+// Разбираются только завершённые строки, поэтому в памяти хранится лишь незаконченная
+// последняя строка и ещё не забранные лексемы
+class StreamingLexer {
+public:
+    StreamingLexer();
+
+    void Feed(std::string_view chunk);
+
+    // Сообщает о конце текста: разбирается последняя строка, в конце потока появляется Eof
+    void Finish();
+
+    // Очередная готовая лексема либо nullopt, если для неё нужно больше текста.
+    // После Eof всегда возвращает Eof. Текст строковой лексемы действителен до следующего вызова
+    std::optional<Token> PullToken();
+
+private:
+    void Push(Token token);
+
+    Lexer lexer_;
+    std::string pending_;
+    std::deque<Token> ready_;
+    // Тексты строковых лексем из ready_, в том же порядке
+    std::deque<std::string> strings_;
+    std::string pulled_string_;
+    bool finished_ = false;
 };
 
 }  // namespace parse
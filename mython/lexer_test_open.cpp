@@ -1,8 +1,12 @@
 #include "lexer.h"
+#include "scan.h"
 #include "test_runner_p.h"
 
+#include <algorithm>
+#include <cctype>
 #include <sstream>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -351,6 +355,166 @@ abc#
         ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Eof{}));
     }
 }
+
+void TestTokenizeAll() {
+    istringstream input("x = 'one' + 2\nif x:\n  print -x\n"s);
+    Lexer lexer(input);
+
+    const TokenBuffer tokens = lexer.TokenizeAll();
+    ASSERT_EQUAL(tokens.Size(), 17U);
+
+    TokenCursor cursor(tokens);
+    ASSERT_EQUAL(cursor.CurrentToken(), Token(token_type::Id{"x"s}));
+    ASSERT_EQUAL(cursor.PeekToken(2), Token(token_type::String{"one"s}));
+    ASSERT_EQUAL(cursor.PeekToken(4), Token(token_type::Number{2}));
+    ASSERT_EQUAL(cursor.NextToken(), Token(token_type::Char{'='}));
+
+    const size_t mark = cursor.Position();
+    ASSERT_EQUAL(cursor.ExpectNext<token_type::String>().value, "one"s);
+    ASSERT_DOESNT_THROW(cursor.ExpectNext<token_type::Char>('+'));
+    cursor.Rewind(mark);
+    ASSERT_EQUAL(cursor.CurrentToken(), Token(token_type::Char{'='}));
+
+    cursor.Rewind(tokens.Size() - 4);
+    ASSERT_EQUAL(cursor.CurrentToken(), Token(token_type::Id{"x"s}));
+    ASSERT_EQUAL(cursor.NextToken(), Token(token_type::Newline{}));
+    ASSERT_EQUAL(cursor.NextToken(), Token(token_type::Dedent{}));
+    ASSERT_EQUAL(cursor.NextToken(), Token(token_type::Eof{}));
+    ASSERT_EQUAL(cursor.NextToken(), Token(token_type::Eof{}));
+    ASSERT_EQUAL(cursor.PeekToken(5), Token(token_type::Eof{}));
+}
+
+void TestTokenizeAllParallel() {
+    string script;
+    for (int i = 0; i < 200; ++i) {
+        const string n = to_string(i);
+        script += "# class "s + n + "\n"s;
+        script += "class C"s + n + ":\n"s;
+        script += "  def m(x):\n"s;
+        script += "    if x > "s + n + ":\n"s;
+        script += "      return 'big\\n' + \"v"s + n + "\"\n"s;
+        script += "\n"s;
+        script += "    return x\n"s;
+        script += "  # inner comment\n"s;
+        script += "c"s + n + " = C"s + n + "()\n"s;
+        script += "print c"s + n + ".m("s + n + ")\n"s;
+    }
+    script += "  "s;
+
+    Lexer serial_lexer(string_view{script});
+    const TokenBuffer serial = serial_lexer.TokenizeAll();
+    for (size_t threads : {1U, 2U, 3U, 8U}) {
+        Lexer lexer(string_view{script});
+        const TokenBuffer parallel = lexer.TokenizeAllParallel(threads, 64);
+        ASSERT_EQUAL(parallel.Size(), serial.Size());
+        for (size_t i = 0; i < serial.Size(); ++i) {
+            ASSERT_EQUAL(parallel.At(i), serial.At(i));
+        }
+        ASSERT_EQUAL(lexer.CurrentToken(), Token(token_type::Eof{}));
+        ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Eof{}));
+    }
+
+    const string broken_script = script + "\nx = 1\ny = 'open\n"s;
+    Lexer broken(string_view{broken_script});
+    ASSERT_THROWS(static_cast<void>(broken.TokenizeAllParallel(4, 64)), std::logic_error);
+}
+
+void TestScanKernels() {
+    const string word = "long_identifier_"s + string(40, 'Z') + "_0123456789"s;
+    const string spaces(37, ' ');
+    const string text = "text with a 'quote' inside and more text to cross a vector block"s;
+    const string specials = "\"\\\n\r"s;
+    const string inputs[] = {
+        word + "+"s, word + "\x80"s, word, spaces + "x"s, spaces,
+        text + "\""s, text + "\\n"s, text + "\n"s, text + "\r"s, text,
+    };
+
+    const ScanKernel default_kernel = ActiveScanKernel();
+    for (auto kernel : {ScanKernel::Scalar, ScanKernel::Sse2, ScanKernel::Avx2}) {
+        if (!SetScanKernel(kernel)) {
+            continue;
+        }
+        const string hint = string(ScanKernelName(kernel));
+        for (const string& input : inputs) {
+            const char* begin = input.data();
+            const char* end = begin + input.size();
+            for (size_t offset = 0; offset < input.size(); offset += 7) {
+                const char* it = begin + offset;
+                AssertEqual(SkipWordChars(it, end) - begin,
+                            find_if_not(it, end, [](char c) {
+                                return isalnum(static_cast<unsigned char>(c)) || c == '_';
+                            }) - begin, hint);
+                AssertEqual(SkipSpaces(it, end) - begin,
+                            find_if(it, end, [](char c) { return c != ' '; }) - begin, hint);
+                AssertEqual(FindStringSpecial(it, end, '"') - begin,
+                            find_first_of(it, end, specials.begin(), specials.end()) - begin, hint);
+            }
+        }
+    }
+    SetScanKernel(default_kernel);
+}
+
+void TestStreamingLexer() {
+    const string program = R"(
+# streamed program
+class Counter:
+  def __init__():
+    self.value = 0   # start
+
+  def add(step):
+    self.value = self.value + step
+
+
+    print 'added \'step\'', "to counter"
+counter = Counter()
+if counter.value >= 0:
+  counter.add(5)
+  # trailing comment
+)"s;
+
+    // Строки с экранированием хранит лексер, поэтому он живёт, пока сравниваются его лексемы
+    Lexer reference(string_view{program});
+    vector<Token> expected{reference.CurrentToken()};
+    while (!expected.back().Is<token_type::Eof>()) {
+        expected.push_back(reference.NextToken());
+    }
+
+    for (size_t chunk_size : {1U, 2U, 3U, 7U, 64U, 1000U}) {
+        StreamingLexer lexer;
+        size_t index = 0;
+        auto drain = [&] {
+            while (auto token = lexer.PullToken()) {
+                ASSERT(index < expected.size());
+                ASSERT_EQUAL(*token, expected[index]);
+                if (token->Is<token_type::Eof>()) {
+                    return;
+                }
+                ++index;
+            }
+        };
+        for (size_t pos = 0; pos < program.size(); pos += chunk_size) {
+            lexer.Feed(string_view{program}.substr(pos, chunk_size));
+            drain();
+        }
+        ASSERT(index < expected.size());
+        lexer.Finish();
+        drain();
+        ASSERT_EQUAL(index, expected.size() - 1);
+        ASSERT_EQUAL(*lexer.PullToken(), Token(token_type::Eof{}));
+    }
+
+    StreamingLexer partial;
+    partial.Feed("x = 'unfinished"sv);
+    ASSERT(!partial.PullToken());
+    partial.Feed(" line'"sv);
+    ASSERT(!partial.PullToken());
+    partial.Finish();
+    ASSERT_EQUAL(*partial.PullToken(), Token(token_type::Id{"x"s}));
+    ASSERT_EQUAL(*partial.PullToken(), Token(token_type::Char{'='}));
+    ASSERT_EQUAL(*partial.PullToken(), Token(token_type::String{"unfinished line"s}));
+    ASSERT_EQUAL(*partial.PullToken(), Token(token_type::Newline{}));
+    ASSERT_EQUAL(*partial.PullToken(), Token(token_type::Eof{}));
+}
 }  // namespace
 
 void RunOpenLexerTests(TestRunner& tr) {
@@ -367,6 +531,10 @@ void RunOpenLexerTests(TestRunner& tr) {
     RUN_TEST(tr, parse::TestMythonProgram);
     RUN_TEST(tr, parse::TestAlwaysEmitsNewlineAtTheEndOfNonemptyLine);
     RUN_TEST(tr, parse::TestCommentsAreIgnored);
+    RUN_TEST(tr, parse::TestTokenizeAll);
+    RUN_TEST(tr, parse::TestTokenizeAllParallel);
+    RUN_TEST(tr, parse::TestScanKernels);
+    RUN_TEST(tr, parse::TestStreamingLexer);
 }
 
 }  // namespace parse
\ No newline at end of file
@@ -1,10 +1,16 @@
+#include "bytecode.h"
+#include "closures.h"
 #include "lexer.h"
 #include "parse.h"
+#include "program_cache.h"
 #include "runtime.h"
 #include "statement.h"
 #include "test_runner_p.h"
 
 #include <iostream>
+#include <iterator>
+#include <optional>
+#include <string_view>
 
 using namespace std;
 
@@ -14,6 +20,16 @@ void RunOpenLexerTests(TestRunner& tr);
 
 namespace ast {
 void RunUnitTests(TestRunner& tr);
+void RunPurityTests(TestRunner& tr);
+}
+namespace bytecode {
+void RunBytecodeTests(TestRunner& tr);
+}
+namespace closures {
+void RunClosureTests(TestRunner& tr);
+}
+namespace engines {
+void RunEngineTests(TestRunner& tr);
 }
 namespace runtime {
 void RunObjectHolderTests(TestRunner& tr);
@@ -24,13 +40,57 @@ void TestParseProgram(TestRunner& tr);
 
 namespace {
 
-void RunMythonProgram(istream& input, ostream& output) {
-    parse::Lexer lexer(input);
+enum class Engine {
+    TreeWalker,
+    Bytecode,
+    Closures,
+};
+
+struct RunOptions {
+    // Каталог кеша разобранных программ; без него программа всегда разбирается заново
+    optional<filesystem::path> cache_dir;
+    // Обход дерева остаётся эталонным способом выполнения
+    Engine engine = Engine::TreeWalker;
+    // Предел глубины вызовов методов, после которого бросается RecursionError
+    size_t max_call_depth = runtime::Context::DEFAULT_MAX_CALL_DEPTH;
+    // Кешировать результаты методов, доказанных чистыми
+    bool memoize = true;
+};
+
+unique_ptr<runtime::Executable> LoadProgram(istream& input, const RunOptions& options) {
+    if (!options.cache_dir) {
+        parse::Lexer lexer(input);
+        return ParseProgram(lexer);
+    }
+
+    const string source{istreambuf_iterator<char>(input), istreambuf_iterator<char>()};
+    const ast::ProgramCache cache(*options.cache_dir);
+    if (auto program = cache.Load(source))
+        return program;
+
+    parse::Lexer lexer{string_view(source)};
     auto program = ParseProgram(lexer);
+    if (const auto* parsed = dynamic_cast<const ast::Program*>(program.get()))
+        cache.Store(source, *parsed);
+    return program;
+}
+
+void RunMythonProgram(istream& input, ostream& output, const RunOptions& options = {}) {
+    auto program = LoadProgram(input, options);
 
     runtime::SimpleContext context{output};
+    context.SetMaxCallDepth(options.max_call_depth);
+    context.SetMemoizing(options.memoize);
     runtime::Closure closure;
-    program->Execute(closure, context);
+    if (options.engine == Engine::Bytecode) {
+        bytecode::Machine machine(dynamic_cast<const ast::Program&>(*program));
+        machine.Run(closure, context);
+    } else if (options.engine == Engine::Closures) {
+        closures::Engine engine(dynamic_cast<const ast::Program&>(*program));
+        engine.Run(closure, context);
+    } else {
+        program->Execute(closure, context);
+    }
 }
 
 void TestSimplePrints() {
@@ -117,6 +177,10 @@ void TestAll() {
     runtime::RunObjectHolderTests(tr);
     runtime::RunObjectsTests(tr);
     ast::RunUnitTests(tr);
+    ast::RunPurityTests(tr);
+    bytecode::RunBytecodeTests(tr);
+    closures::RunClosureTests(tr);
+    engines::RunEngineTests(tr);
     TestParseProgram(tr);
 
     RUN_TEST(tr, TestSimplePrints);
@@ -127,11 +191,32 @@ void TestAll() {
 
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
     try {
+        RunOptions options;
+        for (int i = 1; i < argc; ++i) {
+            const string_view arg = argv[i];
+            if (arg.substr(0, 12) == "--cache-dir="sv)
+                options.cache_dir = arg.substr(12);
+            else if (arg == "--cache-dir"sv && i + 1 < argc)
+                options.cache_dir = argv[++i];
+            else if (arg == "--engine=tree"sv)
+                options.engine = Engine::TreeWalker;
+            else if (arg == "--engine=bytecode"sv)
+                options.engine = Engine::Bytecode;
+            else if (arg == "--engine=closures"sv)
+                options.engine = Engine::Closures;
+            else if (arg.substr(0, 17) == "--max-call-depth="sv)
+                options.max_call_depth = stoul(string(arg.substr(17)));
+            else if (arg == "--no-memoize"sv)
+                options.memoize = false;
+            else
+                throw invalid_argument("Unknown argument: "s + string(arg));
+        }
+
         TestAll();
 
-        RunMythonProgram(cin, cout);
+        RunMythonProgram(cin, cout, options);
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
 		return 1;
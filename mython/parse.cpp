@@ -3,31 +3,53 @@
 #include "lexer.h"
 #include "statement.h"
 
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
 using namespace std;
 
 namespace TokenType = parse::token_type;
 
 namespace {
 bool operator==(const parse::Token& token, char c) {
-    const auto* p = token.TryAs<TokenType::Char>();
-    return p != nullptr && p->value == c;
+    const auto p = token.TryAs<TokenType::Char>();
+    return p && p->value == c;
 }
 
 bool operator!=(const parse::Token& token, char c) {
     return !(token == c);
 }
 
+const runtime::Symbol SELF = "self"sv;
+
 class Parser {
 public:
-    explicit Parser(parse::Lexer& lexer)
-        : lexer_(lexer) {
+    // Lazy method bodies share ownership of the tokens and parse from them on the first call.
+    // Classes are registered in program, which is null when a lazy body is parsed
+    Parser(shared_ptr<const parse::TokenBuffer> tokens, ast::Arena& arena, ast::Program* program,
+           const ParseOptions& options)
+        : tokens_(*tokens), token_owner_(std::move(tokens)), program_(program), arena_(&arena), options_(options) {
+    }
+
+    Parser(const Parser&) = delete;
+    Parser& operator=(const Parser&) = delete;
+
+    [[nodiscard]] const vector<runtime::Symbol>& Globals() const {
+        return globals_.names;
+    }
+
+    [[nodiscard]] bool HasLazyBodies() const {
+        return has_lazy_bodies_;
     }
 
     // Program -> eps
     //          | Statement \n Program
-    unique_ptr<ast::Statement> ParseProgram() {
-        auto result = make_unique<ast::Compound>();
-        while (!lexer_.CurrentToken().Is<TokenType::Eof>()) {
+    ast::Statement* ParseProgram() {
+        auto result = Make<ast::Compound>();
+        while (!tokens_.CurrentToken().Is<TokenType::Eof>()) {
             result->AddStatement(ParseStatement());
         }
 
@@ -35,100 +57,269 @@ public:
     }
 
 private:
+    template <typename T, typename... Args>
+    T* Make(Args&&... args) {
+        return arena_->Make<T>(std::forward<Args>(args)...);
+    }
+
+    // Variables of a method body or of the top level, numbered in order of first appearance
+    struct Scope {
+        unordered_map<runtime::Symbol, uint32_t> slots;
+        vector<runtime::Symbol> names;
+
+        uint32_t Resolve(runtime::Symbol name) {
+            auto [it, inserted] = slots.emplace(name, static_cast<uint32_t>(names.size()));
+            if (inserted) {
+                names.push_back(name);
+            }
+            return it->second;
+        }
+    };
+
+    // The head of a dotted path is resolved to a slot of the current scope
+    ast::VariableValue MakeVariable(vector<runtime::Symbol> dotted_ids) {
+        const uint32_t slot = scope_->Resolve(dotted_ids.front());
+        return ast::VariableValue(std::move(dotted_ids), slot);
+    }
+
+    static bool IsConstant(const ast::Statement* node) {
+        return dynamic_cast<const ast::NumericConst*>(node) != nullptr
+               || dynamic_cast<const ast::StringConst*>(node) != nullptr
+               || dynamic_cast<const ast::BoolConst*>(node) != nullptr
+               || dynamic_cast<const ast::None*>(node) != nullptr;
+    }
+
+    template <typename U>
+    static bool IsConstantOperand(const U& operand) {
+        if constexpr (std::is_convertible_v<U, const ast::Statement*>) {
+            return IsConstant(operand);
+        } else {
+            return true;
+        }
+    }
+
+    static bool IsMinusOne(const ast::Statement* node) {
+        const auto* num = dynamic_cast<const ast::NumericConst*>(node);
+        return num != nullptr && num->GetValue().GetValue() == -1;
+    }
+
+    // Truth value of a constant operand, nullopt for anything else
+    std::optional<bool> ConstantTruth(ast::Statement* node) const {
+        if (!options_.fold_constants || !IsConstant(node)) {
+            return std::nullopt;
+        }
+        runtime::DummyContext context;
+        runtime::Closure closure;
+        return runtime::IsTrue(node->Execute(closure, context));
+    }
+
+    ast::Statement* MakeConstant(const runtime::ObjectHolder& value) {
+        if (!value) {
+            return Make<ast::None>();
+        }
+        if (const auto* num = value.TryAs<runtime::Number>()) {
+            return Make<ast::NumericConst>(*num);
+        }
+        if (const auto* str = value.TryAs<runtime::String>()) {
+            return Make<ast::StringConst>(*str);
+        }
+        if (const auto* boolean = value.TryAs<runtime::Bool>()) {
+            return Make<ast::BoolConst>(*boolean);
+        }
+        return nullptr;
+    }
+
+    // Constant folding. An operation over constant operands is evaluated once, on a temporary
+    // node borrowing the operands, and replaced with its value. Operands are always built
+    // before the operation, so folding bottom-up while parsing covers whole subtrees.
+    // If evaluation throws (division by zero, mismatched operand types) the operation
+    // is kept and the error surfaces at run time
+    template <typename T, typename... Args>
+    ast::Statement* MakeFolded(Args... args) {
+        if (options_.fold_constants && (... && IsConstantOperand(args))) {
+            T node(args...);
+            runtime::DummyContext context;
+            runtime::Closure closure;
+            try {
+                if (auto* constant = MakeConstant(node.Execute(closure, context))) {
+                    return constant;
+                }
+            } catch (const std::runtime_error&) {
+            }
+        }
+        return Make<T>(args...);
+    }
+
     // Suite -> NEWLINE INDENT (Statement)+ DEDENT
-    unique_ptr<ast::Statement> ParseSuite()  // NOLINT
+    ast::Statement* ParseSuite()  // NOLINT
     {
-        lexer_.Expect<TokenType::Newline>();
-        lexer_.ExpectNext<TokenType::Indent>();
+        tokens_.Expect<TokenType::Newline>();
+        tokens_.ExpectNext<TokenType::Indent>();
 
-        lexer_.NextToken();
+        tokens_.NextToken();
 
-        auto result = make_unique<ast::Compound>();
-        while (!lexer_.CurrentToken().Is<TokenType::Dedent>()) {
+        auto result = Make<ast::Compound>();
+        while (!tokens_.CurrentToken().Is<TokenType::Dedent>()) {
             result->AddStatement(ParseStatement());  // NOLINT
         }
 
-        lexer_.Expect<TokenType::Dedent>();
-        lexer_.NextToken();
+        tokens_.Expect<TokenType::Dedent>();
+        tokens_.NextToken();
 
         return result;
     }
 
     // Methods -> [def id(Params) : Suite]*
+    // Method bodies go to an arena of their class, which the bodies own, so the class outlives the program
     vector<runtime::Method> ParseMethods()  // NOLINT
     {
         vector<runtime::Method> result;
+        auto arena = make_shared<ast::Arena>();
 
-        while (lexer_.CurrentToken().Is<TokenType::Def>()) {
+        while (tokens_.CurrentToken().Is<TokenType::Def>()) {
             runtime::Method m;
 
-            m.name = lexer_.ExpectNext<TokenType::Id>().value;
-            lexer_.ExpectNext<TokenType::Char>('(');
+            m.name = tokens_.ExpectNext<TokenType::Id>().value;
+            tokens_.ExpectNext<TokenType::Char>('(');
 
-            if (lexer_.NextToken().Is<TokenType::Id>()) {
-                m.formal_params.push_back(lexer_.Expect<TokenType::Id>().value);
-                while (lexer_.NextToken() == ',') {
-                    m.formal_params.push_back(lexer_.ExpectNext<TokenType::Id>().value);
+            if (tokens_.NextToken().Is<TokenType::Id>()) {
+                m.formal_params.push_back(tokens_.Expect<TokenType::Id>().value);
+                while (tokens_.NextToken() == ',') {
+                    m.formal_params.push_back(tokens_.ExpectNext<TokenType::Id>().value);
                 }
             }
 
-            lexer_.Expect<TokenType::Char>(')');
-            lexer_.ExpectNext<TokenType::Char>(':');
-            lexer_.NextToken();
+            tokens_.Expect<TokenType::Char>(')');
+            tokens_.ExpectNext<TokenType::Char>(':');
+            tokens_.NextToken();
 
-            m.body = std::make_unique<ast::MethodBody>(ParseSuite());  // NOLINT
+            // self takes slot 0 and the parameters follow in order, as ClassInstance::Call binds them
+            Scope locals;
+            locals.Resolve(SELF);
+            for (runtime::Symbol param : m.formal_params) {
+                if (locals.slots.count(param) != 0) {
+                    throw ParseError("Duplicate parameter "s + param.Name() + " in method "s + m.name.Name());
+                }
+                locals.Resolve(param);
+            }
+
+            if (options_.eager_method_bodies) {
+                Scope* outer = std::exchange(scope_, &locals);
+                ast::Arena* outer_arena = std::exchange(arena_, arena.get());
+                m.body = std::make_unique<ast::MethodBody>(ParseSuite(), arena);  // NOLINT
+                arena_ = outer_arena;
+                scope_ = outer;
+            } else {
+                m.body = SkipMethodBody(locals, arena);
+            }
+            m.frame_size = locals.names.size();
 
             result.push_back(std::move(m));
         }
         return result;
     }
 
+    // Pre-parse of a suite: only the indentation is checked and the position of the body in
+    // the token buffer is kept. The frame size must be known before the first call, so every
+    // name that can become a local (an id not after '.' and not called) gets its slot now
+    unique_ptr<ast::LazyMethodBody> SkipMethodBody(Scope& locals, shared_ptr<ast::Arena> arena) {
+        const size_t begin = tokens_.Position();
+        tokens_.Expect<TokenType::Newline>();
+        tokens_.ExpectNext<TokenType::Indent>();
+
+        bool after_dot = false;
+        for (int depth = 0;;) {
+            const parse::Token& token = tokens_.CurrentToken();
+            if (token.Is<TokenType::Indent>()) {
+                ++depth;
+            } else if (token.Is<TokenType::Dedent>()) {
+                --depth;
+            } else if (token.Is<TokenType::Eof>()) {
+                throw ParseError("Unexpected end of file in method body"s);
+            } else if (const auto id = token.TryAs<TokenType::Id>(); id && !after_dot
+                       && tokens_.PeekToken() != '(') {
+                locals.Resolve(id->value);
+            }
+            after_dot = token == '.';
+            tokens_.NextToken();
+            if (depth == 0) {
+                break;
+            }
+        }
+
+        has_lazy_bodies_ = true;
+        // Classes declared after the method stay invisible to it, as with eager parsing. The earlier
+        // ones are held until the first call, since the program may be gone by then
+        return make_unique<ast::LazyMethodBody>(
+            [tokens = token_owner_, options = options_, begin, names = locals.names,
+             classes = declared_classes_](ast::Arena& arena) -> ast::MethodBody* {
+                Parser parser{tokens, arena, nullptr, options};
+                parser.tokens_.Rewind(begin);
+                parser.declared_classes_ = classes;
+
+                Scope body_locals;
+                for (runtime::Symbol name : names) {
+                    body_locals.Resolve(name);
+                }
+                parser.scope_ = &body_locals;
+                ast::Statement* suite = parser.ParseSuite();
+                if (body_locals.names.size() != names.size()) {
+                    throw ParseError("Method body uses a variable missed by pre-parse"s);
+                }
+                return parser.Make<ast::MethodBody>(suite);
+            },
+            std::move(arena));
+    }
+
     // ClassDefinition -> Id ['(' Id ')'] : new_line indent MethodList dedent
-    unique_ptr<ast::Statement> ParseClassDefinition()  // NOLINT
+    ast::Statement* ParseClassDefinition()  // NOLINT
     {
-        string class_name = lexer_.Expect<TokenType::Id>().value;
+        runtime::Symbol class_name = tokens_.Expect<TokenType::Id>().value;
 
-        lexer_.NextToken();
+        tokens_.NextToken();
 
         const runtime::Class* base_class = nullptr;
-        if (lexer_.CurrentToken() == '(') {
-            auto name = lexer_.ExpectNext<TokenType::Id>().value;
-            lexer_.ExpectNext<TokenType::Char>(')');
-            lexer_.NextToken();
+        if (tokens_.CurrentToken() == '(') {
+            auto name = tokens_.ExpectNext<TokenType::Id>().value;
+            tokens_.ExpectNext<TokenType::Char>(')');
+            tokens_.NextToken();
 
             auto it = declared_classes_.find(name);
             if (it == declared_classes_.end()) {
-                throw ParseError("Base class "s + name + " not found for class "s + class_name);
+                throw ParseError("Base class "s + name.Name() + " not found for class "s + class_name.Name());
             }
             base_class = static_cast<const runtime::Class*>(it->second.Get());  // NOLINT
         }
 
-        lexer_.Expect<TokenType::Char>(':');
-        lexer_.ExpectNext<TokenType::Newline>();
-        lexer_.ExpectNext<TokenType::Indent>();
-        lexer_.ExpectNext<TokenType::Def>();
+        tokens_.Expect<TokenType::Char>(':');
+        tokens_.ExpectNext<TokenType::Newline>();
+        tokens_.ExpectNext<TokenType::Indent>();
+        tokens_.ExpectNext<TokenType::Def>();
         vector<runtime::Method> methods = ParseMethods();  // NOLINT
 
-        lexer_.Expect<TokenType::Dedent>();
-        lexer_.NextToken();
+        tokens_.Expect<TokenType::Dedent>();
+        tokens_.NextToken();
 
         auto [it, inserted] = declared_classes_.insert({
             class_name,
-            runtime::ObjectHolder::Own(runtime::Class(class_name, std::move(methods), base_class)),
+            runtime::ObjectHolder::Own(runtime::Class(class_name.Name(), std::move(methods), base_class)),
         });
 
         if (!inserted) {
-            throw ParseError("Class "s + class_name + " already exists"s);
+            throw ParseError("Class "s + class_name.Name() + " already exists"s);
+        }
+        if (program_ != nullptr) {
+            program_->AddClass(it->second);
         }
 
-        return make_unique<ast::ClassDefinition>(it->second);
+        return Make<ast::ClassDefinition>(it->second, scope_->Resolve(class_name));
     }
 
-    vector<string> ParseDottedIds() {
-        vector<string> result(1, lexer_.Expect<TokenType::Id>().value);
+    vector<runtime::Symbol> ParseDottedIds() {
+        vector<runtime::Symbol> result(1, tokens_.Expect<TokenType::Id>().value);
 
-        while (lexer_.NextToken() == '.') {
-            result.push_back(lexer_.ExpectNext<TokenType::Id>().value);
+        while (tokens_.NextToken() == '.') {
+            result.push_back(tokens_.ExpectNext<TokenType::Id>().value);
         }
 
         return result;
@@ -136,69 +327,75 @@ private:
 
     //  AssgnOrCall -> DottedIds = Expr
     //               | DottedIds '(' ExprList ')'
-    unique_ptr<ast::Statement> ParseAssignmentOrCall() {
-        lexer_.Expect<TokenType::Id>();
+    ast::Statement* ParseAssignmentOrCall() {
+        tokens_.Expect<TokenType::Id>();
 
-        vector<string> id_list = ParseDottedIds();
-        string last_name = id_list.back();
+        vector<runtime::Symbol> id_list = ParseDottedIds();
+        runtime::Symbol last_name = id_list.back();
         id_list.pop_back();
 
-        if (lexer_.CurrentToken() == '=') {
-            lexer_.NextToken();
+        if (tokens_.CurrentToken() == '=') {
+            tokens_.NextToken();
 
             if (id_list.empty()) {
-                return make_unique<ast::Assignment>(std::move(last_name), ParseTest());
+                const uint32_t slot = scope_->Resolve(last_name);
+                return Make<ast::Assignment>(last_name, ParseTest(), slot);
             }
-            return make_unique<ast::FieldAssignment>(ast::VariableValue{std::move(id_list)},
-                                                     std::move(last_name), ParseTest());
+            return Make<ast::FieldAssignment>(MakeVariable(std::move(id_list)),
+                                              std::move(last_name), ParseTest());
         }
-        lexer_.Expect<TokenType::Char>('(');
-        lexer_.NextToken();
+        tokens_.Expect<TokenType::Char>('(');
+        tokens_.NextToken();
 
         if (id_list.empty()) {
-            throw ParseError("Mython doesn't support functions, only methods: "s + last_name);
+            throw ParseError("Mython doesn't support functions, only methods: "s + last_name.Name());
         }
 
-        vector<unique_ptr<ast::Statement>> args;
-        if (lexer_.CurrentToken() != ')') {
+        ast::StatementList args;
+        if (tokens_.CurrentToken() != ')') {
             args = ParseTestList();
         }
-        lexer_.Expect<TokenType::Char>(')');
-        lexer_.NextToken();
+        tokens_.Expect<TokenType::Char>(')');
+        tokens_.NextToken();
 
-        return make_unique<ast::MethodCall>(make_unique<ast::VariableValue>(std::move(id_list)),
-                                            std::move(last_name), std::move(args));
+        return Make<ast::MethodCall>(Make<ast::VariableValue>(MakeVariable(std::move(id_list))),
+                                     std::move(last_name), std::move(args));
     }
 
     // Expr -> Adder ['+'/'-' Adder]*
-    unique_ptr<ast::Statement> ParseExpression()  // NOLINT
+    ast::Statement* ParseExpression()  // NOLINT
     {
-        unique_ptr<ast::Statement> result = ParseAdder();
-        while (lexer_.CurrentToken() == '+' || lexer_.CurrentToken() == '-') {
-            char op = lexer_.CurrentToken().As<TokenType::Char>().value;
-            lexer_.NextToken();
+        ast::Statement* result = ParseAdder();
+        while (tokens_.CurrentToken() == '+' || tokens_.CurrentToken() == '-') {
+            char op = tokens_.CurrentToken().As<TokenType::Char>().value;
+            tokens_.NextToken();
 
             if (op == '+') {
-                result = make_unique<ast::Add>(std::move(result), ParseAdder());
+                result = MakeFolded<ast::Add>(result, ParseAdder());
             } else {
-                result = make_unique<ast::Sub>(std::move(result), ParseAdder());
+                result = MakeFolded<ast::Sub>(result, ParseAdder());
             }
         }
         return result;
     }
 
     // Adder -> Mult ['*'/'/' Mult]*
-    unique_ptr<ast::Statement> ParseAdder()  // NOLINT
+    ast::Statement* ParseAdder()  // NOLINT
     {
-        unique_ptr<ast::Statement> result = ParseMult();
-        while (lexer_.CurrentToken() == '*' || lexer_.CurrentToken() == '/') {
-            char op = lexer_.CurrentToken().As<TokenType::Char>().value;
-            lexer_.NextToken();
-
-            if (op == '*') {
-                result = make_unique<ast::Mult>(std::move(result), ParseMult());
+        ast::Statement* result = ParseMult();
+        while (tokens_.CurrentToken() == '*' || tokens_.CurrentToken() == '/') {
+            char op = tokens_.CurrentToken().As<TokenType::Char>().value;
+            tokens_.NextToken();
+
+            ast::Statement* rhs = ParseMult();
+            if (op == '/') {
+                result = MakeFolded<ast::Div>(result, rhs);
+            } else if (options_.fold_constants && IsMinusOne(rhs)) {
+                result = MakeFolded<ast::Negate>(result);
+            } else if (options_.fold_constants && IsMinusOne(result)) {
+                result = MakeFolded<ast::Negate>(rhs);
             } else {
-                result = make_unique<ast::Div>(std::move(result), ParseMult());
+                result = MakeFolded<ast::Mult>(result, rhs);
             }
         }
         return result;
@@ -213,185 +410,190 @@ private:
     //       | FALSE
     //       | DottedIds '(' ExprList ')'
     //       | DottedIds
-    unique_ptr<ast::Statement> ParseMult()  // NOLINT
+    ast::Statement* ParseMult()  // NOLINT
     {
-        if (lexer_.CurrentToken() == '(') {
-            lexer_.NextToken();
+        if (tokens_.CurrentToken() == '(') {
+            tokens_.NextToken();
             auto result = ParseTest();
-            lexer_.Expect<TokenType::Char>(')');
-            lexer_.NextToken();
+            tokens_.Expect<TokenType::Char>(')');
+            tokens_.NextToken();
             return result;
         }
-        if (lexer_.CurrentToken() == '-') {
-            lexer_.NextToken();
-            return make_unique<ast::Mult>(ParseMult(), make_unique<ast::NumericConst>(-1));
+        if (tokens_.CurrentToken() == '-') {
+            tokens_.NextToken();
+            return MakeFolded<ast::Negate>(ParseMult());
         }
-        if (const auto* num = lexer_.CurrentToken().TryAs<TokenType::Number>()) {
+        if (const auto num = tokens_.CurrentToken().TryAs<TokenType::Number>()) {
             int result = num->value;
-            lexer_.NextToken();
-            return make_unique<ast::NumericConst>(result);
+            tokens_.NextToken();
+            return Make<ast::NumericConst>(result);
         }
-        if (const auto* str = lexer_.CurrentToken().TryAs<TokenType::String>()) {
-            string result = str->value;
-            lexer_.NextToken();
-            return make_unique<ast::StringConst>(std::move(result));
+        if (const auto str = tokens_.CurrentToken().TryAs<TokenType::String>()) {
+            runtime::String result{string(str->value)};
+            tokens_.NextToken();
+            return Make<ast::StringConst>(result);
         }
-        if (lexer_.CurrentToken().Is<TokenType::True>()) {
-            lexer_.NextToken();
-            return make_unique<ast::BoolConst>(runtime::Bool(true));
+        if (tokens_.CurrentToken().Is<TokenType::True>()) {
+            tokens_.NextToken();
+            return Make<ast::BoolConst>(runtime::Bool(true));
         }
-        if (lexer_.CurrentToken().Is<TokenType::False>()) {
-            lexer_.NextToken();
-            return make_unique<ast::BoolConst>(runtime::Bool(false));
+        if (tokens_.CurrentToken().Is<TokenType::False>()) {
+            tokens_.NextToken();
+            return Make<ast::BoolConst>(runtime::Bool(false));
         }
-        if (lexer_.CurrentToken().Is<TokenType::None>()) {
-            lexer_.NextToken();
-            return make_unique<ast::None>();
+        if (tokens_.CurrentToken().Is<TokenType::None>()) {
+            tokens_.NextToken();
+            return Make<ast::None>();
         }
 
         return ParseDottedIdsInMultExpr();
     }
 
-    std::unique_ptr<ast::Statement> ParseDottedIdsInMultExpr() {
-        vector<string> names = ParseDottedIds();
+    ast::Statement* ParseDottedIdsInMultExpr() {
+        vector<runtime::Symbol> names = ParseDottedIds();
 
-        if (lexer_.CurrentToken() == '(') {
+        if (tokens_.CurrentToken() == '(') {
             // various calls
-            vector<unique_ptr<ast::Statement>> args;
-            if (lexer_.NextToken() != ')') {
+            ast::StatementList args;
+            if (tokens_.NextToken() != ')') {
                 args = ParseTestList();
             }
-            lexer_.Expect<TokenType::Char>(')');
-            lexer_.NextToken();
+            tokens_.Expect<TokenType::Char>(')');
+            tokens_.NextToken();
 
             auto method_name = names.back();
             names.pop_back();
 
             if (!names.empty()) {
-                return make_unique<ast::MethodCall>(
-                    make_unique<ast::VariableValue>(std::move(names)), std::move(method_name),
+                return Make<ast::MethodCall>(
+                    Make<ast::VariableValue>(MakeVariable(std::move(names))), std::move(method_name),
                     std::move(args));
             }
             if (auto it = declared_classes_.find(method_name); it != declared_classes_.end()) {
-                return make_unique<ast::NewInstance>(
+                return Make<ast::NewInstance>(
                     static_cast<const runtime::Class&>(*it->second), std::move(args));  // NOLINT
             }
-            if (method_name == "str"sv) {
+            if (method_name.Name() == "str"sv) {
                 if (args.size() != 1) {
                     throw ParseError("Function str takes exactly one argument"s);
                 }
-                return make_unique<ast::Stringify>(std::move(args.front()));
+                return MakeFolded<ast::Stringify>(args.front().Get());
             }
-            throw ParseError("Unknown call to "s + method_name + "()"s);
+            throw ParseError("Unknown call to "s + method_name.Name() + "()"s);
         }
-        return make_unique<ast::VariableValue>(std::move(names));
+        return Make<ast::VariableValue>(MakeVariable(std::move(names)));
     }
 
-    vector<unique_ptr<ast::Statement>> ParseTestList()  // NOLINT
+    ast::StatementList ParseTestList()  // NOLINT
     {
-        vector<unique_ptr<ast::Statement>> result;
+        ast::StatementList result;
         result.push_back(ParseTest());
 
-        while (lexer_.CurrentToken() == ',') {
-            lexer_.NextToken();
+        while (tokens_.CurrentToken() == ',') {
+            tokens_.NextToken();
             result.push_back(ParseTest());
         }
         return result;
     }
 
     // Condition -> if LogicalExpr: Suite [else: Suite]
-    unique_ptr<ast::Statement> ParseCondition()  // NOLINT
+    ast::Statement* ParseCondition()  // NOLINT
     {
-        lexer_.Expect<TokenType::If>();
-        lexer_.NextToken();
+        tokens_.Expect<TokenType::If>();
+        tokens_.NextToken();
 
         auto condition = ParseTest();
 
-        lexer_.Expect<TokenType::Char>(':');
-        lexer_.NextToken();
+        tokens_.Expect<TokenType::Char>(':');
+        tokens_.NextToken();
 
         auto if_body = ParseSuite();
 
-        unique_ptr<ast::Statement> else_body;
-        if (lexer_.CurrentToken().Is<TokenType::Else>()) {
-            lexer_.ExpectNext<TokenType::Char>(':');
-            lexer_.NextToken();
+        ast::Statement* else_body = nullptr;
+        if (tokens_.CurrentToken().Is<TokenType::Else>()) {
+            tokens_.ExpectNext<TokenType::Char>(':');
+            tokens_.NextToken();
             else_body = ParseSuite();
         }
 
-        return make_unique<ast::IfElse>(std::move(condition), std::move(if_body),
-                                        std::move(else_body));
+        return Make<ast::IfElse>(condition, if_body, else_body);
     }
 
     // LogicalExpr -> AndTest [OR AndTest]
     // AndTest -> NotTest [AND NotTest]
     // NotTest -> [NOT] NotTest
     //          | Comparison
-    unique_ptr<ast::Statement> ParseTest()  // NOLINT
+    ast::Statement* ParseTest()  // NOLINT
     {
         auto result = ParseAndTest();
-        while (lexer_.CurrentToken().Is<TokenType::Or>()) {
-            lexer_.NextToken();
-            result = make_unique<ast::Or>(std::move(result), ParseAndTest());
+        while (tokens_.CurrentToken().Is<TokenType::Or>()) {
+            tokens_.NextToken();
+            ast::Statement* rhs = ParseAndTest();
+            // True or x is True whatever x is; x is never evaluated
+            if (ConstantTruth(result) == true) {
+                result = Make<ast::BoolConst>(runtime::Bool(true));
+            } else {
+                result = MakeFolded<ast::Or>(result, rhs);
+            }
         }
         return result;
     }
 
-    unique_ptr<ast::Statement> ParseAndTest()  // NOLINT
+    ast::Statement* ParseAndTest()  // NOLINT
     {
         auto result = ParseNotTest();
-        while (lexer_.CurrentToken().Is<TokenType::And>()) {
-            lexer_.NextToken();
-            result = make_unique<ast::And>(std::move(result), ParseNotTest());
+        while (tokens_.CurrentToken().Is<TokenType::And>()) {
+            tokens_.NextToken();
+            ast::Statement* rhs = ParseNotTest();
+            // False and x is False whatever x is; x is never evaluated
+            if (ConstantTruth(result) == false) {
+                result = Make<ast::BoolConst>(runtime::Bool(false));
+            } else {
+                result = MakeFolded<ast::And>(result, rhs);
+            }
         }
         return result;
     }
 
-    unique_ptr<ast::Statement> ParseNotTest()  // NOLINT
+    ast::Statement* ParseNotTest()  // NOLINT
     {
-        if (lexer_.CurrentToken().Is<TokenType::Not>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Not>(ParseNotTest());  // NOLINT
+        if (tokens_.CurrentToken().Is<TokenType::Not>()) {
+            tokens_.NextToken();
+            return MakeFolded<ast::Not>(ParseNotTest());  // NOLINT
         }
         return ParseComparison();
     }
 
     // Comparison -> Expr [COMP_OP Expr]
-    unique_ptr<ast::Statement> ParseComparison()  // NOLINT
+    ast::Statement* ParseComparison()  // NOLINT
     {
         auto result = ParseExpression();
 
-        const auto tok = lexer_.CurrentToken();
+        const auto& tok = tokens_.CurrentToken();
 
         if (tok == '<') {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Less, std::move(result),
-                                                ParseExpression());
+            tokens_.NextToken();
+            return MakeFolded<ast::Less>(result, ParseExpression());
         }
         if (tok == '>') {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Greater, std::move(result),
-                                                ParseExpression());
+            tokens_.NextToken();
+            return MakeFolded<ast::Greater>(result, ParseExpression());
         }
         if (tok.Is<TokenType::Eq>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Equal, std::move(result),
-                                                ParseExpression());
+            tokens_.NextToken();
+            return MakeFolded<ast::Equal>(result, ParseExpression());
         }
         if (tok.Is<TokenType::NotEq>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::NotEqual, std::move(result),
-                                                ParseExpression());
+            tokens_.NextToken();
+            return MakeFolded<ast::NotEqual>(result, ParseExpression());
         }
         if (tok.Is<TokenType::LessOrEq>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::LessOrEqual, std::move(result),
-                                                ParseExpression());
+            tokens_.NextToken();
+            return MakeFolded<ast::LessOrEqual>(result, ParseExpression());
         }
         if (tok.Is<TokenType::GreaterOrEq>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::GreaterOrEqual, std::move(result),
-                                                ParseExpression());
+            tokens_.NextToken();
+            return MakeFolded<ast::GreaterOrEqual>(result, ParseExpression());
         }
         return result;
     }
@@ -399,50 +601,66 @@ private:
     // Statement -> SimpleStatement Newline
     //           | class ClassDefinition
     //           | if Condition
-    unique_ptr<ast::Statement> ParseStatement()  // NOLINT
+    ast::Statement* ParseStatement()  // NOLINT
     {
-        const auto& tok = lexer_.CurrentToken();
+        const auto& tok = tokens_.CurrentToken();
 
         if (tok.Is<TokenType::Class>()) {
-            lexer_.NextToken();
+            tokens_.NextToken();
             return ParseClassDefinition();  // NOLINT
         }
         if (tok.Is<TokenType::If>()) {
             return ParseCondition();
         }
         auto result = ParseSimpleStatement();
-        lexer_.Expect<TokenType::Newline>();
-        lexer_.NextToken();
+        tokens_.Expect<TokenType::Newline>();
+        tokens_.NextToken();
         return result;
     }
 
     // StatementBody -> return Expression
     //               | print ExpressionList
     //               | AssignmentOrCall
-    unique_ptr<ast::Statement> ParseSimpleStatement() {
-        const auto& tok = lexer_.CurrentToken();
+    ast::Statement* ParseSimpleStatement() {
+        const auto& tok = tokens_.CurrentToken();
 
         if (tok.Is<TokenType::Return>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Return>(ParseTest());
+            tokens_.NextToken();
+            return Make<ast::Return>(ParseTest());
         }
         if (tok.Is<TokenType::Print>()) {
-            lexer_.NextToken();
-            vector<unique_ptr<ast::Statement>> args;
-            if (!lexer_.CurrentToken().Is<TokenType::Newline>()) {
+            tokens_.NextToken();
+            ast::StatementList args;
+            if (!tokens_.CurrentToken().Is<TokenType::Newline>()) {
                 args = ParseTestList();
             }
-            return make_unique<ast::Print>(std::move(args));
+            return Make<ast::Print>(std::move(args));
         }
         return ParseAssignmentOrCall();
     }
 
-    parse::Lexer& lexer_;
+    parse::TokenCursor tokens_;
+    shared_ptr<const parse::TokenBuffer> token_owner_;
+    ast::Program* program_;
+    ast::Arena* arena_;
+    const ParseOptions options_;
     runtime::Closure declared_classes_;
+    Scope globals_;
+    Scope* scope_ = &globals_;
+    bool has_lazy_bodies_ = false;
 };
 
 }  // namespace
 
-unique_ptr<runtime::Executable> ParseProgram(parse::Lexer& lexer) {
-    return Parser{lexer}.ParseProgram();
+unique_ptr<runtime::Executable> ParseProgram(parse::Lexer& lexer, const ParseOptions& options) {
+    auto tokens = make_shared<parse::TokenBuffer>(lexer.TokenizeAll());
+    auto program = make_unique<ast::Program>();
+    Parser parser{tokens, program->GetArena(), program.get(), options};
+    program->SetBody(parser.ParseProgram());
+    program->SetGlobals(parser.Globals());
+    if (parser.HasLazyBodies()) {
+        // String constants point into the lexer, which is gone before the first call
+        tokens->OwnStrings();
+    }
+    return program;
 }
\ No newline at end of file
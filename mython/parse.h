@@ -15,4 +15,12 @@ struct ParseError : std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
-std::unique_ptr<runtime::Executable> ParseProgram(parse::Lexer& lexer);
\ No newline at end of file
+struct ParseOptions {
+    // Вычислять операции над константами один раз при разборе
+    bool fold_constants = true;
+    // Строить тела методов при разборе класса. Иначе у тела проверяются только отступы,
+    // а разбирается оно при первом вызове, и тогда же проявляются его синтаксические ошибки
+    bool eager_method_bodies = false;
+};
+
+std::unique_ptr<runtime::Executable> ParseProgram(parse::Lexer& lexer, const ParseOptions& options = {});
\ No newline at end of file
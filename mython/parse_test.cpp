@@ -1,8 +1,12 @@
 #include "lexer.h"
 #include "parse.h"
+#include "program_cache.h"
 #include "statement.h"
 #include "test_runner_p.h"
 
+#include <filesystem>
+#include <fstream>
+
 using namespace std;
 
 namespace parse {
@@ -266,6 +270,366 @@ x = X(xh)
     ASSERT_EQUAL(xh->Fields().at("x"s).Get(), closure.at("x"s).Get());
 }
 
+void TestConstantFolding() {
+    const string program = R"(
+class Box:
+  def __init__(v):
+    self.v = v
+
+b = Box(3)
+print -8, 2*5+10/2, 'a' + 'b', str(1 + 2) + '!', -(4 - 6)
+print 1 < 2, 'a' == 'b', not None, True or b.v, False and b.v, 0 or 'x'
+print b.v * -1, -1 * b.v, -b.v - 1
+)"s;
+
+    for (bool fold : {true, false}) {
+        istringstream is(program);
+        parse::Lexer lexer(is);
+        auto tree = ParseProgram(lexer, ParseOptions{fold});
+
+        runtime::DummyContext context;
+        runtime::Closure closure;
+        tree->Execute(closure, context);
+        ASSERT_EQUAL(context.output.str(),
+                     "-8 15 ab 3! 2\nTrue False True True False True\n-3 -3 -4\n"s);
+    }
+
+    auto tree = ParseProgramFromString("x = 1 / 0\n"s);
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    ASSERT_THROWS(tree->Execute(closure, context), std::runtime_error);
+}
+
+void TestVariableSlots() {
+    const string program = R"(
+class Counter:
+  def __init__(start):
+    self.value = start
+    step = 1
+    self.step = step
+
+  def next(n):
+    result = self.value
+    self.value = self.value + n * self.step
+    return result
+
+c = Counter(preset)
+empty = None
+print c.next(2), c.next(3), c.value, empty
+)"s;
+
+    runtime::DummyContext context;
+    runtime::Closure closure = {{"preset"s, runtime::ObjectHolder::Own(runtime::Number(10))}};
+    auto tree = ParseProgramFromString(program);
+    tree->Execute(closure, context);
+
+    ASSERT_EQUAL(context.output.str(), "10 12 15 None\n"s);
+    ASSERT(closure.count("c"s) && closure.count("empty"s) && closure.count("Counter"s));
+    ASSERT(!closure.at("empty"s));
+    ASSERT(!closure.count("step"s) && !closure.count("result"s));
+
+    auto unbound = ParseProgramFromString("x = y\n"s);
+    runtime::Closure unbound_closure;
+    ASSERT_THROWS(unbound->Execute(unbound_closure, context), std::runtime_error);
+}
+
+void TestProgramCache() {
+    const string program = R"(
+class Shape:
+  def __init__(name):
+    self.name = name
+
+  def __str__():
+    return 'Shape ' + self.name
+
+class Rect(Shape):
+  def __init__(w, h):
+    self.name = 'rect'
+    self.w = w
+    self.h = h
+
+  def area():
+    if self.w > 0 and not self.h <= 0:
+      return self.w * self.h
+    else:
+      return 0
+
+r = Rect(2 + 1, x)
+s = Shape('dot')
+print r.area(), str(s), r.w != 3, -r.h, 'a' < 'b'
+)"s;
+
+    auto make_closure = [] {
+        return runtime::Closure{{"x"s, runtime::ObjectHolder::Own(runtime::Number(4))}};
+    };
+
+    runtime::DummyContext expected;
+    auto closure = make_closure();
+    auto tree = ParseProgramFromString(program);
+    tree->Execute(closure, expected);
+
+    const auto& parsed = dynamic_cast<const ast::Program&>(*tree);
+    const string data = ast::SerializeProgram(parsed);
+    auto restored = ast::DeserializeProgram(data);
+    ASSERT_EQUAL(ast::SerializeProgram(*restored), data);
+
+    runtime::DummyContext context;
+    auto restored_closure = make_closure();
+    restored->Execute(restored_closure, context);
+    ASSERT_EQUAL(context.output.str(), expected.output.str());
+    ASSERT(restored_closure.count("r"s) && restored_closure.count("Rect"s));
+
+    ASSERT_THROWS(static_cast<void>(ast::DeserializeProgram(data.substr(0, data.size() / 2))),
+                  ast::ProgramFormatError);
+
+    const auto directory = std::filesystem::temp_directory_path() / ("mython_cache_test_"s + to_string(data.size()));
+    std::filesystem::remove_all(directory);
+    const ast::ProgramCache cache(directory);
+    ASSERT(!cache.Load(program));
+    ASSERT(cache.Store(program, parsed));
+
+    auto cached = cache.Load(program);
+    ASSERT(cached);
+    runtime::DummyContext cached_context;
+    auto cached_closure = make_closure();
+    cached->Execute(cached_closure, cached_context);
+    ASSERT_EQUAL(cached_context.output.str(), expected.output.str());
+
+    ASSERT(!cache.Load(program + "print 1\n"s));
+
+    // Файл с тем же хешем и длиной, но другим текстом не принимается за попадание
+    string other = program;
+    other.replace(other.find("'dot'"s), 5, "'dox'"s);
+    const auto other_path = cache.PathFor(other);
+    std::filesystem::copy_file(cache.PathFor(program), other_path);
+    {
+        const uint64_t other_hash = stoull(other_path.filename().string().substr(0, 16), nullptr, 16);
+        std::fstream file(other_path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(4);
+        file.write(reinterpret_cast<const char*>(&other_hash), sizeof(other_hash));
+    }
+    ASSERT(!cache.Load(other));
+    std::filesystem::remove_all(directory);
+}
+
+// Повреждённые данные отвергаются при чтении, а не ломают выполнение или выделение памяти
+void TestDamagedProgramData() {
+    auto tree = ParseProgramFromString("x = 1\ny = not x\n"s);
+    const string data = ast::SerializeProgram(dynamic_cast<const ast::Program&>(*tree));
+    ASSERT(ast::DeserializeProgram(data));
+
+    // Хвост данных: Not, затем VariableValue x — тег, слот, длина пути и символ
+    const size_t variable_size = 1 + 3 * sizeof(uint32_t);
+    const size_t slot_at = data.size() - variable_size + 1;
+    string bad_slot = data;
+    const uint32_t slot = 2;
+    bad_slot.replace(slot_at, sizeof(slot), reinterpret_cast<const char*>(&slot), sizeof(slot));
+    ASSERT_THROWS(static_cast<void>(ast::DeserializeProgram(bad_slot)), ast::ProgramFormatError);
+
+    // Число символов идёт после сигнатуры, версии формата и версии интерпретатора
+    string bad_count = data;
+    const size_t count_at = 4 + sizeof(uint32_t) + sizeof(uint32_t) + ast::INTERPRETER_VERSION.size();
+    const uint32_t count = 0x7FFFFFFF;
+    bad_count.replace(count_at, sizeof(count), reinterpret_cast<const char*>(&count), sizeof(count));
+    ASSERT_THROWS(static_cast<void>(ast::DeserializeProgram(bad_count)), ast::ProgramFormatError);
+
+    const size_t not_at = data.size() - variable_size - 1;
+    const string deep = data.substr(0, not_at) + string(1'000'000, data[not_at]) + data.substr(not_at + 1);
+    ASSERT_THROWS(static_cast<void>(ast::DeserializeProgram(deep)), ast::ProgramFormatError);
+}
+
+void TestLazyMethodBodies() {
+    const string program = R"(
+class Greeter:
+  def greet(name):
+    greeting = 'Hello, '
+    if name == '':
+      name = 'stranger'
+    return greeting + name + '!'
+
+  def broken():
+    return 1 +
+
+g = Greeter()
+print g.greet('Bob'), g.greet('')
+)"s;
+
+    auto parse = [&program](bool eager) {
+        istringstream is(program);
+        parse::Lexer lexer(is);
+        ParseOptions options;
+        options.eager_method_bodies = eager;
+        return ParseProgram(lexer, options);
+    };
+
+    ASSERT_THROWS(static_cast<void>(parse(true)), std::runtime_error);
+
+    auto tree = parse(false);
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    tree->Execute(closure, context);
+    ASSERT_EQUAL(context.output.str(), "Hello, Bob! Hello, stranger!\n"s);
+
+    const auto& greeter = *closure.at("Greeter"s).TryAs<runtime::Class>();
+    ASSERT(dynamic_cast<ast::LazyMethodBody&>(*greeter.GetMethod("greet"s)->body).IsParsed());
+    ASSERT(!dynamic_cast<ast::LazyMethodBody&>(*greeter.GetMethod("broken"s)->body).IsParsed());
+
+    auto& instance = *closure.at("g"s).TryAs<runtime::ClassInstance>();
+    ASSERT_THROWS(static_cast<void>(instance.Call("broken"s, {}, context)), std::runtime_error);
+
+    // Кеш не меняет поведения: программа с ошибкой в невызванном методе просто не сохраняется
+    const auto directory = std::filesystem::temp_directory_path() / "mython_cache_test_lazy"s;
+    std::filesystem::remove_all(directory);
+    const ast::ProgramCache cache(directory);
+    ASSERT(!cache.Store(program, dynamic_cast<const ast::Program&>(*parse(false))));
+    ASSERT(!cache.Load(program));
+    std::filesystem::remove_all(directory);
+
+    // Class declared after the method is not visible to it in either mode
+    auto later = ParseProgramFromString(R"(
+class A:
+  def make():
+    return B()
+
+class B:
+  def __init__():
+    self.x = 1
+
+a = A()
+b = a.make()
+)"s);
+    runtime::Closure later_closure;
+    ASSERT_THROWS(later->Execute(later_closure, context), ParseError);
+
+    ASSERT_THROWS(static_cast<void>(ParseProgramFromString("class C:\n  def f():\n")), std::runtime_error);
+}
+
+// Хвостовая рекурсия на миллион шагов не расходует стек C++
+// Классы из Closure вызываются и после разрушения программы, в том числе методы,
+// которые до этого ни разу не разбирались
+void TestClassesOutliveProgram() {
+    const string program = R"(
+class Base:
+  def describe():
+    return 'base'
+
+class Greeter(Base):
+  def greet(name):
+    return 'Hello, ' + name + ' from ' + self.describe()
+
+  def make():
+    return Base()
+
+g = Greeter()
+)"s;
+
+    for (int mode = 0; mode < 3; ++mode) {
+        runtime::Closure closure;
+        {
+            istringstream is(program);
+            parse::Lexer lexer(is);
+            ParseOptions options;
+            options.eager_method_bodies = mode == 0;
+            unique_ptr<runtime::Executable> tree = ParseProgram(lexer, options);
+            if (mode == 2) {
+                tree = ast::DeserializeProgram(ast::SerializeProgram(dynamic_cast<const ast::Program&>(*tree)));
+            }
+            runtime::DummyContext context;
+            tree->Execute(closure, context);
+        }
+
+        runtime::DummyContext context;
+        auto& greeter = *closure.at("g"s).TryAs<runtime::ClassInstance>();
+        const auto greeting = greeter.Call("greet"s, {runtime::ObjectHolder::Own(runtime::String("Bob"s))}, context);
+        ASSERT_EQUAL(greeting.TryAs<runtime::String>()->GetValue(), "Hello, Bob from base"s);
+        const auto made = greeter.Call("make"s, {}, context);
+        ASSERT_EQUAL(made.TryAs<runtime::ClassInstance>()->GetClass().GetName(), "Base"s);
+    }
+}
+
+// Хвостовые вызовы переиспользуют фрейм: цепочка в 10000 шагов проходит при пределе глубины 1000
+void TestTailCalls() {
+    const string program = R"(
+class Odd:
+  def check(n, other):
+    if n == 0:
+      return False
+    return other.check(n - 1, self)
+
+class Even:
+  def check(n, other):
+    if n == 0:
+      return True
+    return other.check(n - 1, self)
+
+  def sum(n, total):
+    if n == 0:
+      return total
+    return self.sum(n - 1, total + n)
+
+class Printer:
+  def show(value):
+    print 'result', value
+
+even = Even()
+odd = Odd()
+print even.check(10000, odd), odd.check(9999, even), even.sum(10000, 0)
+printer = Printer()
+return printer.show(even.sum(3, 0))
+print 'unreachable'
+)"s;
+
+    runtime::DummyContext context;
+    context.SetMaxCallDepth(1000);
+    runtime::Closure closure;
+    auto tree = ParseProgramFromString(program);
+    tree->Execute(closure, context);
+    ASSERT_EQUAL(context.output.str(), "True True 50005000\nresult 6\n"s);
+
+    // Фрейм хвостового вызова начинается пустым: локальные переменные прошлого шага не видны
+    auto reused = ParseProgramFromString(R"(
+class Stale:
+  def f(n):
+    if n > 0:
+      seen = n
+      return self.f(n - 1)
+    return seen
+
+s = Stale()
+x = s.f(1)
+)"s);
+    runtime::Closure reused_closure;
+    ASSERT_THROWS(reused->Execute(reused_closure, context), std::runtime_error);
+}
+
+// Предел глубины вызовов даёт исключение вместо переполнения стека; хвостовые вызовы
+// в глубину не засчитываются
+void TestCallDepthLimit() {
+    auto tree = ParseProgramFromString(R"(
+class Walker:
+  def down(n):
+    if n == 0:
+      return 0
+    return 1 + self.down(n - 1)
+
+  def loop(n):
+    if n == 0:
+      return 0
+    return self.loop(n - 1)
+
+w = Walker()
+print w.loop(1000)
+print w.down(60)
+)"s);
+
+    runtime::DummyContext context;
+    context.SetMaxCallDepth(50);
+    runtime::Closure closure;
+    ASSERT_THROWS(tree->Execute(closure, context), runtime::RecursionError);
+    ASSERT_EQUAL(context.output.str(), "0\n"s);
+    ASSERT_EQUAL(context.GetCallDepth(), 0u);
+}
+
 }  // namespace parse
 
 void TestParseProgram(TestRunner& tr) {
@@ -278,4 +642,12 @@ void TestParseProgram(TestRunner& tr) {
     RUN_TEST(tr, parse::TestComplexLogicalExpression);
     RUN_TEST(tr, parse::TestClassicalPolymorphism);
     RUN_TEST(tr, parse::TestSelf);
+    RUN_TEST(tr, parse::TestConstantFolding);
+    RUN_TEST(tr, parse::TestVariableSlots);
+    RUN_TEST(tr, parse::TestProgramCache);
+    RUN_TEST(tr, parse::TestDamagedProgramData);
+    RUN_TEST(tr, parse::TestLazyMethodBodies);
+    RUN_TEST(tr, parse::TestClassesOutliveProgram);
+    RUN_TEST(tr, parse::TestTailCalls);
+    RUN_TEST(tr, parse::TestCallDepthLimit);
 }
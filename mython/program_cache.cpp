@@ -0,0 +1,722 @@
+#include "program_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <new>
+#include <random>
+#include <sstream>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MYTHON_HAS_MMAP 1
+#endif
+
+using namespace std;
+
+namespace ast {
+
+namespace {
+
+constexpr char PROGRAM_MAGIC[4] = {'M', 'Y', 'P', 'G'};
+// Вторая версия заголовка хранит текст программы
+constexpr char CACHE_MAGIC[4] = {'M', 'Y', 'C', '2'};
+
+enum class NodeTag : uint8_t {
+#define MYTHON_NODE_TAG(T) T,
+    MYTHON_AST_NODES(MYTHON_NODE_TAG)
+#undef MYTHON_NODE_TAG
+};
+
+// Отсутствующий необязательный узел, например ветка else
+constexpr uint8_t NO_NODE = 0xFF;
+
+// Предел вложенности узлов при чтении: испорченный файл не должен исчерпать стек, в том числе
+// в сборке без оптимизаций или с санитайзерами. Чтение более глубокой программы — промах кеша
+constexpr size_t MAX_NODE_DEPTH = 1024;
+
+template <typename T>
+constexpr NodeTag TAG_OF = NodeTag{};
+
+#define MYTHON_NODE_TAG_OF(T) \
+    template <>               \
+    constexpr NodeTag TAG_OF<T> = NodeTag::T;
+MYTHON_AST_NODES(MYTHON_NODE_TAG_OF)
+#undef MYTHON_NODE_TAG_OF
+
+// Сравнения сохраняются номером в этой таблице
+const Comparison::Comparator COMPARATORS[] = {
+    runtime::Equal, runtime::NotEqual, runtime::Less, runtime::Greater, runtime::LessOrEqual, runtime::GreaterOrEqual,
+};
+
+class Writer {
+public:
+    template <typename T>
+    void Put(T value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        out_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void PutString(std::string_view str) {
+        Put(static_cast<uint32_t>(str.size()));
+        out_.append(str);
+    }
+
+    void PutBytes(const char* data, size_t size) {
+        out_.append(data, size);
+    }
+
+    [[nodiscard]] const std::string& Data() const {
+        return out_;
+    }
+
+private:
+    std::string out_;
+};
+
+class Reader {
+public:
+    explicit Reader(std::string_view data)
+        : it_(data.data()), end_(data.data() + data.size()) {
+    }
+
+    template <typename T>
+    T Get() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, Take(sizeof(value)), sizeof(value));
+        return value;
+    }
+
+    std::string_view GetString() {
+        const auto size = Get<uint32_t>();
+        return {Take(size), size};
+    }
+
+    const char* Take(size_t size) {
+        if (Remaining() < size)
+            throw ProgramFormatError("Unexpected end of program data"s);
+        const char* result = it_;
+        it_ += size;
+        return result;
+    }
+
+    // Число элементов списка; каждый занимает хотя бы min_size байт, поэтому число больше
+    // оставшихся данных означает повреждение, а не повод выделять под него память
+    size_t GetCount(size_t min_size) {
+        const auto count = Get<uint32_t>();
+        if (count > Remaining() / min_size)
+            throw ProgramFormatError("Bad element count"s);
+        return count;
+    }
+
+    [[nodiscard]] size_t Remaining() const {
+        return static_cast<size_t>(end_ - it_);
+    }
+
+    [[nodiscard]] bool AtEnd() const {
+        return it_ == end_;
+    }
+
+private:
+    const char* it_;
+    const char* end_;
+};
+
+class ProgramWriter {
+public:
+    explicit ProgramWriter(const Program& program) {
+        for (const auto& cls : program.GetClasses())
+            class_index_.emplace(cls.TryAs<runtime::Class>(), static_cast<uint32_t>(class_index_.size()));
+
+        body_.Put(static_cast<uint32_t>(program.GetGlobals().size()));
+        for (runtime::Symbol global : program.GetGlobals())
+            PutSymbol(global);
+
+        body_.Put(static_cast<uint32_t>(program.GetClasses().size()));
+        for (const auto& cls : program.GetClasses())
+            WriteClass(*cls.TryAs<runtime::Class>());
+
+        WriteNode(&program.GetBody());
+    }
+
+    // Символы пишутся перед узлами, чтобы читатель интернировал их один раз
+    std::string Finish() const {
+        Writer result;
+        result.PutBytes(PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC));
+        result.Put(PROGRAM_FORMAT_VERSION);
+        result.PutString(INTERPRETER_VERSION);
+        result.Put(static_cast<uint32_t>(symbols_.size()));
+        for (runtime::Symbol symbol : symbols_)
+            result.PutString(symbol.Name());
+        result.PutBytes(body_.Data().data(), body_.Data().size());
+        return result.Data();
+    }
+
+private:
+    void PutSymbol(runtime::Symbol symbol) {
+        auto [it, inserted] = symbol_index_.emplace(symbol, static_cast<uint32_t>(symbols_.size()));
+        if (inserted)
+            symbols_.push_back(symbol);
+        body_.Put(it->second);
+    }
+
+    void PutClass(const runtime::Class& cls) {
+        auto it = class_index_.find(&cls);
+        if (it == class_index_.end())
+            throw ProgramFormatError("Class "s + cls.GetName() + " is not declared by the program"s);
+        body_.Put(it->second);
+    }
+
+    void PutList(const StatementList& nodes) {
+        body_.Put(static_cast<uint32_t>(nodes.size()));
+        for (const auto& node : nodes)
+            WriteNode(node.Get());
+    }
+
+    void PutVariable(const VariableValue& node) {
+        body_.Put(node.GetSlot());
+        body_.Put(static_cast<uint32_t>(node.GetDottedIds().size()));
+        for (runtime::Symbol id : node.GetDottedIds())
+            PutSymbol(id);
+    }
+
+    void WriteClass(const runtime::Class& cls) {
+        body_.PutString(cls.GetName());
+        if (cls.GetParent() != nullptr) {
+            body_.Put(uint8_t{1});
+            PutClass(*cls.GetParent());
+        } else
+            body_.Put(uint8_t{0});
+
+        // Порядок методов в хеш-таблице зависит от порядка вставки: сортировка по имени делает
+        // файл одинаковым для одной и той же программы
+        std::vector<const runtime::Method*> methods;
+        for (const auto& [name, method] : cls.GetMethods())
+            methods.push_back(&method);
+        std::sort(methods.begin(), methods.end(), [](const runtime::Method* lhs, const runtime::Method* rhs) {
+            return lhs->name.Name() < rhs->name.Name();
+        });
+
+        body_.Put(static_cast<uint32_t>(methods.size()));
+        for (const runtime::Method* method_ptr : methods) {
+            const runtime::Method& method = *method_ptr;
+            // Отложенное тело разбирается здесь: в файл попадает готовое дерево. Тело с ошибкой
+            // не сохраняется, чтобы она, как и без кеша, проявилась только при вызове метода
+            const MethodBody* body = dynamic_cast<const MethodBody*>(method.body.get());
+            if (auto* lazy = dynamic_cast<LazyMethodBody*>(method.body.get())) {
+                try {
+                    body = &lazy->GetBody();
+                } catch (const std::runtime_error&) {
+                    throw ProgramFormatError("Method "s + method.name.Name() + " has syntax errors"s);
+                }
+            }
+            if (body == nullptr)
+                throw ProgramFormatError("Method "s + method.name.Name() + " has no Mython body"s);
+
+            PutSymbol(method.name);
+            body_.Put(static_cast<uint32_t>(method.formal_params.size()));
+            for (runtime::Symbol param : method.formal_params)
+                PutSymbol(param);
+            body_.Put(static_cast<uint64_t>(method.frame_size));
+            WriteNode(&body->GetBody());
+        }
+    }
+
+    void WriteNode(const Statement* node) {
+        if (node == nullptr) {
+            body_.Put(NO_NODE);
+            return;
+        }
+
+        VisitNode(*node, [this](const auto& n) {
+            using T = std::decay_t<decltype(n)>;
+            if constexpr (std::is_same_v<T, Statement> || std::is_same_v<T, MethodBody>) {
+                throw ProgramFormatError("Node "s + typeid(n).name() + " cannot be saved"s);
+            } else {
+                body_.Put(TAG_OF<T>);
+                WriteFields(n);
+            }
+        });
+    }
+
+    void WriteFields(const NumericConst& node) {
+        body_.Put(static_cast<int32_t>(node.GetValue().GetValue()));
+    }
+
+    void WriteFields(const StringConst& node) {
+        body_.PutString(node.GetValue().GetValue());
+    }
+
+    void WriteFields(const BoolConst& node) {
+        body_.Put(static_cast<uint8_t>(node.GetValue().GetValue()));
+    }
+
+    void WriteFields(const VariableValue& node) {
+        PutVariable(node);
+    }
+
+    void WriteFields(const Assignment& node) {
+        PutSymbol(node.GetName());
+        body_.Put(node.GetSlot());
+        WriteNode(&node.GetValue());
+    }
+
+    void WriteFields(const FieldAssignment& node) {
+        PutVariable(node.GetObject());
+        PutSymbol(node.GetFieldName());
+        WriteNode(&node.GetValue());
+    }
+
+    void WriteFields(const None& /*node*/) {
+    }
+
+    void WriteFields(const Print& node) {
+        if (node.GetVariable() != nullptr)
+            throw ProgramFormatError("Print::Variable cannot be saved"s);
+        PutList(node.GetArgs());
+    }
+
+    void WriteFields(const MethodCall& node) {
+        WriteNode(&node.GetObject());
+        PutSymbol(node.GetMethod());
+        PutList(node.GetArgs());
+    }
+
+    void WriteFields(const NewInstance& node) {
+        PutClass(node.GetClass());
+        PutList(node.GetArgs());
+    }
+
+    void WriteFields(const UnaryOperation& node) {
+        WriteNode(&node.GetArgument());
+    }
+
+    void WriteFields(const BinaryOperation& node) {
+        WriteNode(&node.GetLhs());
+        WriteNode(&node.GetRhs());
+    }
+
+    void WriteFields(const Comparison& node) {
+        const auto it = std::find(std::begin(COMPARATORS), std::end(COMPARATORS), node.GetComparator());
+        if (it == std::end(COMPARATORS))
+            throw ProgramFormatError("Unknown comparison cannot be saved"s);
+        body_.Put(static_cast<uint8_t>(it - std::begin(COMPARATORS)));
+        WriteNode(&node.GetLhs());
+        WriteNode(&node.GetRhs());
+    }
+
+    // Оператор уже задан тегом узла
+    template <CompareOp OP>
+    void WriteFields(const Compare<OP>& node) {
+        WriteNode(&node.GetLhs());
+        WriteNode(&node.GetRhs());
+    }
+
+    void WriteFields(const Compound& node) {
+        PutList(node.GetStatements());
+    }
+
+    void WriteFields(const Return& node) {
+        WriteNode(&node.GetStatement());
+    }
+
+    void WriteFields(const ClassDefinition& node) {
+        PutClass(*node.GetClass().TryAs<runtime::Class>());
+        body_.Put(node.GetSlot());
+    }
+
+    void WriteFields(const IfElse& node) {
+        WriteNode(&node.GetCondition());
+        WriteNode(&node.GetIfBody());
+        WriteNode(node.GetElseBody());
+    }
+
+    Writer body_;
+    std::vector<runtime::Symbol> symbols_;
+    std::unordered_map<runtime::Symbol, uint32_t> symbol_index_;
+    std::unordered_map<const runtime::Class*, uint32_t> class_index_;
+};
+
+class ProgramReader {
+public:
+    ProgramReader(std::string_view data, Program& program)
+        : in_(data), program_(program), arena_(&program.GetArena()) {
+    }
+
+    void Read() {
+        if (std::memcmp(in_.Take(sizeof(PROGRAM_MAGIC)), PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC)) != 0)
+            throw ProgramFormatError("Not a Mython program"s);
+        if (in_.Get<uint32_t>() != PROGRAM_FORMAT_VERSION || in_.GetString() != INTERPRETER_VERSION)
+            throw ProgramFormatError("Program was saved by another interpreter version"s);
+
+        symbols_.resize(in_.GetCount(sizeof(uint32_t)));
+        for (auto& symbol : symbols_)
+            symbol = in_.GetString();
+
+        std::vector<runtime::Symbol> globals(in_.GetCount(sizeof(uint32_t)));
+        for (auto& global : globals)
+            global = GetSymbol();
+        program_.SetGlobals(std::move(globals));
+
+        const auto class_count = in_.Get<uint32_t>();
+        for (uint32_t i = 0; i < class_count; ++i)
+            ReadClass();
+
+        frame_size_ = program_.GetGlobals().size();
+        program_.SetBody(ReadRequiredNode());
+        if (!in_.AtEnd())
+            throw ProgramFormatError("Trailing program data"s);
+    }
+
+private:
+    runtime::Symbol GetSymbol() {
+        const auto index = in_.Get<uint32_t>();
+        if (index >= symbols_.size())
+            throw ProgramFormatError("Bad symbol index"s);
+        return symbols_[index];
+    }
+
+    const runtime::ObjectHolder& GetClass() {
+        const auto index = in_.Get<uint32_t>();
+        if (index >= program_.GetClasses().size())
+            throw ProgramFormatError("Bad class index"s);
+        return program_.GetClasses()[index];
+    }
+
+    void ReadClass() {
+        std::string name(in_.GetString());
+        const runtime::Class* parent = nullptr;
+        if (in_.Get<uint8_t>() != 0)
+            parent = GetClass().TryAs<runtime::Class>();
+
+        // Имя, число параметров, размер фрейма и тег тела
+        constexpr size_t MIN_METHOD_SIZE = 2 * sizeof(uint32_t) + sizeof(uint64_t) + 1;
+        std::vector<runtime::Method> methods(in_.GetCount(MIN_METHOD_SIZE));
+        // Тела методов, как и при разборе, читаются в арену класса
+        auto class_arena = std::make_shared<Arena>();
+        Arena* program_arena = std::exchange(arena_, class_arena.get());
+        for (auto& method : methods) {
+            method.name = GetSymbol();
+            method.formal_params.resize(in_.GetCount(sizeof(uint32_t)));
+            for (auto& param : method.formal_params)
+                param = GetSymbol();
+            // В слотах лежат self, параметры и локальные переменные, у каждой из которых есть символ
+            const auto frame_size = in_.Get<uint64_t>();
+            if (frame_size != 0 && (frame_size <= method.formal_params.size() || frame_size > symbols_.size() + 1))
+                throw ProgramFormatError("Bad frame size of method "s + method.name.Name());
+            method.frame_size = static_cast<size_t>(frame_size);
+            frame_size_ = method.frame_size;
+            method.body = std::make_unique<MethodBody>(ReadRequiredNode(), class_arena);
+        }
+        arena_ = program_arena;
+        program_.AddClass(runtime::ObjectHolder::Own(runtime::Class(std::move(name), std::move(methods), parent)));
+    }
+
+    // Слот читаемой области видимости: фрейма метода или глобальных переменных
+    uint32_t GetSlot() {
+        const auto slot = in_.Get<uint32_t>();
+        if (slot != NO_SLOT && slot >= frame_size_)
+            throw ProgramFormatError("Bad slot "s + std::to_string(slot));
+        return slot;
+    }
+
+    VariableValue GetVariable() {
+        const auto slot = GetSlot();
+        std::vector<runtime::Symbol> dotted_ids(in_.GetCount(sizeof(uint32_t)));
+        if (dotted_ids.empty())
+            throw ProgramFormatError("Empty variable path"s);
+        for (auto& id : dotted_ids)
+            id = GetSymbol();
+        return VariableValue(std::move(dotted_ids), slot);
+    }
+
+    StatementList GetList() {
+        StatementList nodes(in_.GetCount(1));
+        for (auto& node : nodes)
+            node = ReadRequiredNode();
+        return nodes;
+    }
+
+    Statement* ReadRequiredNode() {
+        Statement* node = ReadNode();
+        if (node == nullptr)
+            throw ProgramFormatError("Missing node"s);
+        return node;
+    }
+
+    template <typename T>
+    Statement* ReadUnary() {
+        Statement* argument = ReadRequiredNode();
+        return arena_->Make<T>(argument);
+    }
+
+    template <typename T>
+    Statement* ReadBinary() {
+        Statement* lhs = ReadRequiredNode();
+        Statement* rhs = ReadRequiredNode();
+        return arena_->Make<T>(lhs, rhs);
+    }
+
+    Statement* ReadNode() {
+        if (++depth_ > MAX_NODE_DEPTH)
+            throw ProgramFormatError("Program tree is too deep"s);
+        Statement* node = ReadNodeFields();
+        --depth_;
+        return node;
+    }
+
+    Statement* ReadNodeFields() {
+        const auto tag = in_.Get<uint8_t>();
+        if (tag == NO_NODE)
+            return nullptr;
+
+        switch (static_cast<NodeTag>(tag)) {
+            case NodeTag::NumericConst:
+                return arena_->Make<NumericConst>(runtime::Number(in_.Get<int32_t>()));
+            case NodeTag::StringConst:
+                return arena_->Make<StringConst>(runtime::String(std::string(in_.GetString())));
+            case NodeTag::BoolConst:
+                return arena_->Make<BoolConst>(runtime::Bool(in_.Get<uint8_t>() != 0));
+            case NodeTag::VariableValue:
+                return arena_->Make<VariableValue>(GetVariable());
+            case NodeTag::Assignment: {
+                const runtime::Symbol name = GetSymbol();
+                const auto slot = GetSlot();
+                return arena_->Make<Assignment>(name, ReadRequiredNode(), slot);
+            }
+            case NodeTag::FieldAssignment: {
+                VariableValue object = GetVariable();
+                const runtime::Symbol field = GetSymbol();
+                return arena_->Make<FieldAssignment>(std::move(object), field, ReadRequiredNode());
+            }
+            case NodeTag::None:
+                return arena_->Make<None>();
+            case NodeTag::Print:
+                return arena_->Make<Print>(GetList());
+            case NodeTag::MethodCall: {
+                Statement* object = ReadRequiredNode();
+                const runtime::Symbol method = GetSymbol();
+                return arena_->Make<MethodCall>(object, method, GetList());
+            }
+            case NodeTag::NewInstance: {
+                const auto& cls = *GetClass().TryAs<runtime::Class>();
+                return arena_->Make<NewInstance>(cls, GetList());
+            }
+            case NodeTag::Stringify:
+                return ReadUnary<Stringify>();
+            case NodeTag::Add:
+                return ReadBinary<Add>();
+            case NodeTag::Sub:
+                return ReadBinary<Sub>();
+            case NodeTag::Mult:
+                return ReadBinary<Mult>();
+            case NodeTag::Div:
+                return ReadBinary<Div>();
+            case NodeTag::Or:
+                return ReadBinary<Or>();
+            case NodeTag::And:
+                return ReadBinary<And>();
+            case NodeTag::Not:
+                return ReadUnary<Not>();
+            case NodeTag::Negate:
+                return ReadUnary<Negate>();
+            case NodeTag::Compound: {
+                auto* compound = arena_->Make<Compound>();
+                for (auto& statement : GetList())
+                    compound->AddStatement(std::move(statement));
+                return compound;
+            }
+            case NodeTag::Return:
+                return ReadUnary<Return>();
+            case NodeTag::ClassDefinition: {
+                const runtime::ObjectHolder& cls = GetClass();
+                return arena_->Make<ClassDefinition>(cls, GetSlot());
+            }
+            case NodeTag::IfElse: {
+                Statement* condition = ReadRequiredNode();
+                Statement* if_body = ReadRequiredNode();
+                Statement* else_body = ReadNode();
+                return arena_->Make<IfElse>(condition, if_body, else_body);
+            }
+            case NodeTag::Comparison: {
+                const auto index = in_.Get<uint8_t>();
+                if (index >= std::size(COMPARATORS))
+                    throw ProgramFormatError("Bad comparison"s);
+                Statement* lhs = ReadRequiredNode();
+                Statement* rhs = ReadRequiredNode();
+                return arena_->Make<Comparison>(COMPARATORS[index], lhs, rhs);
+            }
+            case NodeTag::Equal:
+                return ReadBinary<Equal>();
+            case NodeTag::NotEqual:
+                return ReadBinary<NotEqual>();
+            case NodeTag::Less:
+                return ReadBinary<Less>();
+            case NodeTag::Greater:
+                return ReadBinary<Greater>();
+            case NodeTag::LessOrEqual:
+                return ReadBinary<LessOrEqual>();
+            case NodeTag::GreaterOrEqual:
+                return ReadBinary<GreaterOrEqual>();
+            default:
+                throw ProgramFormatError("Bad node tag "s + std::to_string(tag));
+        }
+    }
+
+    Reader in_;
+    Program& program_;
+    Arena* arena_;
+    std::vector<runtime::Symbol> symbols_;
+    // Размер фрейма области, тело которой сейчас читается
+    size_t frame_size_ = 0;
+    size_t depth_ = 0;
+};
+
+// FNV-1a
+uint64_t HashSource(std::string_view source) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : source) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Файл кеша целиком: отображение в память, а где его нет — обычное чтение
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path& path) {
+#ifdef MYTHON_HAS_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info {};
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = static_cast<const char*>(data);
+                size_ = static_cast<size_t>(info.st_size);
+            }
+        }
+        ::close(fd);
+#else
+        std::ifstream input(path, std::ios::binary);
+        if (!input)
+            return;
+        std::ostringstream buffer;
+        buffer << input.rdbuf();
+        copy_ = std::move(buffer).str();
+        data_ = copy_.data();
+        size_ = copy_.size();
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef MYTHON_HAS_MMAP
+        if (data_ != nullptr)
+            ::munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    [[nodiscard]] std::string_view View() const {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifndef MYTHON_HAS_MMAP
+    std::string copy_;
+#endif
+};
+
+}  // namespace
+
+std::string SerializeProgram(const Program& program) {
+    return ProgramWriter(program).Finish();
+}
+
+std::unique_ptr<Program> DeserializeProgram(std::string_view data) {
+    auto program = std::make_unique<Program>();
+    ProgramReader(data, *program).Read();
+    return program;
+}
+
+ProgramCache::ProgramCache(std::filesystem::path directory) : directory_(std::move(directory)) {
+}
+
+std::filesystem::path ProgramCache::PathFor(std::string_view source) const {
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << HashSource(source) << "-v"sv << std::dec
+         << PROGRAM_FORMAT_VERSION << ".mpc"sv;
+    return directory_ / name.str();
+}
+
+// Файл кеша: CACHE_MAGIC, хеш и текст программы, затем SerializeProgram. Хеш выбирает файл,
+// а попаданием считается только совпадение текста: коллизию FNV-1a легко подобрать
+std::unique_ptr<Program> ProgramCache::Load(std::string_view source) const {
+    const MappedFile file(PathFor(source));
+    Reader in(file.View());
+    try {
+        if (std::memcmp(in.Take(sizeof(CACHE_MAGIC)), CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+            || in.Get<uint64_t>() != HashSource(source) || in.Get<uint64_t>() != source.size()
+            || std::memcmp(in.Take(source.size()), source.data(), source.size()) != 0)
+            return nullptr;
+
+        const size_t header_size = sizeof(CACHE_MAGIC) + 2 * sizeof(uint64_t) + source.size();
+        return DeserializeProgram(file.View().substr(header_size));
+    } catch (const ProgramFormatError&) {
+        return nullptr;
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    } catch (const std::length_error&) {
+        return nullptr;
+    }
+}
+
+bool ProgramCache::Store(std::string_view source, const Program& program) const {
+    Writer out;
+    out.PutBytes(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    out.Put(HashSource(source));
+    out.Put(static_cast<uint64_t>(source.size()));
+    out.PutBytes(source.data(), source.size());
+    try {
+        const std::string data = SerializeProgram(program);
+        out.PutBytes(data.data(), data.size());
+    } catch (const ProgramFormatError&) {
+        return false;
+    }
+
+    // Запись во временный файл и переименование: параллельный запуск не увидит файл наполовину
+    std::error_code error;
+    std::filesystem::create_directories(directory_, error);
+    const std::filesystem::path path = PathFor(source);
+    std::filesystem::path temp = path;
+    temp += ".tmp"s + std::to_string(std::random_device{}());
+    {
+        std::ofstream output(temp, std::ios::binary | std::ios::trunc);
+        output.write(out.Data().data(), static_cast<std::streamsize>(out.Data().size()));
+        if (!output)
+            return false;
+    }
+    std::filesystem::rename(temp, path, error);
+    if (error) {
+        std::filesystem::remove(temp, error);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace ast
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "statement.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace ast {
+
+// Версия двоичного формата. Увеличивается при любом изменении узлов, их полей или разбора
+constexpr uint32_t PROGRAM_FORMAT_VERSION = 2;
+constexpr std::string_view INTERPRETER_VERSION = "mython-1.0";
+
+class ProgramFormatError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Двоичная форма разобранной программы: таблица символов, классы с методами, глобальные
+// переменные и дерево узлов. Числа записываются в порядке байтов машины: кеш не переносится
+// между платформами. ProgramFormatError, если в дереве есть узел, который нельзя сохранить
+// (например, тело метода, написанное на C++)
+[[nodiscard]] std::string SerializeProgram(const Program& program);
+
+// Восстанавливает программу из SerializeProgram; ProgramFormatError при повреждённых данных
+[[nodiscard]] std::unique_ptr<Program> DeserializeProgram(std::string_view data);
+
+// Кеш разобранных программ в каталоге. Файл называется по хешу текста программы и версии
+// формата и хранит сам текст для сравнения; при попадании лексер и парсер не запускаются,
+// а файл отображается в память
+class ProgramCache {
+public:
+    explicit ProgramCache(std::filesystem::path directory);
+
+    // nullptr при промахе, а также если файл кеша повреждён или от другой версии
+    [[nodiscard]] std::unique_ptr<Program> Load(std::string_view source) const;
+
+    // false, если программу нельзя сохранить или запись не удалась
+    bool Store(std::string_view source, const Program& program) const;
+
+    [[nodiscard]] std::filesystem::path PathFor(std::string_view source) const;
+
+private:
+    std::filesystem::path directory_;
+};
+
+}  // namespace ast
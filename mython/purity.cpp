@@ -0,0 +1,223 @@
+#include "purity.h"
+
+#include "statement.h"
+
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+namespace ast {
+
+using runtime::Class;
+using runtime::Method;
+using runtime::MethodMemo;
+using runtime::ObjectHolder;
+
+namespace {
+
+// self всегда занимает слот 0 фрейма метода
+constexpr uint32_t SELF_SLOT = 0;
+
+// Вызов self.name с count аргументами
+struct SelfCall {
+    runtime::Symbol name;
+    size_t count;
+};
+
+// Проверяет тело метода без учёта вызываемых методов; вызовы методов self собираются в calls
+class BodyChecker {
+public:
+    explicit BodyChecker(std::vector<SelfCall>& calls) : calls_(calls) {
+    }
+
+    bool Check(const Statement& node) {
+        return VisitNode(node, [this](const auto& n) {
+            return CheckNode(n);
+        });
+    }
+
+private:
+    static bool IsLocal(uint32_t slot) {
+        return slot != NO_SLOT && slot != SELF_SLOT;
+    }
+
+    bool CheckNode(const NumericConst& /*node*/) {
+        return true;
+    }
+
+    bool CheckNode(const StringConst& /*node*/) {
+        return true;
+    }
+
+    bool CheckNode(const BoolConst& /*node*/) {
+        return true;
+    }
+
+    bool CheckNode(const None& /*node*/) {
+        return true;
+    }
+
+    // Чтение поля зависит от состояния объекта, а self как значение может попасть в __str__ или __eq__
+    bool CheckNode(const VariableValue& node) {
+        return node.GetDottedIds().size() == 1 && IsLocal(node.GetSlot());
+    }
+
+    bool CheckNode(const Assignment& node) {
+        return IsLocal(node.GetSlot()) && Check(node.GetValue());
+    }
+
+    bool CheckNode(const MethodCall& node) {
+        const auto* object = dynamic_cast<const VariableValue*>(&node.GetObject());
+        if (object == nullptr || object->GetDottedIds().size() != 1 || object->GetSlot() != SELF_SLOT)
+            return false;
+        calls_.push_back({node.GetMethod(), node.GetArgs().size()});
+        for (const auto& arg : node.GetArgs())
+            if (!Check(*arg))
+                return false;
+        return true;
+    }
+
+    bool CheckNode(const Compound& node) {
+        for (const auto& statement : node.GetStatements())
+            if (!Check(*statement))
+                return false;
+        return true;
+    }
+
+    bool CheckNode(const IfElse& node) {
+        return Check(node.GetCondition()) && Check(node.GetIfBody())
+               && (node.GetElseBody() == nullptr || Check(*node.GetElseBody()));
+    }
+
+    bool CheckNode(const Return& node) {
+        return Check(node.GetStatement());
+    }
+
+    // Арифметика, логика, str() и сравнения над Number/String/Bool/None не вызывают методов.
+    // Сравнение с произвольной функцией, печать, поля и создание объектов — нет
+    template <typename T>
+    bool CheckNode(const T& node) {
+        if constexpr (std::is_same_v<T, Comparison>) {
+            return false;
+        } else if constexpr (std::is_base_of_v<BinaryOperation, T>) {
+            return Check(node.GetLhs()) && Check(node.GetRhs());
+        } else if constexpr (std::is_base_of_v<UnaryOperation, T>) {
+            return Check(node.GetArgument());
+        } else {
+            return false;
+        }
+    }
+
+    std::vector<SelfCall>& calls_;
+};
+
+// Тело метода с переменными по слотам; отложенное тело разбирается, ошибка разбора делает
+// метод нечистым и проявится при его вызове
+const MethodBody* BodyOf(const Method& method) {
+    if (method.frame_size == 0)
+        return nullptr;
+    if (auto* lazy = dynamic_cast<LazyMethodBody*>(method.body.get())) {
+        try {
+            return &lazy->GetBody();
+        } catch (const std::runtime_error&) {
+            // Ошибка разбора или лексера: метод нечист, а ошибка возникнет при его вызове
+            return nullptr;
+        }
+    }
+    return dynamic_cast<const MethodBody*>(method.body.get());
+}
+
+MethodMemo& MemoOf(const Method& method) {
+    if (!method.memo)
+        method.memo = std::make_unique<MethodMemo>();
+    return *method.memo;
+}
+
+// Решает чистоту method и всех методов self, достижимых из него, для объектов класса cls.
+// Рекурсивные вызовы сначала считаются чистыми; затем нечистота распространяется
+// от нарушителей к вызывающим, пока что-то меняется
+void Analyze(const Class& cls, const Method& root) {
+    struct Node {
+        bool pure = true;
+        std::vector<const Method*> callees;
+    };
+    std::unordered_map<const Method*, Node> nodes;
+
+    std::vector<const Method*> pending = {&root};
+    while (!pending.empty()) {
+        const Method* method = pending.back();
+        pending.pop_back();
+        if (nodes.count(method) != 0 || (method->memo && method->memo->IsPureFor(cls) != nullptr))
+            continue;
+
+        Node& node = nodes[method];
+        std::vector<SelfCall> calls;
+        const MethodBody* body = BodyOf(*method);
+        node.pure = body != nullptr && BodyChecker(calls).Check(body->GetBody());
+        for (const SelfCall& call : calls) {
+            const Method* callee = cls.GetMethod(call.name);
+            if (callee == nullptr || callee->formal_params.size() != call.count) {
+                node.pure = false;
+                continue;
+            }
+            node.callees.push_back(callee);
+            pending.push_back(callee);
+        }
+    }
+
+    auto is_pure = [&](const Method* method) {
+        if (auto it = nodes.find(method); it != nodes.end())
+            return it->second.pure;
+        return *method->memo->IsPureFor(cls);
+    };
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto& [method, node] : nodes) {
+            if (!node.pure)
+                continue;
+            for (const Method* callee : node.callees) {
+                if (!is_pure(callee)) {
+                    node.pure = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (const auto& [method, node] : nodes)
+        MemoOf(*method).SetPureFor(cls, node.pure);
+}
+
+}  // namespace
+
+MethodMemo* FindPureMemo(const Class& cls, const Method& method) {
+    if (!method.memo || method.memo->IsPureFor(cls) == nullptr)
+        Analyze(cls, method);
+    return *method.memo->IsPureFor(cls) ? method.memo.get() : nullptr;
+}
+
+ObjectHolder CallMemoized(runtime::ClassInstance& instance, const Method& method,
+                          const std::vector<ObjectHolder>& actual_args, runtime::Context& context) {
+    if (!context.IsMemoizing())
+        return instance.Call(method, actual_args, context);
+    MethodMemo* memo = FindPureMemo(instance.GetClass(), method);
+    if (memo == nullptr)
+        return instance.Call(method, actual_args, context);
+
+    MethodMemo::Key key(instance.GetClass());
+    for (const ObjectHolder& arg : actual_args)
+        if (!key.Add(arg))
+            return instance.Call(method, actual_args, context);
+    if (const ObjectHolder* result = memo->Find(key))
+        return *result;
+
+    ObjectHolder result = instance.Call(method, actual_args, context);
+    memo->Store(std::move(key), result);
+    return result;
+}
+
+}  // namespace ast
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "runtime.h"
+
+#include <vector>
+
+namespace ast {
+
+// Мемоизатор вызова method на объекте класса cls или nullptr, если метод не доказан чистым.
+// Чистый метод не присваивает полей, не печатает, не создаёт объектов и не читает полей,
+// self использует только для вызовов своих методов, которые тоже чисты. С аргументами
+// Number/String/Bool/None его результат зависит только от класса self и аргументов.
+// Анализ выполняется при первом вызове и разбирает отложенные тела вызываемых методов
+[[nodiscard]] runtime::MethodMemo* FindPureMemo(const runtime::Class& cls, const runtime::Method& method);
+
+// Вызов метода обходом дерева через кеш результатов, если контекст мемоизирует и метод чист
+runtime::ObjectHolder CallMemoized(runtime::ClassInstance& instance, const runtime::Method& method,
+                                   const std::vector<runtime::ObjectHolder>& actual_args,
+                                   runtime::Context& context);
+
+}  // namespace ast
@@ -0,0 +1,227 @@
+#include "bytecode.h"
+#include "closures.h"
+#include "lexer.h"
+#include "parse.h"
+#include "purity.h"
+#include "test_runner_p.h"
+
+using namespace std;
+
+namespace ast {
+
+namespace {
+
+unique_ptr<runtime::Executable> Parse(const string& source) {
+    parse::Lexer lexer{string_view(source)};
+    return ParseProgram(lexer);
+}
+
+const runtime::Class& ClassOf(const runtime::Closure& closure, const string& name) {
+    return *closure.at(name).TryAs<runtime::Class>();
+}
+
+bool IsPure(const runtime::Class& cls, const string& method) {
+    return FindPureMemo(cls, *cls.GetMethod(method)) != nullptr;
+}
+
+// Программа, печатающая fib(n) через наивную рекурсию
+string FibProgram(int n) {
+    return R"(
+class Fib:
+  def calc(n):
+    if n < 2:
+      return n
+    return self.calc(n - 1) + self.calc(n - 2)
+
+  def label(n):
+    return 'fib(' + str(n) + ') = ' + str(self.calc(n))
+
+f = Fib()
+print f.label()"s + to_string(n) + ")\n"s;
+}
+
+}  // namespace
+
+void TestPurityAnalysis() {
+    auto program = Parse(R"(
+class Base:
+  def __init__():
+    self.x = 1
+
+  def twice(n):
+    return self.step(n) + self.step(n)
+
+  def step(n):
+    return n + 1
+
+  def even(n):
+    if n == 0:
+      return True
+    return self.odd(n - 1)
+
+  def odd(n):
+    if n == 0:
+      return False
+    return self.even(n - 1)
+
+  def loud(n):
+    print n
+    return n
+
+  def store(n):
+    self.x = n
+
+  def read():
+    return self.x
+
+  def me():
+    return self
+
+  def other(b):
+    return b.step(1)
+
+  def make():
+    return Base()
+
+  def chain(n):
+    if n == 0:
+      return self.loud(0)
+    return self.chain(n - 1)
+
+  def missing():
+    return self.nothing()
+
+class Derived(Base):
+  def step(n):
+    print 'step'
+    return n
+
+b = Base()
+)");
+    runtime::Closure closure;
+    runtime::DummyContext context;
+    program->Execute(closure, context);
+    const runtime::Class& base = ClassOf(closure, "Base"s);
+    const runtime::Class& derived = ClassOf(closure, "Derived"s);
+
+    for (const char* pure : {"twice", "step", "even", "odd"}) {
+        ASSERT(IsPure(base, pure));
+    }
+    for (const char* impure : {"__init__", "loud", "store", "read", "me", "other", "make", "chain", "missing"}) {
+        ASSERT(!IsPure(base, impure));
+    }
+
+    // Метод, чистый для базового класса, нечист для наследника с нечистым step
+    ASSERT(!IsPure(derived, "twice"s));
+    ASSERT(IsPure(derived, "even"s));
+    ASSERT(IsPure(base, "twice"s));
+}
+
+void TestMemoizedCalls() {
+    auto program = Parse(FibProgram(30));
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    program->Execute(closure, context);
+    ASSERT_EQUAL(context.output.str(), "fib(30) = 832040\n"s);
+
+    const runtime::Method& calc = *ClassOf(closure, "Fib"s).GetMethod("calc"s);
+    ASSERT(calc.memo != nullptr);
+    // Каждое значение вычисляется один раз, второй вызов с тем же n берётся из кеша
+    ASSERT_EQUAL(calc.memo->GetStats().misses, 31u);
+    ASSERT_EQUAL(calc.memo->GetStats().hits, 28u);
+    ASSERT_EQUAL(calc.memo->GetSize(), 31u);
+
+    // Объект в аргументах не сравнивается по значению: вызов выполняется без кеша
+    auto with_object = Parse(R"(
+class Id:
+  def get(x):
+    return 1
+
+class Box:
+  def __init__():
+    self.v = 0
+
+i = Id()
+print i.get(Box()), i.get(Box())
+)");
+    runtime::DummyContext object_context;
+    runtime::Closure object_closure;
+    with_object->Execute(object_closure, object_context);
+    const runtime::MethodMemo* memo = ClassOf(object_closure, "Id"s).GetMethod("get"s)->memo.get();
+    ASSERT(memo != nullptr);
+    ASSERT_EQUAL(memo->GetStats().hits + memo->GetStats().misses, 0u);
+}
+
+// Без мемоизации кеш не создаётся и не опрашивается; fib(12) хватает, чтобы это проверить
+void TestMemoizationOptOut() {
+    auto program = Parse(FibProgram(12));
+    runtime::DummyContext context;
+    context.SetMemoizing(false);
+    runtime::Closure closure;
+    runtime::MethodMemo::ResetTotals();
+    program->Execute(closure, context);
+    ASSERT_EQUAL(context.output.str(), "fib(12) = 144\n"s);
+    ASSERT(ClassOf(closure, "Fib"s).GetMethod("calc"s)->memo == nullptr);
+    ASSERT_EQUAL(runtime::MethodMemo::GetTotals().hits + runtime::MethodMemo::GetTotals().misses, 0u);
+}
+
+// Кеш ограничен: когда он полон, новые результаты не запоминаются
+void TestMemoCapacity() {
+    runtime::Class cls("C"s, {}, nullptr);
+    runtime::MethodMemo memo;
+    for (int i = 0; i <= static_cast<int>(runtime::MethodMemo::CAPACITY); ++i) {
+        runtime::MethodMemo::Key key(cls);
+        key.AddNumber(i);
+        memo.Store(std::move(key), runtime::ObjectHolder::Own(runtime::Number(i)));
+    }
+    ASSERT_EQUAL(memo.GetSize(), runtime::MethodMemo::CAPACITY);
+
+    runtime::MethodMemo::Key first(cls);
+    first.AddNumber(0);
+    ASSERT(memo.Find(first) != nullptr);
+    runtime::MethodMemo::Key last(cls);
+    last.AddNumber(static_cast<int>(runtime::MethodMemo::CAPACITY));
+    ASSERT(memo.Find(last) == nullptr);
+
+    // Ключи различают типы и границы строк
+    runtime::MethodMemo::Key one(cls);
+    one.AddString("ab"s);
+    one.AddString("c"s);
+    runtime::MethodMemo::Key other(cls);
+    other.AddString("a"s);
+    other.AddString("bc"s);
+    memo = runtime::MethodMemo();
+    memo.Store(std::move(one), runtime::ObjectHolder::None());
+    ASSERT(memo.Find(other) == nullptr);
+}
+
+// Байт-код и замыкания пользуются тем же кешем
+void TestMemoizedEngines() {
+    for (bool use_bytecode : {true, false}) {
+        auto program = Parse(FibProgram(30));
+        const auto& tree = dynamic_cast<const Program&>(*program);
+        runtime::DummyContext context;
+        runtime::Closure closure;
+        if (use_bytecode) {
+            bytecode::Machine machine(tree);
+            machine.Run(closure, context);
+        } else {
+            closures::Engine engine(tree);
+            engine.Run(closure, context);
+        }
+        ASSERT_EQUAL(context.output.str(), "fib(30) = 832040\n"s);
+        const runtime::Method& calc = *ClassOf(closure, "Fib"s).GetMethod("calc"s);
+        ASSERT_EQUAL(calc.memo->GetStats().misses, 31u);
+        ASSERT_EQUAL(calc.memo->GetStats().hits, 28u);
+    }
+}
+
+void RunPurityTests(TestRunner& tr) {
+    RUN_TEST(tr, ast::TestPurityAnalysis);
+    RUN_TEST(tr, ast::TestMemoizedCalls);
+    RUN_TEST(tr, ast::TestMemoizationOptOut);
+    RUN_TEST(tr, ast::TestMemoCapacity);
+    RUN_TEST(tr, ast::TestMemoizedEngines);
+}
+
+}  // namespace ast
@@ -2,11 +2,64 @@
 
 #include <cassert>
 #include <optional>
+#include <stdexcept>
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <pthread.h>
+#define MYTHON_HAS_STACK_BOUNDS 1
+#endif
 
 using namespace std;
 
 namespace runtime {
 
+namespace {
+const Symbol SELF = "self"sv;
+const Symbol STR_METHOD = "__str__"sv;
+const Symbol EQ_METHOD = "__eq__"sv;
+const Symbol LT_METHOD = "__lt__"sv;
+const Symbol GT_METHOD = "__gt__"sv;
+const Symbol LE_METHOD = "__le__"sv;
+const Symbol GE_METHOD = "__ge__"sv;
+
+// Запас стека под вызов, прошедший проверку, и раскрутку исключения. Его хватает и сборкам
+// без оптимизаций или с санитайзерами, где кадры во много раз больше
+constexpr size_t STACK_RESERVE = 256 << 10;
+
+uintptr_t FindStackLimit() {
+#ifdef MYTHON_HAS_STACK_BOUNDS
+    uintptr_t bottom = 0;
+    size_t size = 0;
+#ifdef __APPLE__
+    // pthread_get_stackaddr_np даёт верхний конец стека
+    const pthread_t self = pthread_self();
+    size = pthread_get_stacksize_np(self);
+    bottom = reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(self)) - size;
+#else
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return 0;
+    void* address = nullptr;
+    const bool found = pthread_attr_getstack(&attr, &address, &size) == 0;
+    pthread_attr_destroy(&attr);
+    if (!found)
+        return 0;
+    bottom = reinterpret_cast<uintptr_t>(address);
+#endif
+    if (size <= 2 * STACK_RESERVE)
+        return 0;
+    return bottom + STACK_RESERVE;
+#else
+    return 0;
+#endif
+}
+}  // namespace
+
+uintptr_t NativeStackLimit() {
+    static thread_local const uintptr_t limit = FindStackLimit();
+    return limit;
+}
+
 ObjectHolder::ObjectHolder(std::shared_ptr<Object> data)
     : data_(std::move(data)) {
 }
@@ -41,6 +94,36 @@ ObjectHolder::operator bool() const {
     return Get() != nullptr;
 }
 
+Frame::Frame(size_t size) : slots_(inline_slots_.data()), size_(size) {
+    if (size > INLINE_SLOTS) {
+        heap_slots_ = std::make_unique<Slot[]>(size);
+        heap_capacity_ = size;
+        slots_ = heap_slots_.get();
+    }
+}
+
+void Frame::Reset(size_t size) {
+    for (size_t i = 0; i < size_; ++i)
+        slots_[i] = Slot();
+
+    if (size <= INLINE_SLOTS) {
+        slots_ = inline_slots_.data();
+    } else if (size <= heap_capacity_) {
+        slots_ = heap_slots_.get();
+    } else {
+        heap_slots_ = std::make_unique<Slot[]>(size);
+        heap_capacity_ = size;
+        slots_ = heap_slots_.get();
+    }
+    size_ = size;
+}
+
+void Context::ThrowRecursionError() const {
+    if (call_depth_ < max_call_depth_)
+        throw RecursionError("C++ stack exhausted at call depth "s + std::to_string(call_depth_));
+    throw RecursionError("maximum call depth "s + std::to_string(max_call_depth_) + " exceeded"s);
+}
+
 bool IsTrue(const ObjectHolder& object) {
     if (!object)
         return false;
@@ -56,13 +139,13 @@ bool IsTrue(const ObjectHolder& object) {
 }
 
 void ClassInstance::Print(std::ostream& os, Context& context) {
-    if (HasMethod("__str__"s, 0))
-        Call ("__str__"s, {},context)->Print(os, context);
+    if (HasMethod(STR_METHOD, 0))
+        Call (STR_METHOD, {},context)->Print(os, context);
     else
         os << this;
 }
 
-bool ClassInstance::HasMethod(const std::string& method, size_t argument_count) const {
+bool ClassInstance::HasMethod(Symbol method, size_t argument_count) const {
     auto ptr_metod = class_.GetMethod(method);
     if (ptr_metod != nullptr)
         if (ptr_metod->formal_params.size() == argument_count)
@@ -70,40 +153,283 @@ bool ClassInstance::HasMethod(const std::string& method, size_t argument_count)
     return false;
 }
 
-Closure& ClassInstance::Fields() {
-    return closure_;
+const Class& ClassInstance::GetClass() const {
+    return class_;
+}
+
+FieldTable& ClassInstance::Fields() {
+    return fields_;
+}
+
+const FieldTable& ClassInstance::Fields() const {
+    return fields_;
+}
+
+ClassInstance::ClassInstance(const Class& cls) : class_(cls), fields_(cls.GetRootShape()) {
+}
+
+Shape::Shape() : layout_(std::make_shared<Layout>()) {
+}
+
+Shape::Shape(std::shared_ptr<Layout> layout, uint32_t size) : layout_(std::move(layout)), size_(size) {
+}
+
+uint32_t Shape::Find(Symbol field) const {
+    const auto& fields = layout_->fields;
+    if (size_ <= LINEAR_LIMIT) {
+        for (uint32_t slot = 0; slot < size_; ++slot)
+            if (fields[slot] == field)
+                return slot;
+        return NOT_FOUND;
+    }
+    // Список может быть длиннее формы: дальше лежат поля её потомков
+    if (auto it = layout_->index.find(field); it != layout_->index.end() && it->second < size_)
+        return it->second;
+    return NOT_FOUND;
+}
+
+const Shape* Shape::Add(Symbol field) const {
+    assert(Find(field) == NOT_FOUND);
+    auto& next = transitions_[field];
+    if (next == nullptr) {
+        // Первый переход продолжает общий список полей, ветвление получает свою копию
+        std::shared_ptr<Layout> layout = layout_;
+        if (layout->fields.size() != size_) {
+            layout = std::make_shared<Layout>();
+            layout->fields.assign(layout_->fields.begin(), layout_->fields.begin() + size_);
+            for (uint32_t slot = 0; slot < size_; ++slot)
+                layout->index.emplace(layout->fields[slot], slot);
+        }
+        layout->fields.push_back(field);
+        layout->index.emplace(field, size_);
+        next.reset(new Shape(std::move(layout), size_ + 1));
+    }
+    return next.get();
+}
+
+Symbol Shape::FieldAt(uint32_t slot) const {
+    return layout_->fields[slot];
+}
+
+FieldTable::Iterator::value_type FieldTable::Iterator::operator*() const {
+    return {table_->shape_->FieldAt(slot_), table_->slots_[slot_]};
 }
 
-const Closure& ClassInstance::Fields() const {
-    return closure_;
+FieldTable::FieldTable(const Shape& shape) : shape_(&shape) {
 }
 
-ClassInstance::ClassInstance(const Class& cls) : class_(cls) {
+ObjectHolder* FieldTable::Find(Symbol field) {
+    const uint32_t slot = shape_->Find(field);
+    return slot != Shape::NOT_FOUND ? &slots_[slot] : nullptr;
 }
 
-ObjectHolder ClassInstance::Call(const std::string& method,
+const ObjectHolder* FieldTable::Find(Symbol field) const {
+    const uint32_t slot = shape_->Find(field);
+    return slot != Shape::NOT_FOUND ? &slots_[slot] : nullptr;
+}
+
+ObjectHolder* FieldTable::Find(Symbol field, FieldCache& cache) {
+    if (cache.shape == shape_ && cache.next == nullptr)
+        return &slots_[cache.slot];
+
+    const uint32_t slot = shape_->Find(field);
+    if (slot == Shape::NOT_FOUND)
+        return nullptr;
+    cache = {shape_, nullptr, slot};
+    return &slots_[slot];
+}
+
+ObjectHolder& FieldTable::operator[](Symbol field) {
+    if (ObjectHolder* value = Find(field))
+        return *value;
+    return Append(shape_->Add(field));
+}
+
+ObjectHolder& FieldTable::Slot(Symbol field, FieldCache& cache) {
+    if (cache.shape == shape_)
+        return cache.next == nullptr ? slots_[cache.slot] : Append(cache.next);
+
+    if (const uint32_t slot = shape_->Find(field); slot != Shape::NOT_FOUND) {
+        cache = {shape_, nullptr, slot};
+        return slots_[slot];
+    }
+    cache = {shape_, shape_->Add(field), shape_->Size()};
+    return Append(cache.next);
+}
+
+ObjectHolder& FieldTable::at(Symbol field) {
+    if (ObjectHolder* value = Find(field))
+        return *value;
+    throw std::out_of_range("No field "s + field.Name());
+}
+
+const ObjectHolder& FieldTable::at(Symbol field) const {
+    if (const ObjectHolder* value = Find(field))
+        return *value;
+    throw std::out_of_range("No field "s + field.Name());
+}
+
+FieldTable::Iterator FieldTable::find(Symbol field) const {
+    const uint32_t slot = shape_->Find(field);
+    return slot != Shape::NOT_FOUND ? Iterator(this, slot) : end();
+}
+
+ObjectHolder& FieldTable::Append(const Shape* next) {
+    shape_ = next;
+    return slots_.emplace_back();
+}
+
+namespace {
+// Тело метода, собранное без MethodBody, оставляет return взведённым: он не должен
+// остановить вызывающий код
+ObjectHolder Finish(ObjectHolder result, Context& context) {
+    if (context.IsReturning())
+        return context.TakeReturnValue();
+    return result;
+}
+}  // namespace
+
+ObjectHolder ClassInstance::Call(Symbol method,
                                  const std::vector<ObjectHolder>& actual_args,
                                  Context& context) {
     if (!HasMethod(method, actual_args.size()))
         throw std::runtime_error("Not method"s);
 
-    auto method_ptr = class_.GetMethod(method);
-    Closure args_closure;
-    args_closure["self"s] = ObjectHolder::Share(*this);
-    for (auto name_ptr = method_ptr->formal_params.begin(); name_ptr != method_ptr->formal_params.end(); ++name_ptr)
-        args_closure[*name_ptr] = (actual_args[std::distance(method_ptr->formal_params.begin(), name_ptr)]);
+    return Call(*class_.GetMethod(method), actual_args, context);
+}
+
+ObjectHolder ClassInstance::Call(const Method& method,
+                                 const std::vector<ObjectHolder>& actual_args,
+                                 Context& context) {
+    assert(method.formal_params.size() == actual_args.size());
+    // Хвостовой вызов из тела заменяет текущий: метод, объект и аргументы берутся из него,
+    // фрейм переиспользуется, а стек C++ не растёт
+    CallScope call(context);
+    const Method* method_ptr = &method;
+    ObjectHolder self = ObjectHolder::Share(*this);
+    std::vector<ObjectHolder> tail_args;
+    const std::vector<ObjectHolder>* args = &actual_args;
+    std::optional<Frame> frame;
+    Closure variables;
+    for (;;) {
+        ObjectHolder result;
+        if (method_ptr->frame_size > 0) {
+            if (frame)
+                frame->Reset(method_ptr->frame_size);
+            else
+                frame.emplace(method_ptr->frame_size);
+            frame->Set(0, self);
+            for (size_t i = 0; i < args->size(); ++i)
+                frame->Set(static_cast<uint32_t>(i + 1), (*args)[i]);
+
+            FrameScope scope(context, *frame);
+            variables.clear();
+            result = Finish(method_ptr->body->Execute(variables, context), context);
+        } else {
+            variables.clear();
+            variables[SELF] = self;
+            for (size_t i = 0; i < args->size(); ++i)
+                variables[method_ptr->formal_params[i]] = (*args)[i];
+
+            result = Finish(method_ptr->body->Execute(variables, context), context);
+        }
+
+        if (!context.HasTailCall())
+            return result;
+        Context::TailCall call = context.TakeTailCall();
+        method_ptr = call.method;
+        self = std::move(call.object);
+        tail_args = std::move(call.args);
+        args = &tail_args;
+    }
+}
 
-    return method_ptr->body->Execute(args_closure,context);
+MethodMemo::Key::Key(const Class& cls) {
+    const auto address = reinterpret_cast<uintptr_t>(&cls);
+    bytes_.append(reinterpret_cast<const char*>(&address), sizeof(address));
 }
 
-Class::Class(std::string name, std::vector<Method> methods, const Class* parent) : name_(name), parent_(parent) {
+void MethodMemo::Key::AddNone() {
+    bytes_ += 'N';
+}
+
+void MethodMemo::Key::AddBool(bool value) {
+    bytes_ += value ? 'T' : 'F';
+}
+
+void MethodMemo::Key::AddNumber(int value) {
+    bytes_ += 'I';
+    bytes_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void MethodMemo::Key::AddString(const std::string& value) {
+    const auto size = static_cast<uint32_t>(value.size());
+    bytes_ += 'S';
+    bytes_.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    bytes_ += value;
+}
+
+bool MethodMemo::Key::Add(const ObjectHolder& arg) {
+    if (!arg)
+        AddNone();
+    else if (const auto* number = arg.TryAs<Number>())
+        AddNumber(number->GetValue());
+    else if (const auto* str = arg.TryAs<String>())
+        AddString(str->GetValue());
+    else if (const auto* boolean = arg.TryAs<Bool>())
+        AddBool(boolean->GetValue());
+    else
+        return false;
+    return true;
+}
+
+std::atomic<uint64_t> MethodMemo::total_hits_ = 0;
+std::atomic<uint64_t> MethodMemo::total_misses_ = 0;
+
+MemoStats MethodMemo::GetTotals() {
+    return {total_hits_.load(std::memory_order_relaxed), total_misses_.load(std::memory_order_relaxed)};
+}
+
+void MethodMemo::ResetTotals() {
+    total_hits_.store(0, std::memory_order_relaxed);
+    total_misses_.store(0, std::memory_order_relaxed);
+}
+
+const bool* MethodMemo::IsPureFor(const Class& cls) const {
+    for (const auto& [verdict_class, pure] : verdicts_)
+        if (verdict_class == &cls)
+            return &pure;
+    return nullptr;
+}
+
+void MethodMemo::SetPureFor(const Class& cls, bool pure) {
+    verdicts_.emplace_back(&cls, pure);
+}
+
+const ObjectHolder* MethodMemo::Find(const Key& key) {
+    if (auto it = results_.find(key.bytes_); it != results_.end()) {
+        ++stats_.hits;
+        total_hits_.fetch_add(1, std::memory_order_relaxed);
+        return &it->second;
+    }
+    ++stats_.misses;
+    total_misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+void MethodMemo::Store(Key key, ObjectHolder result) {
+    if (results_.size() < CAPACITY)
+        results_.emplace(std::move(key.bytes_), std::move(result));
+}
+
+Class::Class(std::string name, std::vector<Method> methods, const Class* parent) : name_(name), parent_(parent), root_shape_(std::make_unique<Shape>()) {
     for (auto & item : methods)
         methods_[item.name] = std::move(item);
 }
 
-const Method* Class::GetMethod(const std::string& name) const {
-    if (methods_.count(name))
-        return &methods_.at(name);
+const Method* Class::GetMethod(Symbol name) const {
+    if (auto it = methods_.find(name); it != methods_.end())
+        return &it->second;
     if (parent_ != nullptr)
         return parent_->GetMethod(name);
     return nullptr;
@@ -113,30 +439,74 @@ const Method* Class::GetMethod(const std::string& name) const {
     return name_;
 }
 
+const Class* Class::GetParent() const {
+    return parent_;
+}
+
+const std::unordered_map<Symbol, Method>& Class::GetMethods() const {
+    return methods_;
+}
+
+const Shape& Class::GetRootShape() const {
+    return *root_shape_;
+}
+
 void Class::Print(ostream& os, Context&) {
     os << "Class "sv << GetName();
 }
 
+const ObjectHolder& Bool::Of(bool value) {
+    static const ObjectHolder TRUE_OBJECT = ObjectHolder::Own(Bool(true));
+    static const ObjectHolder FALSE_OBJECT = ObjectHolder::Own(Bool(false));
+    return value ? TRUE_OBJECT : FALSE_OBJECT;
+}
+
 void Bool::Print(std::ostream& os, [[maybe_unused]] Context& context) {
     os << (GetValue() ? "True"sv : "False"sv);
 }
 
-bool Equal(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
+namespace {
+template <typename T>
+int ThreeWay(const T& lhs, const T& rhs) {
+    return (rhs < lhs) - (lhs < rhs);
+}
+
+// Порядок двух значений одного встроенного типа: <0, 0 или >0; nullopt для остальных пар
+optional<int> CompareBuiltins(const ObjectHolder& lhs, const ObjectHolder& rhs) {
     if (auto ptn_l = lhs.TryAs<Bool>(); ptn_l != nullptr )
         if (auto ptn_r = rhs.TryAs<Bool>(); ptn_r != nullptr )
-            return ptn_l->GetValue() == ptn_r->GetValue();
+            return ThreeWay(ptn_l->GetValue(), ptn_r->GetValue());
 
     if (auto ptn_l = lhs.TryAs<Number>(); ptn_l != nullptr )
         if (auto ptn_r = rhs.TryAs<Number>(); ptn_r != nullptr )
-            return ptn_l->GetValue() == ptn_r->GetValue();
+            return ThreeWay(ptn_l->GetValue(), ptn_r->GetValue());
 
     if (auto ptn_l = lhs.TryAs<String>(); ptn_l != nullptr )
         if (auto ptn_r = rhs.TryAs<String>(); ptn_r != nullptr )
-            return ptn_l->GetValue() == ptn_r->GetValue();
+            return ptn_l->GetValue().compare(ptn_r->GetValue());
+
+    return nullopt;
+}
+
+// Результат метода сравнения object.method(argument), если такой метод есть
+optional<bool> Dispatch(const ObjectHolder& object, Symbol method, const ObjectHolder& argument, Context& context) {
+    if (auto ptn = object.TryAs<ClassInstance>(); ptn != nullptr )
+        if (ptn->HasMethod(method, 1))
+            return IsTrue(ptn->Call(method, {argument}, context));
+    return nullopt;
+}
+}  // namespace
+
+// Каждый оператор вызывает не больше одного метода пользователя: свой (__gt__, __le__, __ge__),
+// отражённый у правого операнда (b.__lt__(a) для a > b) или выраженный через __lt__.
+// Два вызова остаются, только если методы сравнения есть лишь у левого операнда
+
+bool Equal(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
+    if (auto order = CompareBuiltins(lhs, rhs))
+        return *order == 0;
 
-    if (auto ptn_l = lhs.TryAs<ClassInstance>(); ptn_l != nullptr )
-        if (ptn_l->HasMethod("__eq__"s, 1))
-            return ptn_l->Call("__eq__"s, {rhs}, context).TryAs<Bool>()->GetValue();
+    if (auto result = Dispatch(lhs, EQ_METHOD, rhs, context))
+        return *result;
 
     if ( !(bool)lhs && !(bool)rhs )
         return true;
@@ -145,21 +515,13 @@ bool Equal(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
 }
 
 bool Less(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
-    if (auto ptn_l = lhs.TryAs<Bool>(); ptn_l != nullptr )
-        if (auto ptn_r = rhs.TryAs<Bool>(); ptn_r != nullptr )
-            return ptn_l->GetValue() < ptn_r->GetValue();
-
-    if (auto ptn_l = lhs.TryAs<Number>(); ptn_l != nullptr )
-        if (auto ptn_r = rhs.TryAs<Number>(); ptn_r != nullptr )
-            return ptn_l->GetValue() < ptn_r->GetValue();
-
-    if (auto ptn_l = lhs.TryAs<String>(); ptn_l != nullptr )
-        if (auto ptn_r = rhs.TryAs<String>(); ptn_r != nullptr )
-            return ptn_l->GetValue() < ptn_r->GetValue();
+    if (auto order = CompareBuiltins(lhs, rhs))
+        return *order < 0;
 
-    if (auto ptn_l = lhs.TryAs<ClassInstance>(); ptn_l != nullptr )
-        if (ptn_l->HasMethod("__lt__"s, 1))
-            return ptn_l->Call("__lt__"s, {rhs}, context).TryAs<Bool>()->GetValue();
+    if (auto result = Dispatch(lhs, LT_METHOD, rhs, context))
+        return *result;
+    if (auto result = Dispatch(rhs, GT_METHOD, lhs, context))
+        return *result;
 
     throw std::runtime_error("Cannot compare objects for less"s);
 }
@@ -169,14 +531,40 @@ bool NotEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context
 }
 
 bool Greater(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
+    if (auto order = CompareBuiltins(lhs, rhs))
+        return *order > 0;
+
+    if (auto result = Dispatch(lhs, GT_METHOD, rhs, context))
+        return *result;
+    if (auto result = Dispatch(rhs, LT_METHOD, lhs, context))
+        return *result;
+
     return !Less(lhs, rhs,context) && NotEqual(lhs, rhs,context);
 }
 
 bool LessOrEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
-    return !Greater(lhs,rhs,context);
+    if (auto order = CompareBuiltins(lhs, rhs))
+        return *order <= 0;
+
+    if (auto result = Dispatch(lhs, LE_METHOD, rhs, context))
+        return *result;
+    if (auto result = Dispatch(rhs, GE_METHOD, lhs, context))
+        return *result;
+    if (auto result = Dispatch(rhs, LT_METHOD, lhs, context))
+        return !*result;
+
+    return Less(lhs, rhs,context) || Equal(lhs, rhs,context);
 }
 
 bool GreaterOrEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
+    if (auto order = CompareBuiltins(lhs, rhs))
+        return *order >= 0;
+
+    if (auto result = Dispatch(lhs, GE_METHOD, rhs, context))
+        return *result;
+    if (auto result = Dispatch(rhs, LE_METHOD, lhs, context))
+        return *result;
+
     return !Less(lhs,rhs,context);
 }
 
@@ -1,22 +1,25 @@
 #pragma once
 
+#include "symbol.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace runtime {
 
-class Context {
-public:
-
-    virtual std::ostream& GetOutputStream() = 0;
-
-protected:
-    ~Context() = default;
-};
+class Frame;
+class Context;
+class Class;
+struct Method;
 
 class Object {
 public:
@@ -56,11 +59,141 @@ private:
     std::shared_ptr<Object> data_;
 };
 
+// Превышен предел глубины вызовов методов. Обычное исключение, которое можно поймать,
+// в отличие от переполнения стека C++
+class RecursionError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Адрес, ниже которого стек C++ текущего потока считается исчерпанным: под ним остаётся запас
+// на один вызов и обработку исключения. 0, если границу стека узнать нельзя
+[[nodiscard]] uintptr_t NativeStackLimit();
+
+class Context {
+public:
+    // Предел числа вложенных вызовов. Обход дерева и замыкания вызывают методы рекурсией C++,
+    // а расход стека на вызов зависит от сборки, поэтому, кроме предела, EnterCall проверяет
+    // остаток самого стека: RecursionError возникает раньше его переполнения при любом пределе
+    static constexpr size_t DEFAULT_MAX_CALL_DEPTH = 3000;
+
+    virtual std::ostream& GetOutputStream() = 0;
+
+    // Фрейм выполняемого метода или программы; nullptr, если переменные хранятся в Closure
+    [[nodiscard]] Frame* GetFrame() const {
+        return frame_;
+    }
+
+    // Возвращает предыдущий фрейм
+    Frame* SetFrame(Frame* frame) {
+        return std::exchange(frame_, frame);
+    }
+
+    // Выполненный return: пока значение взведено, Compound и IfElse прекращают выполнение,
+    // а ближайший MethodBody забирает значение. Так возврат из метода обходится без исключений
+    void SetReturnValue(ObjectHolder value) {
+        return_value_ = std::move(value);
+        returning_ = true;
+    }
+
+    [[nodiscard]] bool IsReturning() const {
+        return returning_;
+    }
+
+    ObjectHolder TakeReturnValue() {
+        returning_ = false;
+        return std::move(return_value_);
+    }
+
+    // Вызов метода в хвостовой позиции: return self.f(x). Объект и аргументы уже вычислены,
+    // возврат взводится со значением None, а сам вызов выполняет цикл ClassInstance::Call,
+    // переиспользуя фрейм. Так хвостовая рекурсия идёт в постоянном стеке C++
+    struct TailCall {
+        ObjectHolder object;
+        const Method* method = nullptr;
+        std::vector<ObjectHolder> args;
+    };
+
+    void SetTailCall(TailCall call) {
+        SetReturnValue(ObjectHolder::None());
+        tail_call_ = std::move(call);
+    }
+
+    [[nodiscard]] bool HasTailCall() const {
+        return tail_call_.method != nullptr;
+    }
+
+    TailCall TakeTailCall() {
+        return std::exchange(tail_call_, TailCall{});
+    }
+
+    // Глубина вложенных вызовов методов Mython во всех исполнителях. Хвостовой вызов глубину
+    // не увеличивает
+    [[nodiscard]] size_t GetCallDepth() const {
+        return call_depth_;
+    }
+
+    [[nodiscard]] size_t GetMaxCallDepth() const {
+        return max_call_depth_;
+    }
+
+    void SetMaxCallDepth(size_t depth) {
+        max_call_depth_ = depth;
+    }
+
+    // Вход в вызов метода; RecursionError, если предел глубины уже достигнут или стек C++
+    // почти исчерпан
+    void EnterCall() {
+        if (call_depth_ >= max_call_depth_ || IsStackExhausted())
+            ThrowRecursionError();
+        ++call_depth_;
+    }
+
+    void LeaveCall() {
+        --call_depth_;
+    }
+
+    // Запоминать ли результаты методов, доказанных чистыми. По умолчанию включено
+    [[nodiscard]] bool IsMemoizing() const {
+        return memoizing_;
+    }
+
+    void SetMemoizing(bool memoizing) {
+        memoizing_ = memoizing;
+    }
+
+protected:
+    ~Context() = default;
+
+private:
+    // Граница стека берётся у потока, создавшего контекст, и выполнять программу нужно в нём
+    [[nodiscard]] bool IsStackExhausted() const {
+#if defined(__GNUC__) || defined(__clang__)
+        const auto top = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+#else
+        const char marker = 0;
+        const auto top = reinterpret_cast<uintptr_t>(&marker);
+#endif
+        return top < stack_limit_;
+    }
+
+    [[noreturn]] void ThrowRecursionError() const;
+
+    uintptr_t stack_limit_ = NativeStackLimit();
+    size_t call_depth_ = 0;
+    size_t max_call_depth_ = DEFAULT_MAX_CALL_DEPTH;
+    bool memoizing_ = true;
+    Frame* frame_ = nullptr;
+    ObjectHolder return_value_;
+    bool returning_ = false;
+    TailCall tail_call_;
+};
+
 template <typename T>
 class ValueObject : public Object {
 public:
     ValueObject(T v)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
-        : value_(v) {
+        : value_(std::move(v)) {
     }
 
     void Print(std::ostream& os, [[maybe_unused]] Context& context) override {
@@ -75,7 +208,89 @@ private:
     T value_;
 };
 
-using Closure = std::unordered_map<std::string, ObjectHolder>;
+using Closure = std::unordered_map<Symbol, ObjectHolder>;
+
+// Переменные одного вызова метода либо глобальные переменные программы, по индексам слотов,
+// которые назначил парсер. Слот, которому ничего не присваивали, отличается от слота со значением None.
+// Небольшие фреймы размещаются без обращения к куче
+class Frame {
+public:
+    explicit Frame(size_t size);
+
+    Frame(const Frame&) = delete;
+    Frame& operator=(const Frame&) = delete;
+
+    [[nodiscard]] size_t Size() const {
+        return size_;
+    }
+
+    [[nodiscard]] bool IsBound(uint32_t slot) const {
+        return slots_[slot].bound;
+    }
+
+    [[nodiscard]] const ObjectHolder& Get(uint32_t slot) const {
+        return slots_[slot].value;
+    }
+
+    const ObjectHolder& Set(uint32_t slot, ObjectHolder value) {
+        slots_[slot].bound = true;
+        return slots_[slot].value = std::move(value);
+    }
+
+    // Освобождает все слоты и меняет размер; память фрейма по возможности переиспользуется
+    void Reset(size_t size);
+
+private:
+    struct Slot {
+        ObjectHolder value;
+        bool bound = false;
+    };
+
+    static constexpr size_t INLINE_SLOTS = 8;
+
+    std::array<Slot, INLINE_SLOTS> inline_slots_;
+    std::unique_ptr<Slot[]> heap_slots_;
+    size_t heap_capacity_ = 0;
+    Slot* slots_;
+    size_t size_;
+};
+
+// Делает фрейм текущим в контексте на время своей жизни
+class FrameScope {
+public:
+    FrameScope(Context& context, Frame& frame)
+        : context_(context), outer_(context.SetFrame(&frame)) {
+    }
+
+    FrameScope(const FrameScope&) = delete;
+    FrameScope& operator=(const FrameScope&) = delete;
+
+    ~FrameScope() {
+        context_.SetFrame(outer_);
+    }
+
+private:
+    Context& context_;
+    Frame* outer_;
+};
+
+// Засчитывает вызов метода в глубину контекста на время своей жизни
+class CallScope {
+public:
+    explicit CallScope(Context& context) : context_(context) {
+        context_.EnterCall();
+    }
+
+    CallScope(const CallScope&) = delete;
+    CallScope& operator=(const CallScope&) = delete;
+
+    ~CallScope() {
+        context_.LeaveCall();
+    }
+
+private:
+    Context& context_;
+};
 
 bool IsTrue(const ObjectHolder& object);
 
@@ -94,47 +309,278 @@ class Bool : public ValueObject<bool> {
 public:
     using ValueObject<bool>::ValueObject;
 
+    // Общие объекты True и False: результат сравнения или логической операции не выделяет память
+    [[nodiscard]] static const ObjectHolder& Of(bool value);
+
     void Print(std::ostream& os, Context& context) override;
 };
 
 
+struct MemoStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// Запомненные результаты вызовов чистого метода и решения анализа чистоты для классов self
+// (см. ast::FindPureMemo). Ключ вызова — класс self и аргументы Number/String/Bool/None.
+// Кеш ограничен CAPACITY записями; когда он полон, новые результаты не запоминаются
+class MethodMemo {
+public:
+    static constexpr size_t CAPACITY = 1 << 14;
+
+    // Ключ вызова, собираемый из аргументов по одному
+    class Key {
+    public:
+        Key() = default;
+        explicit Key(const Class& cls);
+
+        void AddNone();
+        void AddBool(bool value);
+        void AddNumber(int value);
+        void AddString(const std::string& value);
+        // false, если аргумент нельзя сравнить по значению; такой вызов не мемоизируется
+        [[nodiscard]] bool Add(const ObjectHolder& arg);
+
+    private:
+        friend class MethodMemo;
+
+        std::string bytes_;
+    };
+
+    // Решение анализа для класса self, если оно уже принято
+    [[nodiscard]] const bool* IsPureFor(const Class& cls) const;
+    void SetPureFor(const Class& cls, bool pure);
+
+    // Запомненный результат или nullptr; засчитывается как попадание или промах
+    [[nodiscard]] const ObjectHolder* Find(const Key& key);
+    void Store(Key key, ObjectHolder result);
+
+    [[nodiscard]] const MemoStats& GetStats() const {
+        return stats_;
+    }
+
+    [[nodiscard]] size_t GetSize() const {
+        return results_.size();
+    }
+
+    // Сумма по всем методам во всех потоках
+    [[nodiscard]] static MemoStats GetTotals();
+    static void ResetTotals();
+
+private:
+    // Классов у метода обычно один, поэтому поиск линейный
+    std::vector<std::pair<const Class*, bool>> verdicts_;
+    std::unordered_map<std::string, ObjectHolder> results_;
+    MemoStats stats_;
+    // Программы в разных потоках мемоизируют одновременно, поэтому общие счётчики атомарны
+    static std::atomic<uint64_t> total_hits_;
+    static std::atomic<uint64_t> total_misses_;
+};
+
 struct Method {
-    std::string name;
-    std::vector<std::string> formal_params;
+    Symbol name;
+    std::vector<Symbol> formal_params;
     std::unique_ptr<Executable> body;
+    // Размер фрейма тела с переменными по слотам: self в слоте 0, затем параметры и локальные
+    // переменные. 0 — тело читает переменные из Closure
+    size_t frame_size = 0;
+    // Создаётся при первом анализе чистоты метода
+    mutable std::unique_ptr<MethodMemo> memo = nullptr;
+};
+
+// Скрытый класс объекта: имена полей в порядке появления, поле в слоте с его номером.
+// Объекты одного класса, поля которых присваивались в одном порядке, разделяют форму.
+// Формы образуют дерево переходов от пустой формы класса; добавление поля — переход к дочерней форме.
+// Формы цепочки без ветвлений делят один список полей, форма видит его первые Size() элементов
+class Shape {
+public:
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+    Shape();
+
+    Shape(const Shape&) = delete;
+    Shape& operator=(const Shape&) = delete;
+
+    // Слот поля или NOT_FOUND
+    [[nodiscard]] uint32_t Find(Symbol field) const;
+
+    // Форма с добавленным полем, которого ещё нет; создаётся при первом переходе
+    [[nodiscard]] const Shape* Add(Symbol field) const;
+
+    [[nodiscard]] uint32_t Size() const {
+        return size_;
+    }
+
+    [[nodiscard]] Symbol FieldAt(uint32_t slot) const;
+
+private:
+    struct Layout {
+        std::vector<Symbol> fields;
+        std::unordered_map<Symbol, uint32_t> index;
+    };
+
+    // До такого числа полей поиск — просмотр списка, дальше — по индексу
+    static constexpr uint32_t LINEAR_LIMIT = 8;
+
+    Shape(std::shared_ptr<Layout> layout, uint32_t size);
+
+    std::shared_ptr<Layout> layout_;
+    uint32_t size_ = 0;
+    mutable std::unordered_map<Symbol, std::unique_ptr<Shape>> transitions_;
+};
+
+// Мономорфный кеш обращения к полю в узле программы: форма объекта и слот поля в ней.
+// Для записи нового поля запоминается и форма, в которую объект переходит.
+// Кеш принадлежит одному месту обращения и всегда используется с одним и тем же именем поля
+struct FieldCache {
+    const Shape* shape = nullptr;
+    const Shape* next = nullptr;
+    uint32_t slot = 0;
+};
+
+// Поля объекта: форма и значения по слотам. Кроме прямого доступа повторяет часть интерфейса
+// Closure (find, at, operator[], перебор пар имя — значение только для чтения) для кода,
+// написанного под словарь
+class FieldTable {
+public:
+    class Iterator {
+    public:
+        using value_type = std::pair<Symbol, const ObjectHolder&>;
+
+        // Пара имя — значение, на которую указывает итератор
+        class Pointer {
+        public:
+            explicit Pointer(value_type value)
+                : value_(value) {
+            }
+
+            value_type* operator->() {
+                return &value_;
+            }
+
+        private:
+            value_type value_;
+        };
+
+        Iterator(const FieldTable* table, uint32_t slot)
+            : table_(table), slot_(slot) {
+        }
+
+        value_type operator*() const;
+
+        Pointer operator->() const {
+            return Pointer(**this);
+        }
+
+        Iterator& operator++() {
+            ++slot_;
+            return *this;
+        }
+
+        friend bool operator==(const Iterator& lhs, const Iterator& rhs) {
+            return lhs.slot_ == rhs.slot_;
+        }
+
+        friend bool operator!=(const Iterator& lhs, const Iterator& rhs) {
+            return lhs.slot_ != rhs.slot_;
+        }
+
+    private:
+        const FieldTable* table_;
+        uint32_t slot_;
+    };
+
+    explicit FieldTable(const Shape& shape);
+
+    // Значение поля или nullptr
+    [[nodiscard]] ObjectHolder* Find(Symbol field);
+    [[nodiscard]] const ObjectHolder* Find(Symbol field) const;
+    [[nodiscard]] ObjectHolder* Find(Symbol field, FieldCache& cache);
+
+    // Слот поля; поля, которого нет, добавляется со значением None
+    ObjectHolder& operator[](Symbol field);
+    ObjectHolder& Slot(Symbol field, FieldCache& cache);
+
+    [[nodiscard]] const Shape& GetShape() const {
+        return *shape_;
+    }
+
+    [[nodiscard]] size_t size() const {
+        return slots_.size();
+    }
+
+    [[nodiscard]] bool empty() const {
+        return slots_.empty();
+    }
+
+    [[nodiscard]] size_t count(Symbol field) const {
+        return Find(field) != nullptr ? 1 : 0;
+    }
+
+    // std::out_of_range, если поля нет
+    [[nodiscard]] ObjectHolder& at(Symbol field);
+    [[nodiscard]] const ObjectHolder& at(Symbol field) const;
+
+    [[nodiscard]] Iterator find(Symbol field) const;
+
+    [[nodiscard]] Iterator begin() const {
+        return {this, 0};
+    }
+
+    [[nodiscard]] Iterator end() const {
+        return {this, static_cast<uint32_t>(slots_.size())};
+    }
+
+private:
+    ObjectHolder& Append(const Shape* next);
+
+    const Shape* shape_;
+    std::vector<ObjectHolder> slots_;
 };
 
 class Class : public Object {
     std::string name_;
     const Class* parent_;
-    std::unordered_map<std::string, Method> methods_;
+    std::unordered_map<Symbol, Method> methods_;
+    // Корень дерева форм объектов класса; в куче, чтобы адрес не менялся при перемещении класса
+    std::unique_ptr<Shape> root_shape_;
 
 public:
 
     explicit Class(std::string name, std::vector<Method> methods, const Class* parent = nullptr);
 
-    [[nodiscard]] const Method* GetMethod(const std::string& name) const;
+    [[nodiscard]] const Method* GetMethod(Symbol name) const;
     [[nodiscard]] const std::string& GetName() const;
+    [[nodiscard]] const Class* GetParent() const;
+    // Собственные методы класса, без унаследованных
+    [[nodiscard]] const std::unordered_map<Symbol, Method>& GetMethods() const;
+    // Форма нового объекта класса, без полей
+    [[nodiscard]] const Shape& GetRootShape() const;
 
     void Print(std::ostream& os, Context& context) override;
 };
 
 class ClassInstance : public Object {
     const Class& class_;
-    Closure closure_;
+    FieldTable fields_;
 
 public:
     explicit ClassInstance(const Class& cls);
 
     void Print(std::ostream& os, Context& context) override;
 
-    ObjectHolder Call(const std::string& method, const std::vector<ObjectHolder>& actual_args,
+    ObjectHolder Call(Symbol method, const std::vector<ObjectHolder>& actual_args,
                       Context& context);
+    // Вызов уже найденного метода класса объекта; число аргументов должно совпадать
+    ObjectHolder Call(const Method& method, const std::vector<ObjectHolder>& actual_args,
+                      Context& context);
+
+    [[nodiscard]] bool HasMethod(Symbol method, size_t argument_count) const;
 
-    [[nodiscard]] bool HasMethod(const std::string& method, size_t argument_count) const;
+    [[nodiscard]] const Class& GetClass() const;
 
-    [[nodiscard]] Closure& Fields();
-    [[nodiscard]] const Closure& Fields() const;
+    [[nodiscard]] FieldTable& Fields();
+    [[nodiscard]] const FieldTable& Fields() const;
 };
 
 bool Equal(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context);
@@ -2,6 +2,7 @@
 #include "test_runner_p.h"
 
 #include <functional>
+#include <map>
 
 using namespace std;
 
@@ -474,6 +475,134 @@ void TestComparison() {
     }
 }
 
+// Каждый оператор сравнения объектов одного класса вызывает не больше одного метода
+void TestComparisonDispatch() {
+    map<string, int> calls;
+    auto method = [&calls](string name, bool (*compare)(int, int)) {
+        auto body = [&calls, name, compare](Closure& closure, [[maybe_unused]] Context& ctx) {
+            ++calls[name];
+            const int lhs = closure.at("self"s).TryAs<ClassInstance>()->Fields().at("value"s).TryAs<Number>()->GetValue();
+            const int rhs = closure.at("rhs"s).TryAs<ClassInstance>()->Fields().at("value"s).TryAs<Number>()->GetValue();
+            return ObjectHolder::Own(Bool{compare(lhs, rhs)});
+        };
+        return Method{std::move(name), {"rhs"s}, make_unique<TestMethodBody>(body)};
+    };
+    auto make_instance = [](const Class& cls, int value) {
+        ObjectHolder instance = ObjectHolder::Own(ClassInstance{cls});
+        instance.TryAs<ClassInstance>()->Fields()["value"s] = ObjectHolder::Own(Number{value});
+        return instance;
+    };
+
+    vector<Method> key_methods;
+    key_methods.push_back(method("__lt__"s, [](int l, int r) { return l < r; }));
+    key_methods.push_back(method("__eq__"s, [](int l, int r) { return l == r; }));
+    Class key{"Key"s, std::move(key_methods), nullptr};
+
+    DummyContext ctx;
+    for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+            const ObjectHolder lhs = make_instance(key, a);
+            const ObjectHolder rhs = make_instance(key, b);
+            calls.clear();
+            ASSERT_EQUAL(Greater(lhs, rhs, ctx), a > b);
+            ASSERT_EQUAL(LessOrEqual(lhs, rhs, ctx), a <= b);
+            ASSERT_EQUAL(GreaterOrEqual(lhs, rhs, ctx), a >= b);
+            ASSERT_EQUAL(calls["__lt__"s], 3);
+            ASSERT_EQUAL(calls["__eq__"s], 0);
+        }
+    }
+
+    // Собственные __gt__, __le__ и __ge__ вызываются напрямую
+    vector<Method> ordered_methods;
+    ordered_methods.push_back(method("__gt__"s, [](int l, int r) { return l > r; }));
+    ordered_methods.push_back(method("__le__"s, [](int l, int r) { return l <= r; }));
+    ordered_methods.push_back(method("__ge__"s, [](int l, int r) { return l >= r; }));
+    Class ordered{"Ordered"s, std::move(ordered_methods), nullptr};
+
+    const ObjectHolder one = make_instance(ordered, 1);
+    const ObjectHolder two = make_instance(ordered, 2);
+    calls.clear();
+    ASSERT(Greater(two, one, ctx));
+    ASSERT(LessOrEqual(one, two, ctx));
+    ASSERT(!GreaterOrEqual(one, two, ctx));
+    // a < b выражается через b.__gt__(a)
+    ASSERT(Less(one, two, ctx));
+    ASSERT_EQUAL(calls["__gt__"s], 2);
+    ASSERT_EQUAL(calls["__le__"s], 1);
+    ASSERT_EQUAL(calls["__ge__"s], 1);
+    ASSERT_THROWS(Equal(one, two, ctx), runtime_error);
+}
+
+void TestShapes() {
+    Class cls{"Point"s, {}, nullptr};
+    ClassInstance a{cls};
+    ClassInstance b{cls};
+    ClassInstance c{cls};
+    ASSERT_EQUAL(&a.Fields().GetShape(), &cls.GetRootShape());
+
+    // Одинаковый порядок присваивания — общая форма, другой — своя
+    a.Fields()["x"s] = ObjectHolder::Own(Number{1});
+    a.Fields()["y"s] = ObjectHolder::Own(Number{2});
+    b.Fields()["x"s] = ObjectHolder::Own(Number{3});
+    b.Fields()["y"s] = ObjectHolder::Own(Number{4});
+    c.Fields()["y"s] = ObjectHolder::Own(Number{5});
+    c.Fields()["x"s] = ObjectHolder::Own(Number{6});
+    ASSERT_EQUAL(&a.Fields().GetShape(), &b.Fields().GetShape());
+    ASSERT(&a.Fields().GetShape() != &c.Fields().GetShape());
+    ASSERT_EQUAL(a.Fields().GetShape().Find("y"s), 1u);
+    ASSERT_EQUAL(c.Fields().GetShape().Find("y"s), 0u);
+    ASSERT_EQUAL(cls.GetRootShape().Find("x"s), Shape::NOT_FOUND);
+
+    // Перезапись поля не меняет форму
+    const Shape* shape = &b.Fields().GetShape();
+    b.Fields()["x"s] = ObjectHolder::Own(Number{7});
+    ASSERT_EQUAL(&b.Fields().GetShape(), shape);
+
+    // Интерфейс словаря: поиск, at и перебор в порядке добавления полей
+    ASSERT(c.Fields().find("z"s) == c.Fields().end());
+    ASSERT_THROWS(static_cast<void>(c.Fields().at("z"s)), out_of_range);
+    ASSERT_EQUAL(c.Fields().find("x"s)->second.TryAs<Number>()->GetValue(), 6);
+    ASSERT_EQUAL(c.Fields().count("y"s), 1u);
+    vector<string> names;
+    for (const auto& [name, value] : c.Fields())
+        names.push_back(name.Name() + "="s + to_string(value.TryAs<Number>()->GetValue()));
+    ASSERT_EQUAL(names, (vector<string>{"y=5"s, "x=6"s}));
+
+    // Длинная цепочка и ветвление от её середины
+    ClassInstance wide{cls};
+    ClassInstance branch{cls};
+    for (int i = 0; i < 20; ++i) {
+        wide.Fields()["f"s + to_string(i)] = ObjectHolder::Own(Number{i});
+        if (i < 10)
+            branch.Fields()["f"s + to_string(i)] = ObjectHolder::Own(Number{i});
+    }
+    branch.Fields()["other"s] = ObjectHolder::None();
+    for (int i = 0; i < 20; ++i)
+        ASSERT_EQUAL(wide.Fields().at("f"s + to_string(i)).TryAs<Number>()->GetValue(), i);
+    ASSERT_EQUAL(branch.Fields().GetShape().Find("other"s), 10u);
+    ASSERT_EQUAL(branch.Fields().GetShape().Find("f12"s), Shape::NOT_FOUND);
+    ASSERT_EQUAL(wide.Fields().GetShape().Find("other"s), Shape::NOT_FOUND);
+
+    // Кеш действует только для объектов той формы, для которой заполнен
+    FieldCache cache;
+    ASSERT_EQUAL(a.Fields().Find("y"s, cache)->TryAs<Number>()->GetValue(), 2);
+    ASSERT_EQUAL(cache.shape, &a.Fields().GetShape());
+    ASSERT_EQUAL(b.Fields().Find("y"s, cache)->TryAs<Number>()->GetValue(), 4);
+    ASSERT_EQUAL(c.Fields().Find("y"s, cache)->TryAs<Number>()->GetValue(), 5);
+    ASSERT_EQUAL(cache.shape, &c.Fields().GetShape());
+    FieldCache missing;
+    ASSERT(c.Fields().Find("z"s, missing) == nullptr);
+    ASSERT(missing.shape == nullptr);
+
+    // Кеш записи запоминает переход к форме с новым полем
+    FieldCache store;
+    a.Fields().Slot("z"s, store) = ObjectHolder::Own(Number{8});
+    ASSERT_EQUAL(store.next, &a.Fields().GetShape());
+    b.Fields().Slot("z"s, store) = ObjectHolder::Own(Number{9});
+    ASSERT_EQUAL(&a.Fields().GetShape(), &b.Fields().GetShape());
+    ASSERT_EQUAL(b.Fields().at("z"s).TryAs<Number>()->GetValue(), 9);
+}
+
 void TestClass() {
     vector<Method> methods;
     Closure* passed_closure = nullptr;
@@ -538,8 +667,10 @@ void RunObjectsTests(TestRunner& tr) {
     RUN_TEST(tr, runtime::TestMethodInvocation);
     RUN_TEST(tr, runtime::TestIsTrue);
     RUN_TEST(tr, runtime::TestComparison);
+    RUN_TEST(tr, runtime::TestComparisonDispatch);
     RUN_TEST(tr, runtime::TestClass);
     RUN_TEST(tr, runtime::TestClassInstance);
+    RUN_TEST(tr, runtime::TestShapes);
 }
 
 void RunObjectHolderTests(TestRunner& tr) {
@@ -0,0 +1,250 @@
+#include "scan.h"
+
+#include <atomic>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MYTHON_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace parse {
+
+namespace {
+
+inline bool IsWordChar(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+}
+
+inline bool IsStringSpecial(char c, char separator) {
+    return c == separator || c == '\\' || c == '\n' || c == '\r';
+}
+
+const char* SkipSpacesScalar(const char* it, const char* end) {
+    while (it != end && *it == ' ')
+        ++it;
+    return it;
+}
+
+const char* SkipWordCharsScalar(const char* it, const char* end) {
+    while (it != end && IsWordChar(*it))
+        ++it;
+    return it;
+}
+
+const char* FindStringSpecialScalar(const char* it, const char* end, char separator) {
+    while (it != end && !IsStringSpecial(*it, separator))
+        ++it;
+    return it;
+}
+
+#ifdef MYTHON_SCAN_X86
+
+// Байты блока в диапазоне [lo, hi]. Сравнение знаковое, поэтому байты >= 0x80 в диапазон не попадают
+inline __m128i InRange16(__m128i bytes, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(static_cast<char>(lo - 1))),
+                         _mm_cmplt_epi8(bytes, _mm_set1_epi8(static_cast<char>(hi + 1))));
+}
+
+inline __m128i WordChars16(__m128i bytes) {
+    // Установка бита 0x20 переводит заглавные латинские буквы в строчные и не создаёт новых букв
+    const __m128i lowered = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+    return _mm_or_si128(_mm_or_si128(InRange16(bytes, '0', '9'), InRange16(lowered, 'a', 'z')),
+                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')));
+}
+
+const char* SkipSpacesSse2(const char* it, const char* end) {
+    const __m128i space = _mm_set1_epi8(' ');
+    for (; end - it >= 16; it += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+        const unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, space)) & 0xFFFFu;
+        if (mask != 0)
+            return it + __builtin_ctz(mask);
+    }
+    return SkipSpacesScalar(it, end);
+}
+
+const char* SkipWordCharsSse2(const char* it, const char* end) {
+    for (; end - it >= 16; it += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+        const unsigned mask = ~_mm_movemask_epi8(WordChars16(bytes)) & 0xFFFFu;
+        if (mask != 0)
+            return it + __builtin_ctz(mask);
+    }
+    return SkipWordCharsScalar(it, end);
+}
+
+const char* FindStringSpecialSse2(const char* it, const char* end, char separator) {
+    const __m128i sep = _mm_set1_epi8(separator);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (; end - it >= 16; it += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+        const __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, sep), _mm_cmpeq_epi8(bytes, backslash)),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, lf), _mm_cmpeq_epi8(bytes, cr)));
+        if (const unsigned mask = _mm_movemask_epi8(hits); mask != 0)
+            return it + __builtin_ctz(mask);
+    }
+    return FindStringSpecialScalar(it, end, separator);
+}
+
+__attribute__((target("avx2"))) inline __m256i InRange32(__m256i bytes, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(static_cast<char>(lo - 1))),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi + 1)), bytes));
+}
+
+__attribute__((target("avx2"))) const char* SkipSpacesAvx2(const char* it, const char* end) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    for (; end - it >= 32; it += 32) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it));
+        const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, space)));
+        if (mask != 0)
+            return it + __builtin_ctz(mask);
+    }
+    return SkipSpacesSse2(it, end);
+}
+
+__attribute__((target("avx2"))) const char* SkipWordCharsAvx2(const char* it, const char* end) {
+    for (; end - it >= 32; it += 32) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it));
+        const __m256i lowered = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+        const __m256i word = _mm256_or_si256(
+            _mm256_or_si256(InRange32(bytes, '0', '9'), InRange32(lowered, 'a', 'z')),
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('_')));
+        const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(word));
+        if (mask != 0)
+            return it + __builtin_ctz(mask);
+    }
+    return SkipWordCharsSse2(it, end);
+}
+
+__attribute__((target("avx2"))) const char* FindStringSpecialAvx2(const char* it, const char* end,
+                                                                   char separator) {
+    const __m256i sep = _mm256_set1_epi8(separator);
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    for (; end - it >= 32; it += 32) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it));
+        const __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, sep), _mm256_cmpeq_epi8(bytes, backslash)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, lf), _mm256_cmpeq_epi8(bytes, cr)));
+        if (const auto mask = static_cast<unsigned>(_mm256_movemask_epi8(hits)); mask != 0)
+            return it + __builtin_ctz(mask);
+    }
+    return FindStringSpecialSse2(it, end, separator);
+}
+
+#endif  // MYTHON_SCAN_X86
+
+struct ScanKernels {
+    ScanKernel kernel;
+    const char* (*skip_spaces)(const char*, const char*);
+    const char* (*skip_word_chars)(const char*, const char*);
+    const char* (*find_string_special)(const char*, const char*, char);
+};
+
+constexpr ScanKernels SCALAR_KERNELS{ScanKernel::Scalar, SkipSpacesScalar, SkipWordCharsScalar,
+                                     FindStringSpecialScalar};
+
+#ifdef MYTHON_SCAN_X86
+constexpr ScanKernels SSE2_KERNELS{ScanKernel::Sse2, SkipSpacesSse2, SkipWordCharsSse2,
+                                   FindStringSpecialSse2};
+constexpr ScanKernels AVX2_KERNELS{ScanKernel::Avx2, SkipSpacesAvx2, SkipWordCharsAvx2,
+                                   FindStringSpecialAvx2};
+#endif
+
+bool IsSupported(ScanKernel kernel) {
+#ifdef MYTHON_SCAN_X86
+    // Вызывается и при статической инициализации, до конструкторов libgcc
+    __builtin_cpu_init();
+#endif
+    switch (kernel) {
+        case ScanKernel::Scalar:
+            return true;
+#ifdef MYTHON_SCAN_X86
+        case ScanKernel::Sse2:
+            return __builtin_cpu_supports("sse2");
+        case ScanKernel::Avx2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+const ScanKernels& KernelsFor(ScanKernel kernel) {
+    switch (kernel) {
+#ifdef MYTHON_SCAN_X86
+        case ScanKernel::Sse2:
+            return SSE2_KERNELS;
+        case ScanKernel::Avx2:
+            return AVX2_KERNELS;
+#endif
+        default:
+            return SCALAR_KERNELS;
+    }
+}
+
+const ScanKernels* SelectKernels() {
+    for (ScanKernel kernel : {ScanKernel::Avx2, ScanKernel::Sse2}) {
+        if (IsSupported(kernel))
+            return &KernelsFor(kernel);
+    }
+    return &SCALAR_KERNELS;
+}
+
+// Лексеры TokenizeAllParallel читают ядро из своих потоков, пока другой поток может его сменить
+atomic<const ScanKernels*> active_kernels = SelectKernels();
+
+inline const ScanKernels& Active() {
+    return *active_kernels.load(memory_order_acquire);
+}
+
+}  // namespace
+
+const char* SkipSpaces(const char* it, const char* end) {
+    return Active().skip_spaces(it, end);
+}
+
+const char* SkipWordChars(const char* it, const char* end) {
+    return Active().skip_word_chars(it, end);
+}
+
+const char* FindLineEnd(const char* it, const char* end) {
+    // memchr в стандартной библиотеке уже векторизован
+    const void* found = memchr(it, '\n', static_cast<size_t>(end - it));
+    return found != nullptr ? static_cast<const char*>(found) : end;
+}
+
+const char* FindStringSpecial(const char* it, const char* end, char separator) {
+    return Active().find_string_special(it, end, separator);
+}
+
+ScanKernel ActiveScanKernel() {
+    return Active().kernel;
+}
+
+bool SetScanKernel(ScanKernel kernel) {
+    if (!IsSupported(kernel))
+        return false;
+    active_kernels.store(&KernelsFor(kernel), memory_order_release);
+    return true;
+}
+
+std::string_view ScanKernelName(ScanKernel kernel) {
+    switch (kernel) {
+        case ScanKernel::Sse2:
+            return "sse2"sv;
+        case ScanKernel::Avx2:
+            return "avx2"sv;
+        default:
+            return "scalar"sv;
+    }
+}
+
+}  // namespace parse
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string_view>
+
+namespace parse {
+
+// Ядра поиска границ лексем. Каждая функция возвращает указатель на первый символ,
+// не входящий в искомую последовательность, либо end
+enum class ScanKernel {
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+// Конец последовательности пробелов
+const char* SkipSpaces(const char* it, const char* end);
+
+// Конец последовательности символов идентификатора [0-9A-Za-z_]
+const char* SkipWordChars(const char* it, const char* end);
+
+// Первый '\n' либо end
+const char* FindLineEnd(const char* it, const char* end);
+
+// Первый символ, прерывающий простую строковую константу: separator, '\\', '\n' или '\r'
+const char* FindStringSpecial(const char* it, const char* end, char separator);
+
+// Ядро выбирается при запуске по возможностям процессора
+[[nodiscard]] ScanKernel ActiveScanKernel();
+// Возвращает false, если процессор не поддерживает ядро. Можно вызывать во время разбора
+// в других потоках: лексема, которую уже начали искать, дочитывается прежним ядром
+bool SetScanKernel(ScanKernel kernel);
+
+[[nodiscard]] std::string_view ScanKernelName(ScanKernel kernel);
+
+}  // namespace parse
@@ -1,5 +1,8 @@
 #include "statement.h"
 
+#include "purity.h"
+
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
@@ -12,63 +15,84 @@ using runtime::Context;
 using runtime::ObjectHolder;
 
 namespace {
-const string ADD_METHOD = "__add__"s;
-const string INIT_METHOD = "__init__"s;
+const runtime::Symbol ADD_METHOD = "__add__"sv;
+const runtime::Symbol INIT_METHOD = "__init__"sv;
 }  // namespace
 
 ObjectHolder Assignment::Execute(Closure& closure, Context& context) {
+    if (slot_ != NO_SLOT)
+        return context.GetFrame()->Set(slot_, rvalue_->Execute(closure, context));
     return closure[name_] = rvalue_->Execute(closure, context);
 }
 
-Assignment::Assignment(std::string var, std::unique_ptr<Statement> rv) : name_(var), rvalue_(std::move(rv)) {
+Assignment::Assignment(runtime::Symbol var, Ptr<Statement> rv, uint32_t slot) : name_(var), slot_(slot), rvalue_(std::move(rv)) {
 }
 
-VariableValue::VariableValue(const std::string& var_name) : dotted_ids_({var_name}) {
+VariableValue::VariableValue(runtime::Symbol var_name) : dotted_ids_({var_name}) {
 }
 
-VariableValue::VariableValue(std::vector<std::string> dotted_ids) : dotted_ids_(dotted_ids) {
+VariableValue::VariableValue(std::vector<runtime::Symbol> dotted_ids, uint32_t slot) : dotted_ids_(std::move(dotted_ids)), slot_(slot),
+                                                                                        field_caches_(std::max<size_t>(dotted_ids_.size(), 1) - 1) {
 }
 
-ObjectHolder VariableValue::Execute(Closure& closure, Context& /*context*/) {
-    auto local_closure = closure;
-    for (auto it = dotted_ids_.begin(); it != std::prev(dotted_ids_.end()); ++it)
-        if (local_closure.count(*it)) {
+VariableValue::VariableValue(const std::vector<std::string>& dotted_ids) : dotted_ids_(dotted_ids.begin(), dotted_ids.end()),
+                                                                           field_caches_(std::max<size_t>(dotted_ids_.size(), 1) - 1) {
+}
 
-            if ( auto ptr = local_closure.at(*it).TryAs<runtime::ClassInstance>(); ptr )
-               local_closure = ptr->Fields();
-            else
-                throw std::runtime_error("not definition var"s);
-        } else
+const ObjectHolder& VariableValue::Lookup(Closure& closure, Context& context) const {
+    const ObjectHolder* object = nullptr;
+    if (slot_ != NO_SLOT) {
+        const runtime::Frame& frame = *context.GetFrame();
+        if (!frame.IsBound(slot_))
             throw std::runtime_error("not definition var"s);
-
-    if (local_closure.count(dotted_ids_.back()))
-        return local_closure.at(dotted_ids_.back());
+        object = &frame.Get(slot_);
+    } else if (auto it = closure.find(dotted_ids_.front()); it != closure.end())
+        object = &it->second;
     else
         throw std::runtime_error("not definition var"s);
+
+    for (size_t i = 1; i < dotted_ids_.size(); ++i) {
+        auto ptr = object->TryAs<runtime::ClassInstance>();
+        if (!ptr)
+            throw std::runtime_error("not definition var"s);
+
+        object = ptr->Fields().Find(dotted_ids_[i], field_caches_[i - 1]);
+        if (object == nullptr)
+            throw std::runtime_error("not definition var"s);
+    }
+    return *object;
 }
 
-unique_ptr<Print> Print::Variable(const std::string& name) {
-    auto new_print_ptn = make_unique<Print>(vector<unique_ptr<Statement>>{});
+ObjectHolder VariableValue::Execute(Closure& closure, Context& context) {
+    return Lookup(closure, context);
+}
+
+unique_ptr<Print> Print::Variable(runtime::Symbol name) {
+    auto new_print_ptn = make_unique<Print>(StatementList{});
     new_print_ptn->args_ = name;
     return new_print_ptn;
 }
 
-Print::Print(unique_ptr<Statement> argument) {
-    vector<unique_ptr<Statement>> tmp;
+Print::Print(Ptr<Statement> argument) {
+    StatementList tmp;
     tmp.emplace_back(std::move(argument));
     args_ = std::move(tmp);
 }
 
-Print::Print(vector<unique_ptr<Statement>> args) : args_(std::move(args)) {
+Print::Print(StatementList args) : args_(std::move(args)) {
+}
+
+Print::Print(std::vector<std::unique_ptr<Statement>> args) : args_(StatementList(std::make_move_iterator(args.begin()),
+                                                                                std::make_move_iterator(args.end()))) {
 }
 
 ObjectHolder Print::Execute(Closure& closure, Context& context) {
-    if (std::holds_alternative<std::string>(args_)) {
-        if (closure.at(std::get<std::string>(args_)))
-            closure.at(std::get<std::string>(args_))->Print(context.GetOutputStream(),context);
+    if (std::holds_alternative<runtime::Symbol>(args_)) {
+        if (closure.at(std::get<runtime::Symbol>(args_)))
+            closure.at(std::get<runtime::Symbol>(args_))->Print(context.GetOutputStream(),context);
     }else {
         bool is_first = true;
-        for(auto& item : std::get<std::vector<std::unique_ptr<Statement>>>(args_)){
+        for(auto& item : std::get<StatementList>(args_)){
             if (is_first)
                 is_first = false;
             else
@@ -84,25 +108,58 @@ ObjectHolder Print::Execute(Closure& closure, Context& context) {
     return ObjectHolder::None();
 }
 
-MethodCall::MethodCall(std::unique_ptr<Statement> object, std::string method,
-                       std::vector<std::unique_ptr<Statement>> args) : object_(std::move(object)), method_(std::move(method)),args_(std::move(args)) {
+MethodCall::MethodCall(Ptr<Statement> object, runtime::Symbol method,
+                       StatementList args) : object_(std::move(object)), method_(std::move(method)),args_(std::move(args)) {
 }
 
-ObjectHolder MethodCall::Execute(Closure& closure, Context& context) {
-    auto class_ptr = object_->Execute(closure,context).TryAs<runtime::ClassInstance>();
-    if (class_ptr)
-        if (class_ptr->HasMethod(method_, args_.size())) {
+std::atomic<uint64_t> CallSiteCache::total_hits_ = 0;
+std::atomic<uint64_t> CallSiteCache::total_misses_ = 0;
+
+CallSiteStats CallSiteCache::GetTotals() {
+    return {total_hits_.load(std::memory_order_relaxed), total_misses_.load(std::memory_order_relaxed)};
+}
+
+void CallSiteCache::ResetTotals() {
+    total_hits_.store(0, std::memory_order_relaxed);
+    total_misses_.store(0, std::memory_order_relaxed);
+}
+
+const runtime::Method* CallSiteCache::Lookup(const runtime::Class& cls, runtime::Symbol name) {
+    for (uint8_t i = 0; i < size_; ++i)
+        if (entries_[i].cls == &cls) {
+            ++stats_.hits;
+            total_hits_.fetch_add(1, std::memory_order_relaxed);
+            return entries_[i].method;
+        }
+
+    ++stats_.misses;
+    total_misses_.fetch_add(1, std::memory_order_relaxed);
+    const runtime::Method* method = cls.GetMethod(name);
+    if (method != nullptr && size_ < POLYMORPHIC_LIMIT)
+        entries_[size_++] = {&cls, method};
+    return method;
+}
+
+runtime::Context::TailCall MethodCall::Prepare(Closure& closure, Context& context) {
+    ObjectHolder object = object_->Execute(closure,context);
+    if (auto class_ptr = object.TryAs<runtime::ClassInstance>(); class_ptr)
+        if (auto method = cache_.Lookup(class_ptr->GetClass(), method_); method && method->formal_params.size() == args_.size()) {
             std::vector<ObjectHolder>actual_args;
             actual_args.reserve(args_.size());
             for (auto& item : args_)
                 actual_args.emplace_back(item->Execute(closure,context));
 
-            return class_ptr->Call(method_, actual_args, context);
+            return {std::move(object), method, std::move(actual_args)};
         }
 
     throw std::runtime_error("method not found"s);
 }
 
+ObjectHolder MethodCall::Execute(Closure& closure, Context& context) {
+    const runtime::Context::TailCall call = Prepare(closure, context);
+    return CallMemoized(*call.object.TryAs<runtime::ClassInstance>(), *call.method, call.args, context);
+}
+
 ObjectHolder Stringify::Execute(Closure& closure, Context& context) {
     auto obj = argument_->Execute(closure, context);
     stringstream str;
@@ -163,38 +220,52 @@ ObjectHolder Div::Execute(Closure& closure, Context& context) {
 }
 
 ObjectHolder Compound::Execute(Closure& closure, Context& context) {
-    for(auto& item : statement_)
+    for(auto& item : statement_) {
         item->Execute(closure,context);
+        if (context.IsReturning())
+            break;
+    }
     return ObjectHolder::None();
 }
 
 ObjectHolder Return::Execute(Closure& closure, Context& context) {
-    throw statement_->Execute(closure,context);
-    return {};
+    if (tail_call_ != nullptr)
+        context.SetTailCall(tail_call_->Prepare(closure, context));
+    else
+        context.SetReturnValue(statement_->Execute(closure,context));
+    return ObjectHolder::None();
 }
 
-ClassDefinition::ClassDefinition(ObjectHolder cls) : class_(cls) {
+ClassDefinition::ClassDefinition(ObjectHolder cls, uint32_t slot) : class_(cls), slot_(slot) {
 }
 
-ObjectHolder ClassDefinition::Execute(Closure& closure, Context& /*context*/) {
-    closure[class_.TryAs<runtime::Class>()->GetName()] = class_;
+ObjectHolder ClassDefinition::Execute(Closure& closure, Context& context) {
+    if (slot_ != NO_SLOT)
+        context.GetFrame()->Set(slot_, class_);
+    else
+        closure[class_.TryAs<runtime::Class>()->GetName()] = class_;
 
     return ObjectHolder::None();
 }
 
-FieldAssignment::FieldAssignment(VariableValue object, std::string field_name,
-                                 std::unique_ptr<Statement> rv) : object_(object), field_name_(field_name), rvalue_(std::move(rv)) {
+FieldAssignment::FieldAssignment(VariableValue object, runtime::Symbol field_name,
+                                 Ptr<Statement> rv) : object_(object), field_name_(field_name), rvalue_(std::move(rv)) {
 }
 
 ObjectHolder FieldAssignment::Execute(Closure& closure, Context& context) {
-    if(auto item_ptr = object_.Execute(closure, context).TryAs<runtime::ClassInstance>(); item_ptr )
-        return item_ptr->Fields()[field_name_] = rvalue_->Execute(closure, context);
+    // Держим объект: правая часть может перезаписать поле, через которое он найден
+    const ObjectHolder object = object_.Lookup(closure, context);
+    if(auto item_ptr = object.TryAs<runtime::ClassInstance>(); item_ptr ) {
+        // Правая часть может добавить полей этому же объекту: слот ищется после её вычисления
+        ObjectHolder value = rvalue_->Execute(closure, context);
+        return item_ptr->Fields().Slot(field_name_, cache_) = std::move(value);
+    }
 
     throw std::runtime_error("Class has not self"s);
 }
 
-IfElse::IfElse(std::unique_ptr<Statement> condition, std::unique_ptr<Statement> if_body,
-               std::unique_ptr<Statement> else_body) : condition_(std::move(condition)), if_body_(std::move(if_body)), else_body_ (std::move(else_body)) {
+IfElse::IfElse(Ptr<Statement> condition, Ptr<Statement> if_body,
+               Ptr<Statement> else_body) : condition_(std::move(condition)), if_body_(std::move(if_body)), else_body_ (std::move(else_body)) {
 }
 
 ObjectHolder IfElse::Execute(Closure& closure, Context& context) {
@@ -209,37 +280,95 @@ ObjectHolder IfElse::Execute(Closure& closure, Context& context) {
 ObjectHolder Or::Execute(Closure& closure, Context& context) {
     bool lhs = runtime::IsTrue(lhs_->Execute(closure,context));
     if (lhs)
-        return ObjectHolder::Own( runtime::Bool( true ) );
+        return runtime::Bool::Of(true);
 
     bool rhs = runtime::IsTrue(rhs_->Execute(closure,context));
-    return ObjectHolder::Own( runtime::Bool( rhs ) );
+    return runtime::Bool::Of(rhs);
 }
 
 ObjectHolder And::Execute(Closure& closure, Context& context) {
     bool lhs = runtime::IsTrue(lhs_->Execute(closure,context));
     if (!lhs)
-        return ObjectHolder::Own( runtime::Bool( false ) );
+        return runtime::Bool::Of(false);
 
     bool rhs = runtime::IsTrue(rhs_->Execute(closure,context));
-    return ObjectHolder::Own( runtime::Bool( rhs ) );
+    return runtime::Bool::Of(rhs);
 }
 
 ObjectHolder Not::Execute(Closure& closure, Context& context) {
     bool arg = runtime::IsTrue(argument_->Execute(closure,context));
-    return ObjectHolder::Own( runtime::Bool( !arg ) );
+    return runtime::Bool::Of(!arg);
 }
 
-Comparison::Comparison(Comparator cmp, unique_ptr<Statement> lhs, unique_ptr<Statement> rhs)
+ObjectHolder Negate::Execute(Closure& closure, Context& context) {
+    auto arg = argument_->Execute(closure,context);
+    if (auto ptr = arg.TryAs<runtime::Number>(); ptr)
+        return ObjectHolder::Own( runtime::Number( -ptr->GetValue() ) );
+
+    throw std::runtime_error("incorrect Negate operand"s);
+}
+
+Comparison::Comparison(Comparator cmp, Ptr<Statement> lhs, Ptr<Statement> rhs)
     : BinaryOperation(std::move(lhs), std::move(rhs)), cmp_(cmp) {
 }
 
 ObjectHolder Comparison::Execute(Closure& closure, Context& context) {
-    return ObjectHolder::Own( runtime::Bool(cmp_(lhs_->Execute(closure,context),
-                                                rhs_->Execute(closure,context),
-                                                context)) );
+    return runtime::Bool::Of(cmp_(lhs_->Execute(closure,context),
+                                  rhs_->Execute(closure,context),
+                                  context));
+}
+
+namespace {
+
+template <CompareOp OP>
+constexpr Comparison::Comparator RUNTIME_COMPARATOR = nullptr;
+template <>
+constexpr Comparison::Comparator RUNTIME_COMPARATOR<CompareOp::Equal> = runtime::Equal;
+template <>
+constexpr Comparison::Comparator RUNTIME_COMPARATOR<CompareOp::NotEqual> = runtime::NotEqual;
+template <>
+constexpr Comparison::Comparator RUNTIME_COMPARATOR<CompareOp::Less> = runtime::Less;
+template <>
+constexpr Comparison::Comparator RUNTIME_COMPARATOR<CompareOp::Greater> = runtime::Greater;
+template <>
+constexpr Comparison::Comparator RUNTIME_COMPARATOR<CompareOp::LessOrEqual> = runtime::LessOrEqual;
+template <>
+constexpr Comparison::Comparator RUNTIME_COMPARATOR<CompareOp::GreaterOrEqual> = runtime::GreaterOrEqual;
+
+}  // namespace
+
+template <CompareOp OP>
+Compare<OP>::Compare(Ptr<Statement> lhs, Ptr<Statement> rhs)
+    : Comparison(RUNTIME_COMPARATOR<OP>, std::move(lhs), std::move(rhs)) {
+}
+
+template <CompareOp OP>
+ObjectHolder Compare<OP>::Execute(Closure& closure, Context& context) {
+    const ObjectHolder lhs = lhs_->Execute(closure, context);
+    const ObjectHolder rhs = rhs_->Execute(closure, context);
+
+    // Точное совпадение типов вместо цепочки dynamic_cast
+    const runtime::Object* l = lhs.Get();
+    const runtime::Object* r = rhs.Get();
+    if (l != nullptr && r != nullptr && typeid(*l) == typeid(*r)) {
+        if (typeid(*l) == typeid(runtime::Number))
+            return runtime::Bool::Of(Apply(static_cast<const runtime::Number*>(l)->GetValue(),
+                                           static_cast<const runtime::Number*>(r)->GetValue()));
+        if (typeid(*l) == typeid(runtime::String))
+            return runtime::Bool::Of(Apply(static_cast<const runtime::String*>(l)->GetValue(),
+                                           static_cast<const runtime::String*>(r)->GetValue()));
+    }
+    return runtime::Bool::Of(RUNTIME_COMPARATOR<OP>(lhs, rhs, context));
 }
 
-NewInstance::NewInstance(const runtime::Class& class_, std::vector<std::unique_ptr<Statement>> args) : new_object_class_(class_), args_(std::move(args)) {
+template class Compare<CompareOp::Equal>;
+template class Compare<CompareOp::NotEqual>;
+template class Compare<CompareOp::Less>;
+template class Compare<CompareOp::Greater>;
+template class Compare<CompareOp::LessOrEqual>;
+template class Compare<CompareOp::GreaterOrEqual>;
+
+NewInstance::NewInstance(const runtime::Class& class_, StatementList args) : new_object_class_(class_), args_(std::move(args)) {
 }
 
 NewInstance::NewInstance(const runtime::Class& class_) : new_object_class_(class_) {
@@ -247,29 +376,106 @@ NewInstance::NewInstance(const runtime::Class& class_) : new_object_class_(class
 
 ObjectHolder NewInstance::Execute(Closure& closure, Context& context) {
     auto new_object_ = ObjectHolder::Own(runtime::ClassInstance(new_object_class_));
-    if(auto ptr_class = new_object_.TryAs<runtime::ClassInstance>(); ptr_class->HasMethod(INIT_METHOD, args_.size())){
+    if(auto init = init_cache_.Lookup(new_object_class_, INIT_METHOD); init && init->formal_params.size() == args_.size()){
         std::vector<ObjectHolder> vector_args;
         vector_args.reserve(args_.size());
         for(auto&& item : args_)
             vector_args.push_back(item->Execute(closure, context));
 
-       ptr_class->Call(INIT_METHOD,vector_args,context);
+       new_object_.TryAs<runtime::ClassInstance>()->Call(*init,vector_args,context);
     }
     return new_object_;
 }
 
-MethodBody::MethodBody(std::unique_ptr<Statement>&& body) : body_(std::move(body)) {
+MethodBody::MethodBody(Ptr<Statement> body, std::shared_ptr<const Arena> arena)
+    : arena_(std::move(arena)), body_(std::move(body)) {
 }
 
 ObjectHolder MethodBody::Execute(Closure& closure, Context& context) {
+    body_->Execute(closure,context);
+    if (context.IsReturning())
+        return context.TakeReturnValue();
 
-    try {
-        body_->Execute(closure,context);
-    }
-    catch (ObjectHolder& ans) {
-        return ans;
+    return ObjectHolder::None();
+}
+
+LazyMethodBody::LazyMethodBody(std::function<MethodBody*(Arena&)> parse, std::shared_ptr<Arena> arena)
+    : arena_(std::move(arena)), parse_(std::move(parse)) {
+}
+
+MethodBody& LazyMethodBody::GetBody() {
+    if (body_ == nullptr) {
+        body_ = parse_(*arena_);
+        // Копия лексем тела больше не нужна
+        parse_ = nullptr;
     }
+    return *body_;
+}
 
+ObjectHolder LazyMethodBody::Execute(Closure& closure, Context& context) {
+    return GetBody().Execute(closure, context);
+}
+
+Arena& Program::GetArena() {
+    return arena_;
+}
+
+const Arena& Program::GetArena() const {
+    return arena_;
+}
+
+void Program::SetBody(Statement* body) {
+    body_ = body;
+}
+
+const Statement& Program::GetBody() const {
+    return *body_;
+}
+
+void Program::SetGlobals(std::vector<runtime::Symbol> globals) {
+    globals_ = std::move(globals);
+}
+
+const std::vector<runtime::Symbol>& Program::GetGlobals() const {
+    return globals_;
+}
+
+void Program::AddClass(ObjectHolder cls) {
+    classes_.push_back(std::move(cls));
+}
+
+const std::vector<ObjectHolder>& Program::GetClasses() const {
+    return classes_;
+}
+
+ObjectHolder Program::Execute(Closure& closure, Context& context) {
+    runtime::Frame frame(globals_.size());
+    for (uint32_t slot = 0; slot < globals_.size(); ++slot)
+        if (auto it = closure.find(globals_[slot]); it != closure.end())
+            frame.Set(slot, it->second);
+
+    auto publish = [&] {
+        for (uint32_t slot = 0; slot < globals_.size(); ++slot)
+            if (frame.IsBound(slot))
+                closure[globals_[slot]] = frame.Get(slot);
+    };
+
+    runtime::FrameScope scope(context, frame);
+    try {
+        body_->Execute(closure, context);
+        // return на верхнем уровне просто завершает программу; хвостовой вызов в нём выполняется
+        // обычным вызовом
+        if (context.IsReturning())
+            context.TakeReturnValue();
+        if (context.HasTailCall()) {
+            const runtime::Context::TailCall call = context.TakeTailCall();
+            call.object.TryAs<runtime::ClassInstance>()->Call(*call.method, call.args, context);
+        }
+    } catch (...) {
+        publish();
+        throw;
+    }
+    publish();
     return ObjectHolder::None();
 }
 
@@ -1,13 +1,22 @@
 #pragma once
 
+#include "arena.h"
 #include "runtime.h"
 
+#include <array>
+#include <atomic>
 #include <functional>
+#include <limits>
+#include <typeinfo>
 #include <variant>
 
 namespace ast {
 
 using Statement = runtime::Executable;
+using StatementList = std::vector<Ptr<Statement>>;
+
+// Слот фрейма, назначенный переменной при разборе. Узлы без слота работают с Closure
+constexpr uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
 
 template <typename T>
 class ValueStatement : public Statement {
@@ -21,6 +30,10 @@ public:
         return runtime::ObjectHolder::Share(value_);
     }
 
+    [[nodiscard]] const T& GetValue() const {
+        return value_;
+    }
+
 private:
     T value_;
 };
@@ -30,33 +43,75 @@ using StringConst = ValueStatement<runtime::String>;
 using BoolConst = ValueStatement<runtime::Bool>;
 
 class VariableValue : public Statement {
-    std::vector<std::string> dotted_ids_;
+    std::vector<runtime::Symbol> dotted_ids_;
+    uint32_t slot_ = NO_SLOT;
+    // Кеш поля для каждого имени после первого
+    mutable std::vector<runtime::FieldCache> field_caches_;
 
 public:
-    explicit VariableValue(const std::string& var_name);
-    explicit VariableValue(std::vector<std::string> dotted_ids);
+    explicit VariableValue(runtime::Symbol var_name);
+    explicit VariableValue(std::vector<runtime::Symbol> dotted_ids, uint32_t slot = NO_SLOT);
+    explicit VariableValue(const std::vector<std::string>& dotted_ids);
+
+    // Значение по пути из точек. Области видимости и поля объектов не копируются: ссылка ведёт
+    // прямо в Closure, фрейм или поля последнего объекта и действительна до их изменения
+    [[nodiscard]] const runtime::ObjectHolder& Lookup(runtime::Closure& closure, runtime::Context& context) const;
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const std::vector<runtime::Symbol>& GetDottedIds() const {
+        return dotted_ids_;
+    }
+
+    [[nodiscard]] uint32_t GetSlot() const {
+        return slot_;
+    }
 };
 
 class Assignment : public Statement {
-    std::string name_;
-    std::unique_ptr<Statement> rvalue_;
+    runtime::Symbol name_;
+    uint32_t slot_;
+    Ptr<Statement> rvalue_;
 public:
-    Assignment(std::string var, std::unique_ptr<Statement> rv);
+    Assignment(runtime::Symbol var, Ptr<Statement> rv, uint32_t slot = NO_SLOT);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] runtime::Symbol GetName() const {
+        return name_;
+    }
+
+    [[nodiscard]] uint32_t GetSlot() const {
+        return slot_;
+    }
+
+    [[nodiscard]] const Statement& GetValue() const {
+        return *rvalue_;
+    }
 };
 
 class FieldAssignment : public Statement {
     VariableValue object_;
-    std::string field_name_;
-    std::unique_ptr<Statement> rvalue_;
+    runtime::Symbol field_name_;
+    Ptr<Statement> rvalue_;
+    runtime::FieldCache cache_;
 
 public:
-    FieldAssignment(VariableValue object, std::string field_name, std::unique_ptr<Statement> rv);
+    FieldAssignment(VariableValue object, runtime::Symbol field_name, Ptr<Statement> rv);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const VariableValue& GetObject() const {
+        return object_;
+    }
+
+    [[nodiscard]] runtime::Symbol GetFieldName() const {
+        return field_name_;
+    }
+
+    [[nodiscard]] const Statement& GetValue() const {
+        return *rvalue_;
+    }
 };
 
 class None : public Statement {
@@ -69,48 +124,137 @@ public:
 
 class Print : public Statement {
 
-std::variant<std::string , std::vector<std::unique_ptr<Statement>>> args_;
+std::variant<runtime::Symbol, StatementList> args_;
 
 public:
 
-    explicit Print(std::unique_ptr<Statement> argument);
+    explicit Print(Ptr<Statement> argument);
+    explicit Print(StatementList args);
     explicit Print(std::vector<std::unique_ptr<Statement>> args);
 
-    static std::unique_ptr<Print> Variable(const std::string& name);
+    static std::unique_ptr<Print> Variable(runtime::Symbol name);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    // Имя переменной для Print::Variable, иначе nullptr
+    [[nodiscard]] const runtime::Symbol* GetVariable() const {
+        return std::get_if<runtime::Symbol>(&args_);
+    }
+
+    [[nodiscard]] const StatementList& GetArgs() const {
+        return std::get<StatementList>(args_);
+    }
+};
+
+// Встроенный кеш места вызова: классы получателей, которые здесь уже встречались, и найденные
+// у них методы. Повторный вызов на объекте того же класса не ищет метод по таблицам класса
+// и его родителей. Классов больше POLYMORPHIC_LIMIT — место мегаморфно, новые не запоминаются
+struct CallSiteStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+class CallSiteCache {
+public:
+    static constexpr size_t POLYMORPHIC_LIMIT = 4;
+
+    // Метод name класса cls или nullptr, если его нет
+    const runtime::Method* Lookup(const runtime::Class& cls, runtime::Symbol name);
+
+    [[nodiscard]] const CallSiteStats& GetStats() const {
+        return stats_;
+    }
+
+    [[nodiscard]] size_t GetSize() const {
+        return size_;
+    }
+
+    // Сумма по всем местам вызова во всех потоках
+    [[nodiscard]] static CallSiteStats GetTotals();
+    static void ResetTotals();
+
+private:
+    struct Entry {
+        const runtime::Class* cls = nullptr;
+        const runtime::Method* method = nullptr;
+    };
+
+    std::array<Entry, POLYMORPHIC_LIMIT> entries_;
+    uint8_t size_ = 0;
+    CallSiteStats stats_;
+    // Места вызова разных программ работают в разных потоках, поэтому общие счётчики атомарны
+    static std::atomic<uint64_t> total_hits_;
+    static std::atomic<uint64_t> total_misses_;
 };
 
 class MethodCall : public Statement {
-std::unique_ptr<Statement> object_;
-std::string method_;
-std::vector<std::unique_ptr<Statement>> args_;
+Ptr<Statement> object_;
+runtime::Symbol method_;
+StatementList args_;
+CallSiteCache cache_;
 
 public:
-    MethodCall(std::unique_ptr<Statement> object, std::string method,
-               std::vector<std::unique_ptr<Statement>> args);
+    MethodCall(Ptr<Statement> object, runtime::Symbol method,
+               StatementList args);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    // Вычисляет объект и аргументы и находит метод, но не вызывает его
+    runtime::Context::TailCall Prepare(runtime::Closure& closure, runtime::Context& context);
+
+    [[nodiscard]] const Statement& GetObject() const {
+        return *object_;
+    }
+
+    [[nodiscard]] runtime::Symbol GetMethod() const {
+        return method_;
+    }
+
+    [[nodiscard]] const StatementList& GetArgs() const {
+        return args_;
+    }
+
+    [[nodiscard]] const CallSiteCache& GetCache() const {
+        return cache_;
+    }
 };
 
 class NewInstance : public Statement {
 
 const runtime::Class& new_object_class_;
-std::vector<std::unique_ptr<Statement>> args_;
+StatementList args_;
+// Класс известен заранее, кеш __init__ всегда мономорфный
+CallSiteCache init_cache_;
 
 public:
     explicit NewInstance(const runtime::Class& class_);
-    NewInstance(const runtime::Class& class_, std::vector<std::unique_ptr<Statement>> args);
+    NewInstance(const runtime::Class& class_, StatementList args);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const runtime::Class& GetClass() const {
+        return new_object_class_;
+    }
+
+    [[nodiscard]] const StatementList& GetArgs() const {
+        return args_;
+    }
+
+    [[nodiscard]] const CallSiteCache& GetCache() const {
+        return init_cache_;
+    }
 };
 
 
 class UnaryOperation : public Statement {
 protected:
-std::unique_ptr<Statement> argument_;
+Ptr<Statement> argument_;
 public:
-    explicit UnaryOperation(std::unique_ptr<Statement> argument) : argument_(std::move(argument)) {
+    explicit UnaryOperation(Ptr<Statement> argument) : argument_(std::move(argument)) {
+    }
+
+    [[nodiscard]] const Statement& GetArgument() const {
+        return *argument_;
     }
 };
 
@@ -122,10 +266,18 @@ public:
 
 class BinaryOperation : public Statement {
 protected:
-std::unique_ptr<Statement> lhs_;
-std::unique_ptr<Statement> rhs_;
+Ptr<Statement> lhs_;
+Ptr<Statement> rhs_;
 public:
-    BinaryOperation(std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs) : lhs_(std::move(lhs)), rhs_(std::move(rhs)) {
+    BinaryOperation(Ptr<Statement> lhs, Ptr<Statement> rhs) : lhs_(std::move(lhs)), rhs_(std::move(rhs)) {
+    }
+
+    [[nodiscard]] const Statement& GetLhs() const {
+        return *lhs_;
+    }
+
+    [[nodiscard]] const Statement& GetRhs() const {
+        return *rhs_;
     }
 };
 
@@ -178,13 +330,19 @@ public:
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
 };
 
+class Negate : public UnaryOperation {
+public:
+    using UnaryOperation::UnaryOperation;
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+};
+
 class Compound : public Statement {
 
-std::vector<std::unique_ptr<Statement>> statement_;
+StatementList statement_;
 
 public:
 
-    void AddStatement(std::unique_ptr<Statement> stmt) {
+    void AddStatement(Ptr<Statement> stmt) {
         statement_.emplace_back(std::move(stmt));
     }
 
@@ -194,64 +352,260 @@ public:
     }
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const StatementList& GetStatements() const {
+        return statement_;
+    }
 };
 
+// Узлы тел методов лежат в арене своего класса, а не программы: тело держит её, поэтому класс,
+// опубликованный в замыкании, переживает Program. Тело из арены класса её не держит
 class MethodBody : public Statement {
 
-std::unique_ptr<Statement> body_;
+std::shared_ptr<const Arena> arena_;
+Ptr<Statement> body_;
 
 public:
-    explicit MethodBody(std::unique_ptr<Statement>&& body);
+    explicit MethodBody(Ptr<Statement> body, std::shared_ptr<const Arena> arena = nullptr);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const Statement& GetBody() const {
+        return *body_;
+    }
+
+    // Арена класса, которой владеет тело, или nullptr
+    [[nodiscard]] const Arena* GetArena() const {
+        return arena_.get();
+    }
 };
 
+// Тело метода, которое разбирается при первом вызове. До него хранится только функция
+// разбора; синтаксические ошибки в теле проявляются при первом вызове метода.
+// Разобранное тело кладётся в арену класса, которой владеют тела его методов
+class LazyMethodBody : public Statement {
+
+std::shared_ptr<Arena> arena_;
+std::function<MethodBody*(Arena&)> parse_;
+MethodBody* body_ = nullptr;
+
+public:
+    LazyMethodBody(std::function<MethodBody*(Arena&)> parse, std::shared_ptr<Arena> arena);
+
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    // Разбирает тело, если это ещё не сделано
+    MethodBody& GetBody();
+
+    [[nodiscard]] bool IsParsed() const {
+        return body_ != nullptr;
+    }
+
+    [[nodiscard]] const Arena& GetArena() const {
+        return *arena_;
+    }
+};
+
+// Взводит в контексте возврат со значением; Compound после этого не выполняет оставшиеся
+// инструкции, а значение забирает MethodBody. return вызова метода — хвостовой вызов:
+// он не выполняется здесь, а передаётся через контекст вызывающему ClassInstance::Call
 class Return : public Statement {
 
-std::unique_ptr<Statement> statement_;
+Ptr<Statement> statement_;
+MethodCall* tail_call_;
 
 public:
-    explicit Return(std::unique_ptr<Statement> statement) : statement_(std::move(statement)) {
+    explicit Return(Ptr<Statement> statement)
+        : statement_(std::move(statement)), tail_call_(dynamic_cast<MethodCall*>(&*statement_)) {
     }
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const Statement& GetStatement() const {
+        return *statement_;
+    }
+
+    [[nodiscard]] bool IsTailCall() const {
+        return tail_call_ != nullptr;
+    }
 };
 
 class ClassDefinition : public Statement {
 
 runtime::ObjectHolder class_;
+uint32_t slot_;
 
 public:
 
-    explicit ClassDefinition(runtime::ObjectHolder cls);
+    explicit ClassDefinition(runtime::ObjectHolder cls, uint32_t slot = NO_SLOT);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const runtime::ObjectHolder& GetClass() const {
+        return class_;
+    }
+
+    [[nodiscard]] uint32_t GetSlot() const {
+        return slot_;
+    }
 };
 
 class IfElse : public Statement {
 
-std::unique_ptr<Statement> condition_;
-std::unique_ptr<Statement> if_body_;
-std::unique_ptr<Statement> else_body_;
+Ptr<Statement> condition_;
+Ptr<Statement> if_body_;
+Ptr<Statement> else_body_;
 
 public:
-    IfElse(std::unique_ptr<Statement> condition, std::unique_ptr<Statement> if_body,
-           std::unique_ptr<Statement> else_body);
+    IfElse(Ptr<Statement> condition, Ptr<Statement> if_body,
+           Ptr<Statement> else_body);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const Statement& GetCondition() const {
+        return *condition_;
+    }
+
+    [[nodiscard]] const Statement& GetIfBody() const {
+        return *if_body_;
+    }
+
+    // nullptr, если ветки else нет
+    [[nodiscard]] const Statement* GetElseBody() const {
+        return else_body_.Get();
+    }
 };
 
 class Comparison : public BinaryOperation {
-using Comparator = std::function<bool(const runtime::ObjectHolder&,
-                                        const runtime::ObjectHolder&, runtime::Context&)>;
+public:
+using Comparator = bool (*)(const runtime::ObjectHolder&, const runtime::ObjectHolder&,
+                            runtime::Context&);
 
+private:
 Comparator cmp_;
 
 public:
 
-    Comparison(Comparator cmp, std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs);
+    Comparison(Comparator cmp, Ptr<Statement> lhs, Ptr<Statement> rhs);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] Comparator GetComparator() const {
+        return cmp_;
+    }
 };
 
+enum class CompareOp : uint8_t { Equal, NotEqual, Less, Greater, LessOrEqual, GreaterOrEqual };
+
+// Сравнение с оператором, известным при разборе. Числа и строки сравниваются на месте,
+// остальные объекты — функцией runtime, которую возвращает GetComparator
+template <CompareOp OP>
+class Compare final : public Comparison {
+public:
+    Compare(Ptr<Statement> lhs, Ptr<Statement> rhs);
+
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    // Оператор для двух значений одного встроенного типа
+    template <typename T>
+    static bool Apply(const T& lhs, const T& rhs) {
+        if constexpr (OP == CompareOp::Equal)
+            return lhs == rhs;
+        else if constexpr (OP == CompareOp::NotEqual)
+            return lhs != rhs;
+        else if constexpr (OP == CompareOp::Less)
+            return lhs < rhs;
+        else if constexpr (OP == CompareOp::Greater)
+            return lhs > rhs;
+        else if constexpr (OP == CompareOp::LessOrEqual)
+            return lhs <= rhs;
+        else
+            return lhs >= rhs;
+    }
+};
+
+using Equal = Compare<CompareOp::Equal>;
+using NotEqual = Compare<CompareOp::NotEqual>;
+using Less = Compare<CompareOp::Less>;
+using Greater = Compare<CompareOp::Greater>;
+using LessOrEqual = Compare<CompareOp::LessOrEqual>;
+using GreaterOrEqual = Compare<CompareOp::GreaterOrEqual>;
+
+// Разобранная программа. Владеет ареной, из которой выделены узлы верхнего уровня,
+// и освобождает их целиком вместе с ней. Тела методов живут в аренах классов, поэтому
+// классы, записанные программой в Closure, можно вызывать и после её разрушения.
+// Глобальные переменные живут во фрейме по слотам; перед выполнением в него загружаются
+// значения из переданного Closure, после выполнения они записываются обратно
+class Program : public Statement {
+
+Arena arena_;
+Statement* body_ = nullptr;
+std::vector<runtime::Symbol> globals_;
+std::vector<runtime::ObjectHolder> classes_;
+
+public:
+    [[nodiscard]] Arena& GetArena();
+    [[nodiscard]] const Arena& GetArena() const;
+
+    void SetBody(Statement* body);
+    [[nodiscard]] const Statement& GetBody() const;
+
+    // Имена глобальных переменных в порядке слотов
+    void SetGlobals(std::vector<runtime::Symbol> globals);
+    [[nodiscard]] const std::vector<runtime::Symbol>& GetGlobals() const;
+
+    // Классы программы в порядке объявления: базовый класс всегда раньше наследника
+    void AddClass(runtime::ObjectHolder cls);
+    [[nodiscard]] const std::vector<runtime::ObjectHolder>& GetClasses() const;
+
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+};
+
+// Все конкретные типы узлов дерева
+#define MYTHON_AST_NODES(NODE) \
+    NODE(NumericConst)         \
+    NODE(StringConst)          \
+    NODE(BoolConst)            \
+    NODE(VariableValue)        \
+    NODE(Assignment)           \
+    NODE(FieldAssignment)      \
+    NODE(None)                 \
+    NODE(Print)                \
+    NODE(MethodCall)           \
+    NODE(NewInstance)          \
+    NODE(Stringify)            \
+    NODE(Add)                  \
+    NODE(Sub)                  \
+    NODE(Mult)                 \
+    NODE(Div)                  \
+    NODE(Or)                   \
+    NODE(And)                  \
+    NODE(Not)                  \
+    NODE(Negate)               \
+    NODE(Compound)             \
+    NODE(MethodBody)           \
+    NODE(Return)               \
+    NODE(ClassDefinition)      \
+    NODE(IfElse)               \
+    NODE(Comparison)           \
+    NODE(Equal)                \
+    NODE(NotEqual)             \
+    NODE(Less)                 \
+    NODE(Greater)              \
+    NODE(LessOrEqual)          \
+    NODE(GreaterOrEqual)
+
+// Вызывает visitor с узлом, приведённым к его конкретному типу. Узел не из MYTHON_AST_NODES
+// (например, тело метода, написанное на C++) передаётся как const Statement&
+template <typename Visitor>
+decltype(auto) VisitNode(const Statement& node, Visitor&& visitor) {
+    const std::type_info& type = typeid(node);
+#define MYTHON_VISIT_NODE(T) \
+    if (type == typeid(T))   \
+        return visitor(static_cast<const T&>(node));
+    MYTHON_AST_NODES(MYTHON_VISIT_NODE)
+#undef MYTHON_VISIT_NODE
+    return visitor(node);
+}
+
 }  // namespace ast
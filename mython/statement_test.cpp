@@ -308,6 +308,29 @@ void TestCompound() {
     ASSERT(context.output.str().empty());
 }
 
+void TestReturn() {
+    runtime::DummyContext context;
+
+    // if x: print 1; return 'early'  затем  print 2; return 'late'
+    auto body = make_unique<Compound>();
+    auto if_body = make_unique<Compound>();
+    if_body->AddStatement(make_unique<Print>(make_unique<NumericConst>(1)));
+    if_body->AddStatement(make_unique<Return>(make_unique<StringConst>("early"s)));
+    body->AddStatement(make_unique<IfElse>(make_unique<VariableValue>("x"s), std::move(if_body), nullptr));
+    body->AddStatement(make_unique<Print>(make_unique<NumericConst>(2)));
+    body->AddStatement(make_unique<Return>(make_unique<StringConst>("late"s)));
+    MethodBody method(std::move(body));
+
+    Closure closure = {{"x"s, ObjectHolder::Own(runtime::Bool(true))}};
+    ASSERT_OBJECT_VALUE_EQUAL(method.Execute(closure, context), "early"s);
+    ASSERT(!context.IsReturning());
+
+    closure["x"s] = ObjectHolder::Own(runtime::Bool(false));
+    ASSERT_OBJECT_VALUE_EQUAL(method.Execute(closure, context), "late"s);
+    ASSERT(!context.IsReturning());
+    ASSERT_EQUAL(context.output.str(), "1\n2\n"s);
+}
+
 void TestFields() {
     runtime::DummyContext context;
 
@@ -341,6 +364,12 @@ void TestFields() {
         inst.Call("add"s, {ObjectHolder::Own(runtime::Number(i))}, context);
     }
 
+    // Объекты, которые инициализировал один и тот же __init__, разделяют форму
+    runtime::ClassInstance other(cls);
+    other.Call("__init__"s, {}, context);
+    ASSERT_EQUAL(&other.Fields().GetShape(), &inst.Fields().GetShape());
+    ASSERT_EQUAL(other.Fields().size(), 1u);
+
 //    ASSERT(context.output.str().empty());
 }
 
@@ -453,6 +482,119 @@ void TestNot() {
     test_not(false);
 }
 
+void TestComparisonNodes() {
+    runtime::DummyContext context;
+    Closure closure;
+
+    auto check = [&](auto&& node, bool expected) {
+        const ObjectHolder result = node.Execute(closure, context);
+        // Результат — один из общих объектов True и False
+        ASSERT(result.Get() == runtime::Bool::Of(expected).Get());
+    };
+
+    check(Less(make_unique<NumericConst>(1), make_unique<NumericConst>(2)), true);
+    check(GreaterOrEqual(make_unique<NumericConst>(1), make_unique<NumericConst>(2)), false);
+    check(Equal(make_unique<StringConst>("a"s), make_unique<StringConst>("a"s)), true);
+    check(Greater(make_unique<StringConst>("b"s), make_unique<StringConst>("a"s)), true);
+    check(NotEqual(make_unique<BoolConst>(true), make_unique<BoolConst>(false)), true);
+    check(Equal(make_unique<None>(), make_unique<None>()), true);
+    ASSERT_THROWS(Less(make_unique<NumericConst>(1), make_unique<StringConst>("a"s)).Execute(closure, context),
+                  std::runtime_error);
+
+    // Для объектов классов вызывается __lt__
+    vector<runtime::Method> methods;
+    methods.push_back({"__lt__"s, {"other"s}, make_unique<BoolConst>(true)});
+    runtime::Class cls("AlwaysLess"s, std::move(methods), nullptr);
+    check(Less(make_unique<NewInstance>(cls), make_unique<NumericConst>(1)), true);
+    check(LessOrEqual(make_unique<NewInstance>(cls), make_unique<NumericConst>(1)), true);
+
+    ASSERT(Less(make_unique<NumericConst>(1), make_unique<NumericConst>(2)).GetComparator() == &runtime::Less);
+}
+
+void TestCallSiteCache() {
+    runtime::DummyContext context;
+
+    // Base.value и шесть наследников; Derived0 переопределяет value
+    vector<runtime::Method> base_methods;
+    base_methods.push_back({"value"s, {}, make_unique<NumericConst>(1)});
+    base_methods.push_back({"__init__"s, {}, make_unique<None>()});
+    runtime::Class base("Base"s, std::move(base_methods), nullptr);
+    vector<runtime::Method> override_methods;
+    override_methods.push_back({"value"s, {}, make_unique<NumericConst>(2)});
+    vector<unique_ptr<runtime::Class>> classes;
+    classes.push_back(make_unique<runtime::Class>("Derived0"s, std::move(override_methods), &base));
+    for (int i = 1; i < 6; ++i)
+        classes.push_back(make_unique<runtime::Class>("Derived"s + to_string(i), vector<runtime::Method>{}, &base));
+
+    MethodCall call(make_unique<VariableValue>("x"s), "value"s, {});
+    Closure closure;
+    for (int round = 0; round < 2; ++round) {
+        for (const auto& cls : classes) {
+            closure["x"s] = ObjectHolder::Own(runtime::ClassInstance(*cls));
+            ASSERT_OBJECT_VALUE_EQUAL(call.Execute(closure, context), cls == classes.front() ? 2 : 1);
+        }
+    }
+    // Запоминаются первые POLYMORPHIC_LIMIT классов, остальные ищутся каждый раз
+    const size_t limit = CallSiteCache::POLYMORPHIC_LIMIT;
+    ASSERT_EQUAL(call.GetCache().GetSize(), limit);
+    ASSERT_EQUAL(call.GetCache().GetStats().hits, limit);
+    ASSERT_EQUAL(call.GetCache().GetStats().misses, 2 * classes.size() - limit);
+
+    // Неизвестный метод не кешируется и по-прежнему приводит к ошибке
+    MethodCall missing(make_unique<VariableValue>("x"s), "missing"s, {});
+    ASSERT_THROWS(missing.Execute(closure, context), std::runtime_error);
+    ASSERT_THROWS(missing.Execute(closure, context), std::runtime_error);
+    ASSERT_EQUAL(missing.GetCache().GetSize(), 0u);
+
+    NewInstance make(*classes.back());
+    for (int i = 0; i < 3; ++i)
+        ASSERT(make.Execute(closure, context).TryAs<runtime::ClassInstance>() != nullptr);
+    ASSERT_EQUAL(make.GetCache().GetStats().hits, 2u);
+    ASSERT_EQUAL(make.GetCache().GetStats().misses, 1u);
+}
+
+void TestArena() {
+    struct Counted : Statement {
+        explicit Counted(int& destroyed)
+            : destroyed(destroyed) {
+        }
+        ~Counted() override {
+            ++destroyed;
+        }
+        ObjectHolder Execute(Closure& /*closure*/, runtime::Context& /*context*/) override {
+            return ObjectHolder::None();
+        }
+        int& destroyed;
+    };
+
+    runtime::DummyContext context;
+    int destroyed = 0;
+    {
+        Arena arena;
+        Closure closure;
+        auto* cpd = arena.Make<Compound>();
+        cpd->AddStatement(arena.Make<Assignment>("x"s, arena.Make<StringConst>("one"s)));
+        cpd->AddStatement(arena.Make<Counted>(destroyed));
+        cpd->AddStatement(make_unique<Counted>(destroyed));
+        for (int i = 0; i < 10000; ++i) {
+            arena.Make<Counted>(destroyed);
+        }
+
+        cpd->Execute(closure, context);
+        ASSERT_OBJECT_VALUE_EQUAL(closure.at("x"s), "one"s);
+        ASSERT(arena.BytesUsed() >= 10001 * sizeof(Counted));
+        ASSERT(arena.BytesUsed() <= arena.BytesReserved());
+        ASSERT_EQUAL(destroyed, 0);
+    }
+    ASSERT_EQUAL(destroyed, 10002);
+
+    Ptr<Statement> owned(make_unique<Counted>(destroyed));
+    Ptr<Statement> moved = std::move(owned);
+    ASSERT(!owned && moved);
+    moved = nullptr;
+    ASSERT_EQUAL(destroyed, 10003);
+}
+
 }  // namespace
 
 void RunUnitTests(TestRunner& tr) {
@@ -470,12 +612,16 @@ void RunUnitTests(TestRunner& tr) {
     RUN_TEST(tr, ast::TestSuccessfulClassInstanceAdd);
     RUN_TEST(tr, ast::TestClassInstanceAddWithoutMethod);
     RUN_TEST(tr, ast::TestCompound);
+    RUN_TEST(tr, ast::TestReturn);
+    RUN_TEST(tr, ast::TestArena);
     RUN_TEST(tr, ast::TestFields);
     RUN_TEST(tr, ast::TestBaseClass);
     RUN_TEST(tr, ast::TestInheritance);
     RUN_TEST(tr, ast::TestOr);
     RUN_TEST(tr, ast::TestAnd);
     RUN_TEST(tr, ast::TestNot);
+    RUN_TEST(tr, ast::TestComparisonNodes);
+    RUN_TEST(tr, ast::TestCallSiteCache);
 }
 
 }  // namespace ast
@@ -0,0 +1,86 @@
+#include "symbol.h"
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+
+using namespace std;
+
+namespace runtime {
+
+struct Symbol::Entry {
+    std::string name;
+    size_t hash;
+    uint32_t id;
+};
+
+namespace {
+
+class SymbolTable {
+public:
+    const Symbol::Entry* Intern(std::string_view name) {
+        const size_t hash = std::hash<std::string_view>{}(name);
+
+        // Повторяющиеся имена находятся в кеше потока без захвата общей блокировки
+        thread_local std::array<const Symbol::Entry*, 1024> recent{};
+        const Symbol::Entry*& cached = recent[hash % recent.size()];
+        if (cached != nullptr && cached->hash == hash && cached->name == name) {
+            return cached;
+        }
+
+        std::lock_guard guard(mutex_);
+        if (auto it = index_.find(name); it != index_.end()) {
+            return cached = it->second;
+        }
+        const auto id = static_cast<uint32_t>(entries_.size());
+        entries_.push_back({std::string(name), hash, id});
+        const auto& entry = entries_.back();
+        index_.emplace(entry.name, &entry);
+        return cached = &entry;
+    }
+
+    static SymbolTable& Instance() {
+        static SymbolTable table;
+        return table;
+    }
+
+private:
+    std::mutex mutex_;
+    // Элементы deque не перемещаются при добавлении, ключи индекса ссылаются на их имена
+    std::deque<Symbol::Entry> entries_;
+    std::unordered_map<std::string_view, const Symbol::Entry*> index_;
+};
+
+}  // namespace
+
+Symbol::Symbol() : Symbol(""sv) {
+}
+
+Symbol::Symbol(std::string_view name) : entry_(SymbolTable::Instance().Intern(name)) {
+}
+
+Symbol::Symbol(const std::string& name) : Symbol(std::string_view{name}) {
+}
+
+Symbol::Symbol(const char* name) : Symbol(std::string_view{name}) {
+}
+
+const std::string& Symbol::Name() const {
+    return entry_->name;
+}
+
+size_t Symbol::Hash() const {
+    return entry_->hash;
+}
+
+uint32_t Symbol::Id() const {
+    return entry_->id;
+}
+
+std::ostream& operator<<(std::ostream& os, Symbol symbol) {
+    return os << symbol.Name();
+}
+
+}  // namespace runtime
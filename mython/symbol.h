@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+
+namespace runtime {
+
+// Интернированный идентификатор. Одинаковые имена разделяют одну запись глобальной таблицы,
+// поэтому сравнение символов — сравнение указателей, а хеш вычислен заранее
+class Symbol {
+public:
+    Symbol();
+
+    Symbol(std::string_view name);    // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+    Symbol(const std::string& name);  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+    Symbol(const char* name);         // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+
+    [[nodiscard]] const std::string& Name() const;
+    [[nodiscard]] size_t Hash() const;
+    // Порядковый номер символа в таблице, плотный и начинающийся с нуля
+    [[nodiscard]] uint32_t Id() const;
+
+    friend bool operator==(Symbol lhs, Symbol rhs) {
+        return lhs.entry_ == rhs.entry_;
+    }
+
+    friend bool operator!=(Symbol lhs, Symbol rhs) {
+        return lhs.entry_ != rhs.entry_;
+    }
+
+    friend bool operator<(Symbol lhs, Symbol rhs) {
+        return lhs.Id() < rhs.Id();
+    }
+
+    struct Entry;
+
+private:
+    const Entry* entry_;
+};
+
+std::ostream& operator<<(std::ostream& os, Symbol symbol);
+
+}  // namespace runtime
+
+namespace std {
+template <>
+struct hash<runtime::Symbol> {
+    size_t operator()(runtime::Symbol symbol) const noexcept {
+        return symbol.Hash();
+    }
+};
+}  // namespace std